@@ -0,0 +1,28 @@
+#ifndef _AFFINITY_H
+#define _AFFINITY_H
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    /*
+     * A cpu spec is a comma separated list of CPUs, ranges and NUMA nodes,
+     * e.g. "0-7,16-23" or "node1". An empty or NULL spec means no pinning.
+     */
+
+    //the nth CPU of spec, counted round the set, -1 if spec has none.
+    int affinity_cpu(const char *spec, int nth);
+
+    //pin the calling thread to the nth CPU of spec, or to all of them if
+    //nth < 0. 0 if pinned or spec is empty, -1 on a bad spec or failure.
+    //threads created afterwards inherit the mask.
+    int affinity_pin(const char *spec, int nth);
+
+    //the NUMA node of a CPU, 0 if unknown.
+    int affinity_node(int cpu);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
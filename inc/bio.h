@@ -3,6 +3,7 @@
 
 #include "header.h"
 #include "linux_list.h"
+#include "atomic.h"
 
 #if defined(__cplusplus)
 extern "C" {
@@ -12,17 +13,37 @@ extern "C" {
 #define POSTED_HANDLE               0
 #define HANDLE_INOTIFY              1
 #define HANDLE_INOTIFY_THREADED     2
-#define BIO_NUM_OPS                 130
+#define HANDLE_SCAN                 130     //initial and posted directory scans
+#define BIO_SCAN_QUEUES             32
+#define BIO_NUM_OPS                 (HANDLE_SCAN + BIO_SCAN_QUEUES)
 
     typedef int (*bio_handle)(void *arg);
 
+    struct bio_job
+    {
+        bio_handle bh;
+        void *arg;
+        struct list_head list;
+        int embedded;       //owned by the caller, see bio_post_job
+        uint64_t queued;    //when it was queued, in microseconds
+    };
+
     extern int g_build_index_ok;
 
     /* Exported API */
-    int bio_init(void);
-    void bio_create_job(int type, bio_handle bh, void *arg);
+    int bio_init(int threads, int queue_limit, const char *cpus);
+    int bio_create_job(int type, bio_handle bh, void *arg);
+    void bio_post_job(int type, struct bio_job *job, bio_handle bh, void *arg);
+    int bio_try_create_job(int type, bio_handle bh, void *arg);
+    int bio_try_post_job(int type, struct bio_job *job, bio_handle bh, void *arg);
+    int bio_queue_full(int type);
+    void bio_wait_space(int type);
+    void bio_start_jobs();
+    void bio_wait_done(atomic_t *counter);
     unsigned long long bio_jobnum(int type);
+    void wait_for_bio_thread(int type);
     void wait_for_bio_threads();
+    void print_bio_stats();
 
     void add_mem(size_t size);
     void sub_mem(size_t size);
@@ -0,0 +1,163 @@
+#ifndef _BRLOCK_H
+#define _BRLOCK_H
+
+#include <pthread.h>
+#include <sched.h>
+
+/*
+ * Reader-writer lock for data read far more often than it is changed.
+ *
+ * Every reader thread counts itself on a slot of its own cache line, so
+ * readers never write a line another reader uses.  A writer raises the
+ * writer flag, then waits until every slot is back at zero; readers that
+ * see the flag step back and wait for it to drop.  Read sections must not
+ * nest, the inner one would wait for a writer waiting for the outer one.
+ *
+ * Both sides spin for BRLOCK_SPINS rounds and then sleep: readers on rcond
+ * until the writer is done, the writer on wcond until a reader leaving
+ * while the flag is up wakes it.  The flag and the counts are checked again
+ * under wait_lock before sleeping, so no wakeup is lost.
+ *
+ * The slots are padded to two lines instead of aligned, the lock sits in
+ * structures allocated with plain new.
+ */
+
+#define BRLOCK_SLOTS 64
+#define BRLOCK_SPINS 64
+
+typedef struct brlock_slot
+{
+    volatile long readers;
+    char pad[128 - sizeof(long)];
+} brlock_slot;
+
+typedef struct brlock
+{
+    brlock_slot slots[BRLOCK_SLOTS];
+    volatile int writer;
+    volatile unsigned int next_slot;
+    pthread_mutex_t wlock;      //one writer at a time
+    pthread_mutex_t wait_lock;  //for sleeping on rcond and wcond
+    pthread_cond_t rcond;       //readers waiting for the writer
+    pthread_cond_t wcond;       //the writer waiting for readers
+} brlock;
+
+static __thread int brlock_thread_slot = -1;
+
+static inline void brlock_init(brlock *l)
+{
+    int i;
+
+    for (i = 0; i < BRLOCK_SLOTS; i++)
+    {
+        l->slots[i].readers = 0;
+    }
+    l->writer = 0;
+    l->next_slot = 0;
+    pthread_mutex_init(&l->wlock, NULL);
+    pthread_mutex_init(&l->wait_lock, NULL);
+    pthread_cond_init(&l->rcond, NULL);
+    pthread_cond_init(&l->wcond, NULL);
+}
+
+static inline void brlock_destroy(brlock *l)
+{
+    pthread_mutex_destroy(&l->wlock);
+    pthread_mutex_destroy(&l->wait_lock);
+    pthread_cond_destroy(&l->rcond);
+    pthread_cond_destroy(&l->wcond);
+}
+
+static inline brlock_slot *brlock_my_slot(brlock *l)
+{
+    if (brlock_thread_slot < 0)
+    {
+        brlock_thread_slot = __sync_fetch_and_add(&l->next_slot, 1) % BRLOCK_SLOTS;
+    }
+    return &l->slots[brlock_thread_slot];
+}
+
+//a reader left while a writer waits for the slots to drain.
+static inline void brlock_wake_writer(brlock *l)
+{
+    pthread_mutex_lock(&l->wait_lock);
+    pthread_cond_signal(&l->wcond);
+    pthread_mutex_unlock(&l->wait_lock);
+}
+
+static inline void brlock_rdlock(brlock *l)
+{
+    brlock_slot *slot = brlock_my_slot(l);
+    int spins;
+
+    while (1)
+    {
+        __sync_fetch_and_add(&slot->readers, 1);
+        if (!l->writer)
+        {
+            return;
+        }
+        __sync_fetch_and_sub(&slot->readers, 1);
+        brlock_wake_writer(l);
+
+        for (spins = 0; l->writer && spins < BRLOCK_SPINS; spins++)
+        {
+            sched_yield();
+        }
+        if (l->writer)
+        {
+            pthread_mutex_lock(&l->wait_lock);
+            while (l->writer)
+            {
+                pthread_cond_wait(&l->rcond, &l->wait_lock);
+            }
+            pthread_mutex_unlock(&l->wait_lock);
+        }
+    }
+}
+
+static inline void brlock_rdunlock(brlock *l)
+{
+    __sync_fetch_and_sub(&brlock_my_slot(l)->readers, 1);
+    if (l->writer)
+    {
+        brlock_wake_writer(l);
+    }
+}
+
+static inline void brlock_wrlock(brlock *l)
+{
+    int i, spins;
+
+    pthread_mutex_lock(&l->wlock);
+    l->writer = 1;
+    __sync_synchronize();
+    for (i = 0; i < BRLOCK_SLOTS; i++)
+    {
+        for (spins = 0; l->slots[i].readers != 0 && spins < BRLOCK_SPINS; spins++)
+        {
+            sched_yield();
+        }
+        if (l->slots[i].readers != 0)
+        {
+            pthread_mutex_lock(&l->wait_lock);
+            while (l->slots[i].readers != 0)
+            {
+                pthread_cond_wait(&l->wcond, &l->wait_lock);
+            }
+            pthread_mutex_unlock(&l->wait_lock);
+        }
+    }
+}
+
+static inline void brlock_wrunlock(brlock *l)
+{
+    __sync_synchronize();
+    l->writer = 0;
+    pthread_mutex_lock(&l->wait_lock);
+    pthread_cond_broadcast(&l->rcond);
+    pthread_mutex_unlock(&l->wait_lock);
+    pthread_mutex_unlock(&l->wlock);
+}
+
+#endif
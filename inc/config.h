@@ -24,6 +24,24 @@ typedef struct config
     //check
     int  check_interval;
     int  check_one_folder_interval;
+
+    //inotify
+    char *notify_backend;       //inotify (default) or fanotify
+    int  coalesce_window_ms;    //0 disables per-path event coalescing
+    int  overflow_rescan_rate;  //dirs rescanned per second after a queue overflow
+    int  inotify_instances;     //inotify fds, each with its own reader thread
+
+    //bio
+    int  bio_threads;           //workers of the job pool, 0 for one per CPU
+    int  bio_queue_limit;       //events a queue holds before it is full, 0 for no limit
+    char *queue_full_policy;    //block (default), coalesce or dirty
+    int  delta_flush_ms;        //buffer the counter updates of parent dirs per thread, 0 disables it
+    int  lazy_rollup;           //count a file on its own dir only, sum the totals when read
+
+    //cpu affinity, cpu lists like "0-7,16" or "node1", unset to float
+    char *worker_cpus;          //bio worker i takes the ith cpu
+    char *reader_cpus;          //reader of inotify instance i takes the ith cpu
+    char *service_cpus;         //dump, db, check and rescan threads share them
 } config;
 
 extern config g_config;
@@ -0,0 +1,10 @@
+#ifndef _FANOTIFY_PROCESS_H
+#define _FANOTIFY_PROCESS_H
+
+#include "header.h"
+
+int fanotify_init_backend();
+int fanotify_watch_dir(const char *dir);
+void *fan_notify_process(void *arg);
+
+#endif
@@ -12,10 +12,28 @@
 #define EXIT_TIMEOUT 2
 #define CONFIG_FILE "/usr/local/etc/dircounter.conf"
 
+//event source, selected by notify_backend in the config file.
+#define NOTIFY_INOTIFY  0
+#define NOTIFY_FANOTIFY 1
+
+extern int g_notify_backend;
+
 int init_notify_fs(const char *fromfile);
 int add_notify_dir(const char *dir, int events, int level, char **exclude_list);
 
 int get_monitor_dir_from_config(const char *configfile, monitor_dirs *md);
 void do_self_test();
+void print_notify_stats();
+
+//used by the event readers to hand over the events of one read.
+struct notify_reader;
+notify_reader *alloc_notify_reader(int instance);
+void notify_reader_pin(notify_reader *r);
+int notify_reader_timeout(notify_reader *r);
+int notify_reader_begin(notify_reader *r);
+void notify_reader_event(notify_reader *r, char *file, int eventmask, uint32_t cookie, md_owner *owner);
+void notify_reader_overflow(notify_reader *r);
+int notify_reader_ignored(notify_reader *r, char *file);
+void notify_reader_end(notify_reader *r);
 
 #endif
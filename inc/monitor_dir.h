@@ -4,6 +4,7 @@
 #include "header.h"
 #include "headercxx.h"
 #include "kv.h"
+#include "brlock.h"
 #include <pcre.h>
 #include <string>
 #include <unordered_map>
@@ -16,20 +17,69 @@ typedef unordered_map <string, char> strCharhashMap;
 typedef unordered_map <string, int> strInthashMap;
 typedef unordered_map <string, vector<string> > strVectorhashMap;
 
+//an exclude name under a root, matched as "^root/(.*)name(.*)$".
 typedef struct exclude_dir
 {
     string dirpattern;
-    pcre *re;
+    pcre *re;               //only for names that are not plain strings
+    pcre_extra *extra;
 } edir;
 
+#define EXCLUDE_ROOT_SLOTS  (MAX_MONITOR_DIRS * 2)
+#define EXCLUDE_CACHE_SLOTS 4096
+#define EXCLUDE_CACHE_PATH  244     //fills a slot to 256 bytes
+
+struct exclude_root;
+struct exclude_automaton;
+
+//a path and its answer, seq is odd while the slot is written.
+typedef struct exclude_cache_slot
+{
+    volatile uint32_t seq;
+    uint32_t gen;
+    uint16_t len;
+    uint8_t excluded;
+    char path[EXCLUDE_CACHE_PATH];
+} exclude_cache_slot;
+
+/*
+    the plain names of all roots are compiled into one automaton, every root
+    keeps the ids of its names. both are immutable once published and
+    is_exclude_dir reads them without a lock; writers replace them under
+    ex_lock, bump gen, and keep the old ones until the array is freed.
+*/
 typedef struct exclude_dir_array
 {
-    vector<edir> vdirs;
-    strCharhashMap ex_dir_map;
+    strCharhashMap pattern_map;
     strVectorhashMap sub_dir_map;
     pthread_mutex_t ex_lock;
+
+    struct exclude_automaton *volatile automaton;
+    struct exclude_root *volatile roots[EXCLUDE_ROOT_SLOTS];
+    volatile unsigned char root_lens[MAX_PATH / 8];     //bitmap of root lengths
+    volatile uint32_t gen;
+    exclude_cache_slot *cache;  //answers for paths, valid while gen is unchanged
+
+    int root_num;
+    vector<string> literals;
+    strInthashMap literal_ids;
+    vector<struct exclude_automaton *> old_automata;
+    vector<struct exclude_root *> old_roots;
 } exclude_dir_array;
 
+//names of files ignored under a root, checked on the bare name of an event.
+typedef struct name_filter
+{
+    vector<string> names;       //whole names
+    vector<string> suffixes;    //from "*suffix"
+    vector<string> prefixes;    //from "prefix*"
+    vector<string> globs;       //any other pattern, fnmatch
+    vector<string> paths;       //patterns holding a '/', matched on the whole path
+    int check_last;             //names and suffixes only, last[] rejects early
+    unsigned char last[32];     //bitmap of the last bytes of names and suffixes
+} name_filter;
+
+//a copy of a monitored dir with its full path, as handed out by the registry.
 typedef struct monitor_dir
 {
     char dir_name[MAX_PATH];
@@ -42,14 +92,86 @@ typedef struct monitor_dir
     uint8_t is_counter_size; //optimize for speeding up
     fileinfo fi;
 } monitor_dir, *p_monitor_dir;
-typedef unordered_map <string, p_monitor_dir> strhashMap;
+
+//a monitored dir in the registry, its path is the trie node it hangs on.
+typedef struct md_record
+{
+    uint32_t node;
+    uint32_t file_status;
+    uint8_t directory_level;
+    uint8_t is_counter_size;
+    uint8_t trailing_slash;  //added as "path/", kept for the name in the dump
+    fileinfo fi;             //only changed by atomic adds, see update_fileinfo
+
+    //the nearest monitored dir above this one, valid while parent_gen is
+    //the generation of the registry. read and refreshed under md_lock.
+    struct md_record *parent;
+    volatile uint32_t parent_gen;
+} md_record;
+
+/*
+    the monitored dir owning the files of a directory: the dir itself or the
+    nearest monitored one above it. resolved once when an event is read and
+    carried with it; it is used only while gen is the registry generation.
+*/
+typedef struct md_owner
+{
+    md_record *rec;         //NULL if not resolved
+    uint32_t gen;
+    uint8_t is_counter_size;
+    uint8_t directory_level;
+} md_owner;
+
+#define MD_ROOT 0           //the node of "/"
+#define MD_NONE 0xffffffff
+
+//one path component, linked to its parent and its siblings by node id.
+typedef struct md_node
+{
+    uint32_t parent;
+    uint32_t name;          //id of the interned component
+    uint32_t child;         //first child
+    uint32_t next;
+    uint32_t prev;
+    md_record *rec;         //NULL on the way to monitored dirs below
+} md_node;
+
+/*
+    the paths of the monitored dirs as a trie of components. every distinct
+    component name is stored once, the nodes are a vector indexed by id and
+    edges maps parent id and name id to the child.
+*/
+typedef struct md_trie
+{
+    vector<md_node> nodes;
+    vector<uint32_t> free_nodes;
+    unordered_map <uint64_t, uint32_t> edges;
+
+    unordered_map <string, uint32_t> name_ids;
+    vector<const string *> names;   //the keys of name_ids
+    vector<uint32_t> name_refs;     //nodes using the name
+    vector<uint32_t> free_names;
+} md_trie;
+
+struct md_delta_buf;
 
 typedef struct monitor_dirs
 {
-    strhashMap md;
-    pthread_rwlock_t md_lock;
+    md_trie trie;
+    brlock md_lock;         //shared by lookups and counter updates, exclusive for add, del and move
     int md_mum;
+    volatile uint32_t gen;  //bumped by add, del and move, see monitor_parent
     exclude_dir_array ex_dirs;
+
+    //updates of the dirs above a file gather in per thread buffers and
+    //reach the counters every delta_flush_ms, 0 updates them directly.
+    int delta_flush_ms;
+    pthread_mutex_t delta_lock;
+    vector<struct md_delta_buf *> delta_bufs;
+
+    //with lazy_rollup set the counters of a dir only hold the files it owns,
+    //the totals are summed when they are read.
+    int lazy_rollup;
 } monitor_dirs;
 
 extern monitor_dirs *g_md;
@@ -58,30 +180,49 @@ extern pthread_mutex_t g_delete_dir_lock;
 extern strCharhashMap g_delete_dir;
 
 //for exclude dir
-int add_exclude_pattern(char *dirpattern , exclude_dir_array *ed);
+int add_exclude_pattern(char *root, const char *name, exclude_dir_array *ed);
 int is_exclude_dir(char *dir , exclude_dir_array *ed);
 
 int add_sub_exclude_dir(char *dir, char *subdir, exclude_dir_array *ed);
 int get_sub_exclude_dir(char *dir, exclude_dir_array *ed, vector<string> &vSubdirs);
 
+//for ignored file names
+int add_ignore_root(char *root, int index, vector<string> &vIgnores);
+int have_ignore_filters();
+name_filter *ignore_filter_of_root(int index);
+name_filter *find_ignore_filter(const char *path);
+int is_ignored_name(name_filter *nf, const char *name);
+int is_ignored_path(name_filter *nf, const char *path);
+
 //for monitor dir
 monitor_dirs *alloc_monitor_dirs();
 void free_monitor_dirs(monitor_dirs *md);
 
-int __find_monitor_dir(monitor_dirs *md, char *path, monitor_dir **target);
+int __find_monitor_dir(monitor_dirs *md, const char *path, md_record **target);
 int find_monitor_dir(monitor_dirs *md, char *path, monitor_dir *target);
+int find_monitor_dir_info(monitor_dirs *md, char *path, monitor_dir *target);
+int is_monitor_dir(monitor_dirs *md, char *path);
 int find_update_monitor_dir(monitor_dirs *md, char *path, fileinfo *delta, int type);
+int update_monitor_parents(monitor_dirs *md, char *path, fileinfo *delta, int type);
+int move_monitor_parents(monitor_dirs *md, char *from, char *to, fileinfo *delta);
+void flush_monitor_deltas(monitor_dirs *md);
+int resolve_monitor_owner(monitor_dirs *md, const char *dir, md_owner *owner);
+int monitor_owner_current(monitor_dirs *md, const md_owner *owner);
+int update_monitor_owner(monitor_dirs *md, md_owner *owner, char *path, fileinfo *delta, int type);
 int find_monitor_file_type(monitor_dirs *md, const char *path);
 int find_monitor_file_level(monitor_dirs *md, const char *path, int level);
 
 int del_monitor_dir(monitor_dirs *md, char *path);
 int add_monitor_dir(monitor_dirs *md, char *path, int &level, int is_counter_size);
+int get_monitor_subdirs(monitor_dirs *md, char *path, vector<string> &vDirs);
+int move_monitor_dir(monitor_dirs *md, char *path, char *newpath, vector<string> &vNewdirs);
 
 int del_monitor_dir_inotify(monitor_dirs *md, char *path);
 int add_monitor_dir_inotify(monitor_dirs *md, char *path, int level, int is_counter_size, int f);
 
 int del_dir_inotify(char *path);
-int add_dir_inotify(monitor_dirs *md, char *path, int level);
+int add_dir_inotify(monitor_dirs *md, char *path, int level, int is_counter_size);
+int notify_events(int is_counter_size);
 
 void print_directory_sort(monitor_dirs *md);
 
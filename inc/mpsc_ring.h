@@ -0,0 +1,125 @@
+#ifndef _MPSC_RING_H
+#define _MPSC_RING_H
+
+#include <stdlib.h>
+
+/*
+ * Bounded multi-producer single-consumer ring of pointers.
+ *
+ * Every slot carries a sequence number saying whose turn it is: in lap n
+ * a producer may fill slot i when seq == i + n * size, and the consumer may
+ * take it when seq == i + n * size + 1.  Producers claim a position with a
+ * single compare-and-swap on tail, the consumer owns head and only writes
+ * the slots it gives back.  A slot claimed but not filled yet reads as
+ * empty, the producer filling it has to wake the consumer as usual.
+ */
+
+#if defined(__i386__) || defined(__x86_64__)
+/* stores are not reordered with stores nor loads with loads on x86 */
+#define mpsc_barrier()  __asm__ __volatile__("" ::: "memory")
+#else
+#define mpsc_barrier()  __sync_synchronize()
+#endif
+
+typedef struct mpsc_slot
+{
+    volatile unsigned long seq;
+    void *data;
+} mpsc_slot;
+
+typedef struct mpsc_ring
+{
+    mpsc_slot *slots;
+    unsigned long mask;
+    volatile unsigned long tail __attribute__((aligned(64)));  /* producers */
+    unsigned long head __attribute__((aligned(64)));           /* consumer */
+} mpsc_ring;
+
+/* size must be a power of two */
+static inline int mpsc_ring_init(mpsc_ring *ring, unsigned long size)
+{
+    unsigned long i;
+
+    if (size == 0 || (size & (size - 1)) != 0)
+    {
+        return -1;
+    }
+
+    ring->slots = (mpsc_slot *)calloc(size, sizeof(mpsc_slot));
+    if (ring->slots == NULL)
+    {
+        return -1;
+    }
+    for (i = 0; i < size; i++)
+    {
+        ring->slots[i].seq = i;
+    }
+    ring->mask = size - 1;
+    ring->tail = 0;
+    ring->head = 0;
+    return 0;
+}
+
+static inline void mpsc_ring_destroy(mpsc_ring *ring)
+{
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+/* any thread, returns -1 if the ring is full */
+static inline int mpsc_ring_push(mpsc_ring *ring, void *data)
+{
+    unsigned long pos = ring->tail;
+    mpsc_slot *slot = NULL;
+    long diff = 0;
+
+    while (1)
+    {
+        slot = &ring->slots[pos & ring->mask];
+        diff = (long)(slot->seq - pos);
+        if (diff == 0)
+        {
+            if (__sync_bool_compare_and_swap(&ring->tail, pos, pos + 1))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return -1;
+        }
+        pos = ring->tail;
+    }
+
+    slot->data = data;
+    mpsc_barrier();
+    slot->seq = pos + 1;
+    return 0;
+}
+
+/* consumer only, returns NULL if the ring is empty */
+static inline void *mpsc_ring_pop(mpsc_ring *ring)
+{
+    mpsc_slot *slot = &ring->slots[ring->head & ring->mask];
+    void *data = NULL;
+
+    if ((long)(slot->seq - (ring->head + 1)) < 0)
+    {
+        return NULL;
+    }
+    mpsc_barrier();
+    data = slot->data;
+    mpsc_barrier();
+    slot->seq = ring->head + ring->mask + 1;
+    ring->head++;
+    return data;
+}
+
+/* consumer only */
+static inline int mpsc_ring_empty(mpsc_ring *ring)
+{
+    mpsc_slot *slot = &ring->slots[ring->head & ring->mask];
+    return (long)(slot->seq - (ring->head + 1)) < 0;
+}
+
+#endif
@@ -19,6 +19,7 @@ int get_parent_dir(char *buf, char *parent);
 int get_tmpfile(char *dir, char *file);
 void my_sleep(int sec);
 void my_usleep(int usec);
+uint64_t get_mstime();
 int make_dir(const char *path, mode_t iFlag);
 int make_dir_recusive(char *path, mode_t iFlag);
 int delstr(char *str, const char *delchs);
@@ -8,6 +8,8 @@ extern "C"
 
 #include <stdio.h>
 
+#define INOTIFYTOOLS_MAX_INSTANCES 16
+
     int inotifytools_str_to_event(char const *event);
     int inotifytools_str_to_event_sep(char const *event, char sep);
     char *inotifytools_event_to_str(int events);
@@ -18,6 +20,8 @@ extern "C"
     void inotifytools_replace_filename(char const *oldname,
                                        char const *newname);
     char *inotifytools_filename_from_wd(int wd);
+    int inotifytools_copy_filename_from_wd(int instance, int wd, char *buf, int size);
+    int inotifytools_root_from_wd(int instance, int wd);
     int inotifytools_wd_from_filename(char const *filename);
     void inotifytools_remove_filename_prefix(char const *filename);
     int inotifytools_remove_watch_by_filename(char const *filename);
@@ -36,6 +40,8 @@ extern "C"
     int inotifytools_ignore_events_by_regex(char const *pattern, int flags);
     struct inotify_event *inotifytools_next_event(int timeout);
     struct inotify_event *inotifytools_next_events(int timeout, int num_events);
+    struct inotify_event *inotifytools_next_batch(int timeout, int *bytes);
+    struct inotify_event *inotifytools_next_batch_instance(int instance, int timeout, int *bytes);
     int inotifytools_error();
     int inotifytools_get_stat_by_wd(int wd, int event);
     int inotifytools_get_stat_total(int event);
@@ -43,6 +49,10 @@ extern "C"
                                           int event);
     void inotifytools_initialize_stats();
     int inotifytools_initialize();
+    int inotifytools_initialize_instances(int num);
+    int inotifytools_get_num_instances();
+    int inotifytools_assign_root(char const *root, int instance);
+    int inotifytools_root_index(char const *root);
     void inotifytools_cleanup();
     int inotifytools_get_num_watches();
 
@@ -54,6 +64,17 @@ extern "C"
     void inotifytools_set_printf_timefmt(char *fmt);
 
     int inotifytools_get_max_user_watches();
+
+    typedef struct inotifytools_batch_stats
+    {
+        unsigned long long batches;     //successful batched reads
+        unsigned long long events;      //events returned by those reads
+        unsigned long long syscalls;    //poll + ioctl + read calls issued
+        unsigned long long max_batch;   //largest number of events in one read
+    } inotifytools_batch_stats;
+
+    void inotifytools_get_batch_stats(inotifytools_batch_stats *stats);
+    void inotifytools_get_batch_stats_instance(int instance, inotifytools_batch_stats *stats);
     int inotifytools_get_max_user_instances();
     int inotifytools_get_max_queued_events();
 
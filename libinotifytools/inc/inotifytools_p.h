@@ -5,10 +5,8 @@
 
 struct rbtree *inotifytools_wd_sorted_by_event(int sort_event);
 
-typedef struct watch
+typedef struct watch_stats
 {
-    char *filename;
-    int wd;
     unsigned hit_access;
     unsigned hit_modify;
     unsigned hit_attrib;
@@ -23,6 +21,16 @@ typedef struct watch
     unsigned hit_unmount;
     unsigned hit_move_self;
     unsigned hit_total;
+} watch_stats;
+
+typedef struct watch
+{
+    char *filename;
+    int filename_len;
+    int wd;
+    watch_stats *stats;     // only allocated once stats are collected
+    int root;               // index of the assigned root holding it, -1 if none
+    int mask;               // events asked for so far, without IN_MASK_ADD
 } watch;
 
 #endif
@@ -38,6 +38,9 @@
 #include <time.h>
 #include <regex.h>
 #include <setjmp.h>
+#include <poll.h>
+#include <limits.h>
+#include <pthread.h>
 
 #define my_free(x) do{\
         if(x) \
@@ -140,7 +143,6 @@
 #define QUEUE_SIZE_PATH   INOTIFY_PROCDIR "max_queued_watches"
 #define INSTANCES_PATH    INOTIFY_PROCDIR "max_user_instances"
 
-static int inotify_fd;
 static unsigned  num_access;
 static unsigned  num_modify;
 static unsigned  num_attrib;
@@ -157,15 +159,48 @@ static unsigned  num_unmount;
 static unsigned  num_total;
 static int collect_stats = 0;
 
-struct rbtree *tree_wd = 0;
-struct rbtree *tree_filename = 0;
-static int error = 0;
+/*
+ * Each instance is one inotify fd with its own watch tables.  Watches are
+ * placed on an instance by the root assigned with inotifytools_assign_root(),
+ * so several readers can drain their queues in parallel.  The recursive lock
+ * guards the wd table and the filename tree of the instance.
+ *
+ * Watch descriptors are small integers handed out densely by the kernel, so
+ * watches are looked up by wd in a flat table indexed by the wd.
+ */
+typedef struct inotify_instance
+{
+    int fd;
+    watch **wd_table;
+    int wd_table_size;
+    int num_watches;
+    struct rbtree *tree_filename;
+    pthread_mutex_t lock;
+    char *batch_buf;
+    size_t batch_buf_size;
+    inotifytools_batch_stats batch_stats;
+} inotify_instance;
+
+typedef struct instance_root
+{
+    char *path;
+    int len;
+    int instance;
+} instance_root;
+
+static inotify_instance instances[INOTIFYTOOLS_MAX_INSTANCES];
+static int num_instances = 0;
+static instance_root *roots = 0;
+static int num_roots = 0;
+static pthread_mutex_t roots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread int error = 0;
 static int init = 0;
 static char *timefmt = 0;
 static regex_t *regex = 0;
 
 int isdir(char const *path);
-void record_stats(struct inotify_event const *event);
+void record_stats(inotify_instance *in, struct inotify_event const *event);
 int onestr_to_event(char const *event);
 
 /**
@@ -266,42 +301,203 @@ int read_num_from_file(char *filename, int *num)
     return 1;
 }
 
-int wd_compare(const void *d1, const void *d2, const void *config)
+int filename_compare(const void *d1, const void *d2, const void *config)
 {
     if (!d1 || !d2)
     {
         return (char *)d1 - (char *)d2;
     }
-    return ((watch *)d1)->wd - ((watch *)d2)->wd;
+    return strcmp(((watch *)d1)->filename, ((watch *)d2)->filename);
 }
 
-int filename_compare(const void *d1, const void *d2, const void *config)
+/**
+ * @internal
+ */
+watch *watch_from_wd(inotify_instance *in, int wd)
 {
-    if (!d1 || !d2)
+    if (wd <= 0 || wd >= in->wd_table_size)
     {
-        return (char *)d1 - (char *)d2;
+        return 0;
     }
-    return strcmp(((watch *)d1)->filename, ((watch *)d2)->filename);
+    return in->wd_table[wd];
 }
 
 /**
  * @internal
+ * Store @a w under @a wd, or clear the slot when @a w is 0.
  */
-watch *watch_from_wd(int wd)
+int wd_table_set(inotify_instance *in, int wd, watch *w)
 {
-    watch w;
-    w.wd = wd;
-    return (watch *)rbfind(&w, tree_wd);
+    if (wd <= 0)
+    {
+        return 0;
+    }
+
+    if (wd >= in->wd_table_size)
+    {
+        if (!w)
+        {
+            return 1;
+        }
+
+        int size = in->wd_table_size ? in->wd_table_size : 1024;
+        while (size <= wd)
+        {
+            size *= 2;
+        }
+        watch **tmp = (watch **)realloc(in->wd_table, size * sizeof(watch *));
+        if (!tmp)
+        {
+            error = ENOMEM;
+            return 0;
+        }
+        memset(tmp + in->wd_table_size, 0,
+               (size - in->wd_table_size) * sizeof(watch *));
+        in->wd_table = tmp;
+        in->wd_table_size = size;
+    }
+
+    if (in->wd_table[wd] && !w)
+    {
+        in->num_watches--;
+    }
+    else if (!in->wd_table[wd] && w)
+    {
+        in->num_watches++;
+    }
+    in->wd_table[wd] = w;
+    return 1;
+}
+
+/**
+ * @internal
+ * Give @a w the new name @a name, which the watch takes ownership of.
+ */
+void set_watch_filename(watch *w, char *name)
+{
+    if (w->filename)
+    {
+        free(w->filename);
+    }
+    w->filename = name;
+    w->filename_len = name ? strlen(name) : 0;
 }
 
 /**
  * @internal
  */
-watch *watch_from_filename(char const *filename)
+watch *watch_from_filename(inotify_instance *in, char const *filename)
 {
     watch w;
     w.filename = (char *)filename;
-    return (watch *)rbfind(&w, tree_filename);
+    return (watch *)rbfind(&w, in->tree_filename);
+}
+
+/**
+ * @internal
+ * Index of the longest assigned root which is a prefix of @a path, -1 if
+ * there is none.  Must be called with roots_lock held.
+ */
+static int root_for_path(char const *path)
+{
+    int i, best = -1, best_len = -1;
+    int len = strlen(path);
+
+    for (i = 0; i < num_roots; i++)
+    {
+        instance_root *r = &roots[i];
+        if (r->len > len || r->len <= best_len
+            || strncmp(r->path, path, r->len) != 0)
+        {
+            continue;
+        }
+        if (r->len < len && path[r->len] != '/' && r->path[r->len - 1] != '/')
+        {
+            continue;
+        }
+        best = i;
+        best_len = r->len;
+    }
+
+    return best;
+}
+
+/**
+ * @internal
+ * Instance owning the longest assigned root which is a prefix of @a path,
+ * instance 0 if there is none.
+ */
+inotify_instance *instance_for_path(char const *path)
+{
+    int root, instance = 0;
+
+    pthread_mutex_lock(&roots_lock);
+    root = root_for_path(path);
+    if (root >= 0)
+    {
+        instance = roots[root].instance;
+    }
+    pthread_mutex_unlock(&roots_lock);
+
+    return &instances[instance];
+}
+
+/**
+ * @internal
+ * Index of the assigned root holding @a path, see inotifytools_root_index().
+ */
+static int root_index_of_path(char const *path)
+{
+    int root;
+
+    pthread_mutex_lock(&roots_lock);
+    root = root_for_path(path);
+    pthread_mutex_unlock(&roots_lock);
+
+    return root;
+}
+
+/**
+ * @internal
+ * Find the watch for @a filename in whichever instance holds it.  A directory
+ * moved across roots keeps its watch on the instance it was created on, so
+ * the instance of the path is tried first and then all the others.  The
+ * instance is returned locked in @a owner when the watch is found.
+ */
+watch *locked_watch_from_filename(char const *filename, inotify_instance **owner)
+{
+    inotify_instance *first = instance_for_path(filename);
+    watch *w = 0;
+    int i;
+
+    pthread_mutex_lock(&first->lock);
+    w = watch_from_filename(first, filename);
+    if (w)
+    {
+        *owner = first;
+        return w;
+    }
+    pthread_mutex_unlock(&first->lock);
+
+    for (i = 0; i < num_instances; i++)
+    {
+        inotify_instance *in = &instances[i];
+        if (in == first)
+        {
+            continue;
+        }
+        pthread_mutex_lock(&in->lock);
+        w = watch_from_filename(in, filename);
+        if (w)
+        {
+            *owner = in;
+            return w;
+        }
+        pthread_mutex_unlock(&in->lock);
+    }
+
+    *owner = 0;
+    return 0;
 }
 
 /**
@@ -315,54 +511,194 @@ watch *watch_from_filename(char const *filename)
  */
 int inotifytools_initialize()
 {
+    return inotifytools_initialize_instances(1);
+}
+
+/**
+ * Initialise several inotify instances.
+ *
+ * Each instance has its own kernel queue and watch tables.  Roots are spread
+ * over the instances with inotifytools_assign_root(), and each instance is
+ * read with inotifytools_next_batch_instance().  The functions without an
+ * instance argument which take a watch descriptor use instance 0.
+ *
+ * @param num number of instances, between 1 and INOTIFYTOOLS_MAX_INSTANCES.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().
+ */
+int inotifytools_initialize_instances(int num)
+{
+    pthread_mutexattr_t attr;
+    int i;
+
     if (init)
     {
         return 1;
     }
 
+    if (num < 1)
+    {
+        num = 1;
+    }
+    if (num > INOTIFYTOOLS_MAX_INSTANCES)
+    {
+        num = INOTIFYTOOLS_MAX_INSTANCES;
+    }
+
     error = 0;
-    // Try to initialise inotify
-    inotify_fd = inotify_init();
-    if (inotify_fd < 0)
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+
+    for (i = 0; i < num; i++)
     {
-        error = inotify_fd;
-        return 0;
+        inotify_instance *in = &instances[i];
+        memset(in, 0, sizeof(*in));
+
+        // Try to initialise inotify
+        in->fd = inotify_init();
+        if (in->fd < 0)
+        {
+            error = errno;
+            while (--i >= 0)
+            {
+                close(instances[i].fd);
+                rbdestroy(instances[i].tree_filename);
+                pthread_mutex_destroy(&instances[i].lock);
+            }
+            pthread_mutexattr_destroy(&attr);
+            return 0;
+        }
+
+        in->tree_filename = rbinit(filename_compare, 0);
+        pthread_mutex_init(&in->lock, &attr);
     }
+    pthread_mutexattr_destroy(&attr);
 
+    num_instances = num;
     collect_stats = 0;
     init = 1;
-    tree_wd = rbinit(wd_compare, 0);
-    tree_filename = rbinit(filename_compare, 0);
     timefmt = 0;
 
     return 1;
 }
 
 /**
- * @internal
+ * Get the number of inotify instances set up by inotifytools_initialize().
  */
-void destroy_watch(watch *w)
+int inotifytools_get_num_instances()
 {
-    if (w->filename)
+    return num_instances;
+}
+
+/**
+ * Assign the watches of a directory tree to an instance.
+ *
+ * Watches added later for @a root or any path below it go to that instance,
+ * unless a longer assigned root matches.  Assigning a root twice keeps the
+ * first assignment.
+ *
+ * @param root directory, with or without a trailing '/'.
+ *
+ * @param instance instance to use, or -1 to spread roots round robin.
+ *
+ * @return the instance the root is assigned to, or -1 on failure.
+ */
+int inotifytools_assign_root(char const *root, int instance)
+{
+    niceassert(init, "inotifytools_initialize not called yet");
+
+    int i, len = strlen(root);
+    instance_root *tmp = 0;
+
+    // keep "/" but drop the trailing '/' of any other root
+    if (len > 1 && root[len - 1] == '/')
     {
-        free(w->filename);
+        len--;
     }
-    free(w);
+
+    pthread_mutex_lock(&roots_lock);
+    for (i = 0; i < num_roots; i++)
+    {
+        if (roots[i].len == len && strncmp(roots[i].path, root, len) == 0)
+        {
+            instance = roots[i].instance;
+            pthread_mutex_unlock(&roots_lock);
+            return instance;
+        }
+    }
+
+    if (instance < 0 || instance >= num_instances)
+    {
+        instance = num_roots % num_instances;
+    }
+
+    tmp = (instance_root *)realloc(roots, (num_roots + 1) * sizeof(instance_root));
+    if (!tmp)
+    {
+        pthread_mutex_unlock(&roots_lock);
+        error = ENOMEM;
+        return -1;
+    }
+    roots = tmp;
+    roots[num_roots].path = strndup(root, len);
+    roots[num_roots].len = len;
+    roots[num_roots].instance = instance;
+    num_roots++;
+    pthread_mutex_unlock(&roots_lock);
+
+    return instance;
+}
+
+/**
+ * Get the index of an assigned root.
+ *
+ * Roots are numbered in the order they were first assigned, and the index
+ * of a root never changes.
+ *
+ * @param root directory given to inotifytools_assign_root().
+ *
+ * @return index of the root, or -1 if it was never assigned.
+ */
+int inotifytools_root_index(char const *root)
+{
+    niceassert(init, "inotifytools_initialize not called yet");
+
+    int i, index = -1, len = strlen(root);
+
+    if (len > 1 && root[len - 1] == '/')
+    {
+        len--;
+    }
+
+    pthread_mutex_lock(&roots_lock);
+    for (i = 0; i < num_roots; i++)
+    {
+        if (roots[i].len == len && strncmp(roots[i].path, root, len) == 0)
+        {
+            index = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&roots_lock);
+
+    return index;
 }
 
 /**
  * @internal
  */
-void cleanup_tree(const void *nodep,
-                  const VISIT which,
-                  const int depth, void *arg)
+void destroy_watch(watch *w)
 {
-    if (which != endorder && which != leaf)
+    if (w->filename)
     {
-        return;
+        free(w->filename);
     }
-    watch *w = (watch *)nodep;
-    destroy_watch(w);
+    if (w->stats)
+    {
+        free(w->stats);
+    }
+    free(w);
 }
 
 /**
@@ -379,7 +715,6 @@ void inotifytools_cleanup()
     }
 
     init = 0;
-    close(inotify_fd);
     collect_stats = 0;
     error = 0;
     timefmt = 0;
@@ -391,86 +726,162 @@ void inotifytools_cleanup()
         regex = 0;
     }
 
-    rbwalk(tree_wd, cleanup_tree, 0);
-    rbdestroy(tree_wd);
-    tree_wd = 0;
-    rbdestroy(tree_filename);
-    tree_filename = 0;
+    int i;
+    for (i = 0; i < num_instances; i++)
+    {
+        inotify_instance *in = &instances[i];
+        close(in->fd);
+        my_free(in->batch_buf);
+        in->batch_buf_size = 0;
+
+        int wd;
+        for (wd = 0; wd < in->wd_table_size; wd++)
+        {
+            if (in->wd_table[wd])
+            {
+                destroy_watch(in->wd_table[wd]);
+            }
+        }
+        my_free(in->wd_table);
+        in->wd_table_size = 0;
+        in->num_watches = 0;
+        rbdestroy(in->tree_filename);
+        in->tree_filename = 0;
+        pthread_mutex_destroy(&in->lock);
+    }
+    num_instances = 0;
+
+    for (i = 0; i < num_roots; i++)
+    {
+        free(roots[i].path);
+    }
+    my_free(roots);
+    num_roots = 0;
 }
 
 /**
  * @internal
+ * Allocate or reset the per-watch statistics of every watch of an instance.
  */
-void empty_stats(const void *nodep,
-                 const VISIT which,
-                 const int depth, void *arg)
+void empty_stats(inotify_instance *in)
 {
-    if (which != endorder && which != leaf)
+    int wd;
+    for (wd = 0; wd < in->wd_table_size; wd++)
     {
-        return;
+        watch *w = in->wd_table[wd];
+        if (!w)
+        {
+            continue;
+        }
+        if (w->stats)
+        {
+            memset(w->stats, 0, sizeof(watch_stats));
+        }
+        else
+        {
+            w->stats = (watch_stats *)calloc(1, sizeof(watch_stats));
+        }
+    }
+}
+
+/**
+ * @internal
+ * Watches of @a path and of everything below it.
+ */
+typedef struct watch_list
+{
+    watch **watches;
+    int used;
+    int size;
+} watch_list;
+
+/**
+ * @internal
+ */
+int watch_list_add(watch_list *list, watch *w)
+{
+    if (list->used == list->size)
+    {
+        int size = list->size ? list->size * 2 : 32;
+        watch **tmp = (watch **)realloc(list->watches, size * sizeof(watch *));
+        if (!tmp)
+        {
+            return 0;
+        }
+        list->watches = tmp;
+        list->size = size;
     }
-    watch *w = (watch *)nodep;
-    w->hit_access = 0;
-    w->hit_modify = 0;
-    w->hit_attrib = 0;
-    w->hit_close_nowrite = 0;
-    w->hit_close_write = 0;
-    w->hit_open = 0;
-    w->hit_move_self = 0;
-    w->hit_moved_from = 0;
-    w->hit_moved_to = 0;
-    w->hit_create = 0;
-    w->hit_delete = 0;
-    w->hit_delete_self = 0;
-    w->hit_unmount = 0;
-    w->hit_total = 0;
+    list->watches[list->used++] = w;
+    return 1;
 }
 
 /**
  * @internal
+ * Collect the watch of the directory @a path, @a len bytes long without a
+ * trailing '/', and the watches of everything below it.
+ *
+ * The filename tree is ordered by strcmp(), so all names starting with
+ * "path/" form one run of the tree.  Only that run is visited, the cost is
+ * the size of the subtree and not the number of watches of the instance.
  */
-void replace_filename(const void *nodep,
-                      const VISIT which,
-                      const int depth, void *arg)
+void watches_below(inotify_instance *in, char const *path, int len,
+                   watch_list *list)
 {
-    if (which != endorder && which != leaf)
+    watch key;
+    watch const *w;
+    char *sub = (char *)malloc(len + 2);
+    int sublen = len + 1;
+
+    if (!sub)
     {
         return;
     }
-    watch *w = (watch *)nodep;
-    char *old_name = ((char **)arg)[0];
-    char *new_name = ((char **)arg)[1];
-    int old_len = *((int *) & ((char **)arg)[2]);
-    char *name;
-    if (0 == strncmp(old_name, w->filename, old_len))
+    memcpy(sub, path, len);
+    sub[len] = '\0';
+
+    if (len == 1 && path[0] == '/')
+    {
+        // everything is below "/", and "/" itself starts the run
+        sublen = 1;
+    }
+    else
     {
-        nasprintf(&name, "%s%s", new_name, &(w->filename[old_len]));
-        if (!strcmp(w->filename, new_name))
+        key.filename = sub;
+        w = (watch const *)rbfind(&key, in->tree_filename);
+        if (w)
         {
-            free(name);
+            watch_list_add(list, (watch *)w);
         }
-        else
+        sub[len] = '/';
+        sub[len + 1] = '\0';
+    }
+
+    key.filename = sub;
+    w = (watch const *)rblookup(RB_LUGTEQ, &key, in->tree_filename);
+    while (w && strncmp(w->filename, sub, sublen) == 0)
+    {
+        if (!watch_list_add(list, (watch *)w))
         {
-            rbdelete(w, tree_filename);
-            free(w->filename);
-            w->filename = name;
-            rbsearch(w, tree_filename);
+            break;
         }
+        w = (watch const *)rblookup(RB_LUGREAT, w, in->tree_filename);
     }
+
+    free(sub);
 }
 
 /**
  * @internal
+ * Length of @a path without a trailing '/', "/" is kept as it is.
  */
-void get_num(const void *nodep,
-             const VISIT which,
-             const int depth, void *arg)
+int dir_name_len(char const *path)
 {
-    if (which != endorder && which != leaf)
+    int len = strlen(path);
+    if (len > 1 && path[len - 1] == '/')
     {
-        return;
+        len--;
     }
-    ++(*((int *)arg));
+    return len;
 }
 
 
@@ -490,10 +901,14 @@ void inotifytools_initialize_stats()
 {
     niceassert(init, "inotifytools_initialize not called yet");
 
-    // if already collecting stats, reset stats
-    if (collect_stats)
+    // watches only carry stats while they are collected, set them up or
+    // reset them
+    int i;
+    for (i = 0; i < num_instances; i++)
     {
-        rbwalk(tree_wd, empty_stats, 0);
+        pthread_mutex_lock(&instances[i].lock);
+        empty_stats(&instances[i]);
+        pthread_mutex_unlock(&instances[i].lock);
     }
 
     num_access = 0;
@@ -915,7 +1330,7 @@ char *inotifytools_event_to_str_sep(int events, char sep)
 char *inotifytools_filename_from_wd(int wd)
 {
     niceassert(init, "inotifytools_initialize not called yet");
-    watch *w = watch_from_wd(wd);
+    watch *w = watch_from_wd(&instances[0], wd);
     if (!w)
     {
         return 0;
@@ -923,6 +1338,79 @@ char *inotifytools_filename_from_wd(int wd)
     return w->filename;
 }
 
+/**
+ * Copy the filename used to establish a watch of an instance.
+ *
+ * Unlike inotifytools_filename_from_wd(), the name is copied under the
+ * instance lock, so it stays valid while other threads add, remove or
+ * rename watches.
+ *
+ * @param instance instance the watch descriptor belongs to.
+ *
+ * @param wd watch descriptor.
+ *
+ * @param buf buffer receiving the NUL-terminated filename.
+ *
+ * @param size size of @a buf.
+ *
+ * @return length of the filename, or -1 if @a wd is not associated with any
+ *         filename or the name does not fit in @a buf.
+ */
+int inotifytools_copy_filename_from_wd(int instance, int wd, char *buf, int size)
+{
+    niceassert(init, "inotifytools_initialize not called yet");
+    inotify_instance *in = &instances[instance];
+    int len = -1;
+
+    pthread_mutex_lock(&in->lock);
+    watch *w = watch_from_wd(in, wd);
+    if (w && w->filename)
+    {
+        len = w->filename_len;
+        if (len < size)
+        {
+            memcpy(buf, w->filename, len + 1);
+        }
+        else
+        {
+            len = -1;
+        }
+    }
+    pthread_mutex_unlock(&in->lock);
+
+    return len;
+}
+
+/**
+ * Get the assigned root a watch of an instance lies below.
+ *
+ * Lets a reader apply per-root settings to an event before building the
+ * path of the event.
+ *
+ * @param instance instance the watch descriptor belongs to.
+ *
+ * @param wd watch descriptor.
+ *
+ * @return index of the root as returned by inotifytools_root_index(), or -1
+ *         if @a wd is unknown or lies below no assigned root.
+ */
+int inotifytools_root_from_wd(int instance, int wd)
+{
+    niceassert(init, "inotifytools_initialize not called yet");
+    inotify_instance *in = &instances[instance];
+    int root = -1;
+
+    pthread_mutex_lock(&in->lock);
+    watch *w = watch_from_wd(in, wd);
+    if (w)
+    {
+        root = w->root;
+    }
+    pthread_mutex_unlock(&in->lock);
+
+    return root;
+}
+
 /**
  * Get the watch descriptor for a particular filename.
  *
@@ -940,12 +1428,16 @@ char *inotifytools_filename_from_wd(int wd)
 int inotifytools_wd_from_filename(char const *filename)
 {
     niceassert(init, "inotifytools_initialize not called yet");
-    watch *w = watch_from_filename(filename);
+    inotify_instance *in = 0;
+    int wd = -1;
+    watch *w = locked_watch_from_filename(filename, &in);
     if (!w)
     {
         return -1;
     }
-    return w->wd;
+    wd = w->wd;
+    pthread_mutex_unlock(&in->lock);
+    return wd;
 }
 
 /**
@@ -965,16 +1457,17 @@ int inotifytools_wd_from_filename(char const *filename)
 void inotifytools_set_filename_by_wd(int wd, char const *filename)
 {
     niceassert(init, "inotifytools_initialize not called yet");
-    watch *w = watch_from_wd(wd);
-    if (!w)
-    {
-        return;
-    }
-    if (w->filename)
+    inotify_instance *in = &instances[0];
+
+    pthread_mutex_lock(&in->lock);
+    watch *w = watch_from_wd(in, wd);
+    if (w)
     {
-        free(w->filename);
+        rbdelete(w, in->tree_filename);
+        set_watch_filename(w, strdup(filename));
+        rbsearch(w, in->tree_filename);
     }
-    w->filename = strdup(filename);
+    pthread_mutex_unlock(&in->lock);
 }
 
 /**
@@ -994,16 +1487,16 @@ void inotifytools_set_filename_by_wd(int wd, char const *filename)
 void inotifytools_set_filename_by_filename(char const *oldname,
                                            char const *newname)
 {
-    watch *w = watch_from_filename(oldname);
+    inotify_instance *in = 0;
+    watch *w = locked_watch_from_filename(oldname, &in);
     if (!w)
     {
         return;
     }
-    if (w->filename)
-    {
-        free(w->filename);
-    }
-    w->filename = strdup(newname);
+    rbdelete(w, in->tree_filename);
+    set_watch_filename(w, strdup(newname));
+    rbsearch(w, in->tree_filename);
+    pthread_mutex_unlock(&in->lock);
 }
 
 /**
@@ -1016,6 +1509,9 @@ void inotifytools_set_filename_by_filename(char const *oldname,
  * inotifytools_initialize() must be called before this function can
  * be used.
  *
+ * Only the watches of @a oldname and of the paths below it are renamed,
+ * "/a/b" does not match "/a/bc".
+ *
  * @param oldname Current filename prefix.
  *
  * @param newname New filename prefix.
@@ -1035,20 +1531,47 @@ void inotifytools_replace_filename(char const *oldname,
     {
         return;
     }
-    char *names[2 + sizeof(int) / sizeof(char *)];
-    names[0] = (char *)oldname;
-    names[1] = (char *)newname;
-    *((int *)&names[2]) = strlen(oldname);
-    rbwalk(tree_filename, replace_filename, (void *)names);
+    int i, j;
+    int old_len = dir_name_len(oldname);
+    int new_len = dir_name_len(newname);
+
+    // the renamed tree may hold watches of several instances
+    for (i = 0; i < num_instances; i++)
+    {
+        inotify_instance *in = &instances[i];
+        watch_list list;
+        memset(&list, 0, sizeof(list));
+
+        pthread_mutex_lock(&in->lock);
+        watches_below(in, oldname, old_len, &list);
+
+        // take them all out first, the new names may sort anywhere
+        for (j = 0; j < list.used; j++)
+        {
+            rbdelete(list.watches[j], in->tree_filename);
+        }
+        for (j = 0; j < list.used; j++)
+        {
+            watch *w = list.watches[j];
+            char *name;
+            nasprintf(&name, "%.*s%s", new_len, newname, &(w->filename[old_len]));
+            set_watch_filename(w, name);
+            w->root = root_index_of_path(name);
+            rbsearch(w, in->tree_filename);
+        }
+        pthread_mutex_unlock(&in->lock);
+
+        my_free(list.watches);
+    }
 }
 
 /**
  * @internal
  */
-int remove_inotify_watch(watch *w)
+int remove_inotify_watch(inotify_instance *in, watch *w)
 {
     error = 0;
-    int status = inotify_rm_watch(inotify_fd, w->wd);
+    int status = inotify_rm_watch(in->fd, w->wd);
     if (status < 0)
     {
         fprintf(stderr, "Failed to remove watch on %s\n", w->filename);
@@ -1061,7 +1584,7 @@ int remove_inotify_watch(watch *w)
 /**
  * @internal
  */
-watch *create_watch(int wd, char *filename)
+watch *create_watch(inotify_instance *in, int wd, char *filename)
 {
     if (wd <= 0 || !filename)
     {
@@ -1069,11 +1592,24 @@ watch *create_watch(int wd, char *filename)
     }
 
     watch *w = (watch *)calloc(1, sizeof(watch));
+    if (!w)
+    {
+        return 0;
+    }
     w->wd = wd;
-    w->filename = strdup(filename);
-    rbsearch(w, tree_wd);
-    rbsearch(w, tree_filename);
-    return NULL;
+    w->root = root_index_of_path(filename);
+    set_watch_filename(w, strdup(filename));
+    if (collect_stats)
+    {
+        w->stats = (watch_stats *)calloc(1, sizeof(watch_stats));
+    }
+    if (!wd_table_set(in, wd, w))
+    {
+        destroy_watch(w);
+        return 0;
+    }
+    rbsearch(w, in->tree_filename);
+    return w;
 }
 
 /**
@@ -1091,20 +1627,26 @@ watch *create_watch(int wd, char *filename)
 int inotifytools_remove_watch_by_wd(int wd)
 {
     niceassert(init, "inotifytools_initialize not called yet");
-    watch *w = watch_from_wd(wd);
-    if (!w)
-    {
-        return 1;
-    }
+    inotify_instance *in = &instances[0];
+    int ret = 1;
 
-    if (!remove_inotify_watch(w))
+    pthread_mutex_lock(&in->lock);
+    watch *w = watch_from_wd(in, wd);
+    if (w)
     {
-        return 0;
+        if (!remove_inotify_watch(in, w))
+        {
+            ret = 0;
+        }
+        else
+        {
+            wd_table_set(in, w->wd, 0);
+            rbdelete(w, in->tree_filename);
+            destroy_watch(w);
+        }
     }
-    rbdelete(w, tree_wd);
-    rbdelete(w, tree_filename);
-    destroy_watch(w);
-    return 1;
+    pthread_mutex_unlock(&in->lock);
+    return ret;
 }
 
 /**
@@ -1123,193 +1665,102 @@ int inotifytools_remove_watch_by_filename(char const *filename)
     del_dir((char *)filename);
 
     niceassert(init, "inotifytools_initialize not called yet");
-    watch *w = watch_from_filename(filename);
+    inotify_instance *in = 0;
+    watch *w = locked_watch_from_filename(filename, &in);
     if (!w)
     {
         return 1;
     }
 
-    if (!remove_inotify_watch(w))
+    if (!remove_inotify_watch(in, w))
     {
+        pthread_mutex_unlock(&in->lock);
         return 0;
     }
-    rbdelete(w, tree_wd);
-    rbdelete(w, tree_filename);
+    wd_table_set(in, w->wd, 0);
+    rbdelete(w, in->tree_filename);
     destroy_watch(w);
+    pthread_mutex_unlock(&in->lock);
     return 1;
 }
 
-typedef struct remove_file
-{
-    char *file;
-    watch *w;
-} remove_file;
-
-typedef struct remove_files
-{
-    remove_file *files;
-    int used;
-    int size;
-} remove_files;
-
-void add_remove_file(remove_files *rfiles,
-                     char *filename,
-                     watch *w)
+//delete the watch files with prefix
+void inotifytools_remove_filename_prefix(char const *filename)
 {
-    if (!rfiles)
+    if (!filename)
     {
         return;
     }
 
-    int index = rfiles->used;
+    int i = 0, j = 0;
+    int len = dir_name_len(filename);
 
-    if (rfiles->size == 0)
-    {
-        int size = 32;
-        remove_file *tmp = (remove_file *)calloc(size, sizeof(remove_file));
-        if (!tmp)
-        {
-            return;
-        }
-        rfiles->files = tmp;
-        rfiles->size = size;
-    }
-    else if (rfiles->used >= rfiles->size)
+    // the tree may hold watches of several instances
+    for (j = 0; j < num_instances; j++)
     {
-        int size = 2 * rfiles->size;
-        remove_file *tmp = (remove_file *)realloc(rfiles->files,
-                                                  size * sizeof(remove_file));
-        if (!tmp)
-        {
-            return;
-        }
+        inotify_instance *in = &instances[j];
+        watch_list list;
+        memset(&list, 0, sizeof(list));
 
-        rfiles->files = tmp;
-        rfiles->size = size;
-    }
+        pthread_mutex_lock(&in->lock);
+        watches_below(in, filename, len, &list);
 
-    rfiles->files[index].file = strdup(filename);
-    rfiles->files[index].w = w;
-    rfiles->used++;
-    return;
-}
+        for (i = 0; i < list.used; i++)
+        {
+            watch *w = list.watches[i];
 
-void free_remove_file(remove_file *file)
-{
-    if (!file)
-    {
-        return;
-    }
+            del_dir(w->filename);
+            remove_inotify_watch(in, w);
+            wd_table_set(in, w->wd, 0);
+            rbdelete(w, in->tree_filename);
+            destroy_watch(w);
+        }
+        pthread_mutex_unlock(&in->lock);
 
-    if (file->file)
-    {
-        free(file->file);
+        my_free(list.watches);
     }
-    return;
 }
 
-void free_remove_files(remove_files *files)
-{
-    int i = 0;
-
-    if (!files)
-    {
-        return;
-    }
-
-    if (!files->files)
-    {
-        return;
-    }
-
-    for (i = 0; i < files->used; i++)
-    {
-        free_remove_file(&files->files[i]);
-    }
-
-    free(files->files);
-}
 
 /**
  * @internal
+ * A directory already watched is asked for again, by a root that may need
+ * other events.  The kernel is asked with IN_MASK_ADD for the events the
+ * watch does not have yet, so the watch keeps the union of the masks.  A
+ * watch another thread is still setting up is not known yet, the kernel is
+ * asked anyway and merges the masks in either order.
  */
-void get_remove_fileinfo(const void *nodep,
-                         const VISIT which,
-                         const int depth, void *arg)
+static int widen_watch(char const *filename, int events)
 {
-    if (which != endorder && which != leaf)
+    inotify_instance *in = 0;
+    watch *w = locked_watch_from_filename(filename, &in);
+    int wanted = events & ~IN_MASK_ADD;
+
+    if (!w)
     {
-        return;
+        in = instance_for_path(filename);
+        pthread_mutex_lock(&in->lock);
     }
-
-    int sublen = 0;
-    watch *w = (watch *)nodep;
-    char *old_name = ((char **)arg)[0];
-    int old_len = *((int *) & ((char **)arg)[1]);
-    remove_files *files = ((remove_files **)arg)[2];
-
-    printf("remove dir %s, len %d\n", old_name, old_len);
-
-    if (0 == strncmp(old_name, w->filename, old_len))
+    else if ((wanted & ~w->mask) == 0)
     {
-        sublen = strlen(w->filename);
-        if (sublen < old_len)
-        {
-            return;
-        }
-
-        if ((sublen > old_len) && (w->filename[old_len] != '/'))
-        {
-            return;
-        }
-
-        add_remove_file(files, w->filename, w);
+        pthread_mutex_unlock(&in->lock);
+        return 1;
     }
-}
 
-//delete the watch files with prefix
-void inotifytools_remove_filename_prefix(char const *filename)
-{
-    if (!filename)
+    if (inotify_add_watch(in->fd, filename, wanted | IN_MASK_ADD) < 0)
     {
-        return;
+        error = errno;
+        pthread_mutex_unlock(&in->lock);
+        return 0;
     }
-
-    int i = 0;
-    remove_files rfiles;
-    memset(&rfiles, 0, sizeof(remove_files));
-
-    char *names[2 + sizeof(int) / sizeof(char *)];
-    names[0] = (char *)filename;
-    *((int *)&names[1]) = strlen(filename);
-    names[2] = (char *)&rfiles;
-
-    rbwalk(tree_filename, get_remove_fileinfo, (void *)names);
-
-    for (i = 0; i < rfiles.used; i++)
+    if (w)
     {
-        remove_file *t = &rfiles.files[i];
-        if (!t->file)
-        {
-            continue;
-        }
-
-        del_dir((char *)t->file);
-
-        if (!t->w)
-        {
-            continue;
-        }
-        remove_inotify_watch(t->w);
-        rbdelete(t->w, tree_wd);
-        rbdelete(t->w, tree_filename);
-        destroy_watch(t->w);
+        w->mask |= wanted;
     }
-
-    free_remove_files(&rfiles);
+    pthread_mutex_unlock(&in->lock);
+    return 1;
 }
 
-
 /**
  * Set up a watch on a file.
  *
@@ -1332,7 +1783,7 @@ int inotifytools_watch_file(char const *filename, int events)
 
     if (add_dir((char *)filename) == 1)
     {
-        return 1;
+        return widen_watch(filename, events);
     }
 
     printf("watch file : %s\n", filename);
@@ -1363,13 +1814,16 @@ int inotifytools_watch_files(char const *filenames[], int events)
     niceassert(init, "inotifytools_initialize not called yet");
     error = 0;
 
-    static int i;
+    int i;
     for (i = 0; filenames[i]; ++i)
     {
-        static int wd;
-        wd = inotify_add_watch(inotify_fd, filenames[i], events);
+        int wd;
+        inotify_instance *in = instance_for_path(filenames[i]);
+        pthread_mutex_lock(&in->lock);
+        wd = inotify_add_watch(in->fd, filenames[i], events);
         if (wd < 0)
         {
+            pthread_mutex_unlock(&in->lock);
             if (wd == -1)
             {
                 error = errno;
@@ -1403,7 +1857,12 @@ int inotifytools_watch_files(char const *filenames[], int events)
             nasprintf(&filename, "%s/", filenames[i]);
         }
 #endif
-        create_watch(wd, filename);
+        watch *w = create_watch(in, wd, filename);
+        if (w)
+        {
+            w->mask = events & ~IN_MASK_ADD;
+        }
+        pthread_mutex_unlock(&in->lock);
         free(filename);
     } // for
 
@@ -1516,7 +1975,7 @@ struct inotify_event *inotifytools_next_events(int timeout, int num_events)
             }\
         }\
         if ( collect_stats ) {\
-            record_stats( A );\
+            record_stats( &instances[0], A );\
         }\
         return A;\
     }
@@ -1577,6 +2036,7 @@ struct inotify_event *inotifytools_next_events(int timeout, int num_events)
     static struct timeval *read_timeout_ptr;
     read_timeout_ptr = (timeout <= 0 ? NULL : &read_timeout);
 
+    int inotify_fd = instances[0].fd;
     FD_ZERO(&read_fds);
     FD_SET(inotify_fd, &read_fds);
     rc = select(inotify_fd + 1, &read_fds,
@@ -1636,6 +2096,181 @@ struct inotify_event *inotifytools_next_events(int timeout, int num_events)
 #undef RETURN
 }
 
+/**
+ * Get every inotify event currently queued in the kernel with one read.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * The read buffer is sized from FIONREAD, so a burst of events is drained
+ * with a single read() instead of one read() per event.
+ *
+ * @param timeout maximum amount of time, in milliseconds, to wait for an
+ *                event.  If @a timeout is 0, the function is non-blocking.
+ *                If @a timeout is negative, the function will block until an
+ *                event occurs.
+ *
+ * @param bytes   set to the number of bytes of complete events available
+ *                from the returned pointer.
+ *
+ * @return pointer to the first event of the batch, or NULL if the function
+ *         timed out or failed.  Walk the batch with
+ *         sizeof(struct inotify_event) + event->len.  The batch is located in
+ *         static storage and is overwritten by the next call.
+ *
+ * @note Events matching inotifytools_ignore_events_by_regex() are NOT
+ *       filtered out of the batch; the caller is expected to filter.
+ */
+struct inotify_event *inotifytools_next_batch(int timeout, int *bytes)
+{
+    return inotifytools_next_batch_instance(0, timeout, bytes);
+}
+
+/**
+ * Get every event currently queued on one instance with one read.
+ *
+ * Same as inotifytools_next_batch() for the instance @a instance.  Each
+ * instance has its own buffer, so different instances may be read from
+ * different threads at the same time.
+ */
+struct inotify_event *inotifytools_next_batch_instance(int instance, int timeout, int *bytes)
+{
+    niceassert(init, "inotifytools_initialize not called yet");
+
+    inotify_instance *in = &instances[instance];
+    inotifytools_batch_stats *batch_stats = &in->batch_stats;
+    struct pollfd pfd;
+    unsigned int bytes_to_read = 0;
+    size_t want = 0;
+    ssize_t this_bytes = 0;
+    int rc = 0;
+
+    error = 0;
+    *bytes = 0;
+
+    pfd.fd = in->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    rc = poll(&pfd, 1, timeout < 0 ? -1 : timeout);
+    batch_stats->syscalls++;
+    if (rc < 0)
+    {
+        error = errno;
+        return NULL;
+    }
+    else if (rc == 0)
+    {
+        // timeout
+        return NULL;
+    }
+
+    rc = ioctl(in->fd, FIONREAD, &bytes_to_read);
+    batch_stats->syscalls++;
+    if (rc == -1)
+    {
+        error = errno;
+        return NULL;
+    }
+
+    // always leave room for at least one event with the longest name,
+    // otherwise read() fails with EINVAL.
+    want = bytes_to_read;
+    if (want < sizeof(struct inotify_event) + NAME_MAX + 1)
+    {
+        want = sizeof(struct inotify_event) + NAME_MAX + 1;
+    }
+    if (want > in->batch_buf_size)
+    {
+        char *tmp = (char *)realloc(in->batch_buf, want);
+        if (!tmp)
+        {
+            error = ENOMEM;
+            return NULL;
+        }
+        in->batch_buf = tmp;
+        in->batch_buf_size = want;
+    }
+
+    this_bytes = read(in->fd, in->batch_buf, in->batch_buf_size);
+    batch_stats->syscalls++;
+    if (this_bytes < 0)
+    {
+        error = errno;
+        return NULL;
+    }
+    if (this_bytes == 0)
+    {
+        fprintf(stderr, "Inotify reported end-of-file.  Possibly too many "
+                "events occurred at once.\n");
+        return NULL;
+    }
+
+    unsigned long long num = 0;
+    char *p = in->batch_buf;
+    while (p < in->batch_buf + this_bytes)
+    {
+        struct inotify_event *event = (struct inotify_event *)p;
+        if (collect_stats)
+        {
+            record_stats(in, event);
+        }
+        num++;
+        p += sizeof(struct inotify_event) + event->len;
+    }
+
+    batch_stats->batches++;
+    batch_stats->events += num;
+    if (num > batch_stats->max_batch)
+    {
+        batch_stats->max_batch = num;
+    }
+
+    *bytes = (int)this_bytes;
+    return (struct inotify_event *)in->batch_buf;
+}
+
+/**
+ * Get the counters maintained by inotifytools_next_batch(), summed over all
+ * instances.
+ *
+ * @param stats filled with the number of batches, events and system calls
+ *              since inotifytools_initialize().
+ */
+void inotifytools_get_batch_stats(inotifytools_batch_stats *stats)
+{
+    int i;
+
+    if (!stats)
+    {
+        return;
+    }
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < num_instances; i++)
+    {
+        inotifytools_batch_stats *one = &instances[i].batch_stats;
+        stats->batches += one->batches;
+        stats->events += one->events;
+        stats->syscalls += one->syscalls;
+        if (one->max_batch > stats->max_batch)
+        {
+            stats->max_batch = one->max_batch;
+        }
+    }
+}
+
+/**
+ * Get the counters maintained by inotifytools_next_batch_instance() for one
+ * instance.
+ */
+void inotifytools_get_batch_stats_instance(int instance, inotifytools_batch_stats *stats)
+{
+    if (!stats || instance < 0 || instance >= num_instances)
+    {
+        return;
+    }
+    memcpy(stats, &instances[instance].batch_stats, sizeof(*stats));
+}
+
 /**
  * Set up recursive watches on an entire directory tree.
  *
@@ -1759,9 +2394,9 @@ int inotifytools_watch_recursively_with_exclude(char const *path, int events,
         my_path = (char *)path;
     }
 
-    static struct dirent *ent;
+    struct dirent *ent;
     char *next_file;
-    static struct stat64 my_stat;
+    struct stat64 my_stat;
     ent = readdir(dir);
     // Watch each directory within this directory
     while (ent)
@@ -1790,15 +2425,15 @@ int inotifytools_watch_recursively_with_exclude(char const *path, int events,
             {
                 free(next_file);
                 nasprintf(&next_file, "%s%s/", my_path, ent->d_name);
-                static unsigned int no_watch;
-                static char const **exclude_entry;
+                unsigned int no_watch;
+                char const **exclude_entry;
 
                 no_watch = 0;
                 for (exclude_entry = exclude_list;
                      exclude_entry && *exclude_entry && !no_watch;
                      ++exclude_entry)
                 {
-                    static int exclude_length;
+                    int exclude_length;
 
                     exclude_length = strlen(*exclude_entry);
                     if ((*exclude_entry)[exclude_length - 1] == '/')
@@ -1814,7 +2449,7 @@ int inotifytools_watch_recursively_with_exclude(char const *path, int events,
                 }
                 if (!no_watch)
                 {
-                    static int status;
+                    int status;
                     status = inotifytools_watch_recursively_with_exclude(
                                  next_file,
                                  events,
@@ -1915,9 +2550,9 @@ int inotifytools_watch_recursively_with_level(char const *path, int events, int
         }
     }
 
-    static struct dirent *ent = NULL;
+    struct dirent *ent = NULL;
     char *next_file = NULL;
-    static struct stat64 my_stat;
+    struct stat64 my_stat;
     if (dir)
     {
         ent = readdir(dir);
@@ -1967,15 +2602,15 @@ int inotifytools_watch_recursively_with_level(char const *path, int events, int
                 my_free(next_file);
                 nasprintf(&next_file, "%s%s/", my_path, ent->d_name);
 
-                static unsigned int no_watch;
-                static char **exclude_entry;
+                unsigned int no_watch;
+                char **exclude_entry;
 
                 no_watch = 0;
                 for (exclude_entry = exclude_list;
                      exclude_entry && *exclude_entry && !no_watch;
                      ++exclude_entry)
                 {
-                    static int exclude_length;
+                    int exclude_length;
 
                     exclude_length = strlen(*exclude_entry);
                     if ((*exclude_entry)[exclude_length - 1] == '/')
@@ -1992,7 +2627,7 @@ int inotifytools_watch_recursively_with_level(char const *path, int events, int
 
                 if (!no_watch)
                 {
-                    static int status;
+                    int status;
                     status = inotifytools_watch_recursively_with_level(next_file,
                                                                        events, level, exclude_list);
                     // For some errors, we will continue.
@@ -2042,145 +2677,152 @@ int inotifytools_watch_recursively_with_level(char const *path, int events, int
 /**
  * @internal
  */
-void record_stats(struct inotify_event const *event)
+void record_stats(inotify_instance *in, struct inotify_event const *event)
 {
     if (!event)
     {
         return;
     }
-    watch *w = watch_from_wd(event->wd);
-    if (!w)
+    pthread_mutex_lock(&in->lock);
+    watch *w = watch_from_wd(in, event->wd);
+    if (!w || !w->stats)
     {
+        pthread_mutex_unlock(&in->lock);
         return;
     }
+    watch_stats *ws = w->stats;
     if (IN_ACCESS & event->mask)
     {
-        ++w->hit_access;
+        ++ws->hit_access;
         ++num_access;
     }
     if (IN_MODIFY & event->mask)
     {
-        ++w->hit_modify;
+        ++ws->hit_modify;
         ++num_modify;
     }
     if (IN_ATTRIB & event->mask)
     {
-        ++w->hit_attrib;
+        ++ws->hit_attrib;
         ++num_attrib;
     }
     if (IN_CLOSE_WRITE & event->mask)
     {
-        ++w->hit_close_write;
+        ++ws->hit_close_write;
         ++num_close_write;
     }
     if (IN_CLOSE_NOWRITE & event->mask)
     {
-        ++w->hit_close_nowrite;
+        ++ws->hit_close_nowrite;
         ++num_close_nowrite;
     }
     if (IN_OPEN & event->mask)
     {
-        ++w->hit_open;
+        ++ws->hit_open;
         ++num_open;
     }
     if (IN_MOVED_FROM & event->mask)
     {
-        ++w->hit_moved_from;
+        ++ws->hit_moved_from;
         ++num_moved_from;
     }
     if (IN_MOVED_TO & event->mask)
     {
-        ++w->hit_moved_to;
+        ++ws->hit_moved_to;
         ++num_moved_to;
     }
     if (IN_CREATE & event->mask)
     {
-        ++w->hit_create;
+        ++ws->hit_create;
         ++num_create;
     }
     if (IN_DELETE & event->mask)
     {
-        ++w->hit_delete;
+        ++ws->hit_delete;
         ++num_delete;
     }
     if (IN_DELETE_SELF & event->mask)
     {
-        ++w->hit_delete_self;
+        ++ws->hit_delete_self;
         ++num_delete_self;
     }
     if (IN_UNMOUNT & event->mask)
     {
-        ++w->hit_unmount;
+        ++ws->hit_unmount;
         ++num_unmount;
     }
     if (IN_MOVE_SELF & event->mask)
     {
-        ++w->hit_move_self;
+        ++ws->hit_move_self;
         ++num_move_self;
     }
 
-    ++w->hit_total;
+    ++ws->hit_total;
     ++num_total;
-
+    pthread_mutex_unlock(&in->lock);
 }
 
 int *stat_ptr(watch *w, int event)
 {
+    if (!w->stats)
+    {
+        return (int *)0;
+    }
     if (IN_ACCESS == event)
     {
-        return (int *)&w->hit_access;
+        return (int *)&w->stats->hit_access;
     }
     if (IN_MODIFY == event)
     {
-        return (int *)&w->hit_modify;
+        return (int *)&w->stats->hit_modify;
     }
     if (IN_ATTRIB == event)
     {
-        return (int *)&w->hit_attrib;
+        return (int *)&w->stats->hit_attrib;
     }
     if (IN_CLOSE_WRITE == event)
     {
-        return (int *)&w->hit_close_write;
+        return (int *)&w->stats->hit_close_write;
     }
     if (IN_CLOSE_NOWRITE == event)
     {
-        return (int *)&w->hit_close_nowrite;
+        return (int *)&w->stats->hit_close_nowrite;
     }
     if (IN_OPEN == event)
     {
-        return (int *)&w->hit_open;
+        return (int *)&w->stats->hit_open;
     }
     if (IN_MOVED_FROM == event)
     {
-        return (int *)&w->hit_moved_from;
+        return (int *)&w->stats->hit_moved_from;
     }
     if (IN_MOVED_TO == event)
     {
-        return (int *)&w->hit_moved_to;
+        return (int *)&w->stats->hit_moved_to;
     }
     if (IN_CREATE == event)
     {
-        return (int *)&w->hit_create;
+        return (int *)&w->stats->hit_create;
     }
     if (IN_DELETE == event)
     {
-        return (int *)&w->hit_delete;
+        return (int *)&w->stats->hit_delete;
     }
     if (IN_DELETE_SELF == event)
     {
-        return (int *)&w->hit_delete_self;
+        return (int *)&w->stats->hit_delete_self;
     }
     if (IN_UNMOUNT == event)
     {
-        return (int *)&w->hit_unmount;
+        return (int *)&w->stats->hit_unmount;
     }
     if (IN_MOVE_SELF == event)
     {
-        return (int *)&w->hit_move_self;
+        return (int *)&w->stats->hit_move_self;
     }
     if (0 == event)
     {
-        return (int *)&w->hit_total;
+        return (int *)&w->stats->hit_total;
     }
     return (int *)0;
 }
@@ -2207,7 +2849,7 @@ int inotifytools_get_stat_by_wd(int wd, int event)
         return -1;
     }
 
-    watch *w = watch_from_wd(wd);
+    watch *w = watch_from_wd(&instances[0], wd);
     if (!w)
     {
         return -1;
@@ -2370,8 +3012,13 @@ int isdir(char const *path)
  */
 int inotifytools_get_num_watches()
 {
-    int ret = 0;
-    rbwalk(tree_filename, get_num, (void *)&ret);
+    int ret = 0, i;
+    for (i = 0; i < num_instances; i++)
+    {
+        pthread_mutex_lock(&instances[i].lock);
+        ret += instances[i].num_watches;
+        pthread_mutex_unlock(&instances[i].lock);
+    }
     return ret;
 }
 
@@ -2854,32 +3501,39 @@ int event_compare(const void *p1, const void *p2, const void *config)
     }
     int *i1 = stat_ptr((watch *)p1, sort_event);
     int *i2 = stat_ptr((watch *)p2, sort_event);
-    if (0 == *i1 - *i2)
+    // watches without stats sort as if nothing happened on them
+    int n1 = i1 ? *i1 : 0;
+    int n2 = i2 ? *i2 : 0;
+    if (0 == n1 - n2)
     {
         return ((watch *)p1)->wd - ((watch *)p2)->wd;
     }
     if (asc)
     {
-        return *i1 - *i2;
+        return n1 - n2;
     }
     else
     {
-        return *i2 - *i1;
+        return n2 - n1;
     }
 }
 
 struct rbtree *inotifytools_wd_sorted_by_event(int sort_event)
 {
     struct rbtree *ret = rbinit(event_compare, (void *)sort_event);
-    RBLIST *all = rbopenlist(tree_wd);
-    void const *p = rbreadlist(all);
-    while (p)
+    // watch descriptors are only unique within one instance, use instance 0.
+    inotify_instance *in = &instances[0];
+    int wd;
+    for (wd = 0; wd < in->wd_table_size; wd++)
     {
+        void const *p = in->wd_table[wd];
+        if (!p)
+        {
+            continue;
+        }
         void const *r = rbsearch(p, ret);
         niceassert((int)(r == p), "Couldn't insert watch into new tree");
-        p = rbreadlist(all);
     }
-    rbcloselist(all);
     return ret;
 }
 
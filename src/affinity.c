@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include "header.h"
+#include "affinity.h"
+#include "log.h"
+
+#define NODE_CPULIST "/sys/devices/system/node/node%d/cpulist"
+#define CPU_NODE_DIR "/sys/devices/system/cpu/cpu%d"
+
+static int read_node_cpulist(int node, char *buf, int size)
+{
+    char path[128] = {0};
+    FILE *fp = NULL;
+
+    snprintf(path, sizeof(path), NODE_CPULIST, node);
+    fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    if (fgets(buf, size, fp) == NULL)
+    {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    buf[strcspn(buf, "\r\n")] = '\0';
+    return 0;
+}
+
+//nodes is 0 inside a node cpulist, a node can not name another node.
+static int parse_cpus(const char *spec, cpu_set_t *set, int nodes)
+{
+    char buf[1024] = {0};
+    char nodelist[1024] = {0};
+    char *tok = NULL, *save = NULL, *end = NULL;
+    long first = 0, last = 0;
+
+    snprintf(buf, sizeof(buf), "%s", spec);
+    for (tok = strtok_r(buf, ", \t", &save); tok != NULL; tok = strtok_r(NULL, ", \t", &save))
+    {
+        if (nodes && strncmp(tok, "node", 4) == 0)
+        {
+            first = strtol(tok + 4, &end, 10);
+            if (end == tok + 4 || *end != '\0'
+                || read_node_cpulist((int)first, nodelist, sizeof(nodelist)) != 0
+                || parse_cpus(nodelist, set, 0) != 0)
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        first = strtol(tok, &end, 10);
+        if (end == tok || first < 0)
+        {
+            return -1;
+        }
+        last = first;
+        if (*end == '-')
+        {
+            tok = end + 1;
+            last = strtol(tok, &end, 10);
+            if (end == tok || last < first)
+            {
+                return -1;
+            }
+        }
+        if (*end != '\0' || last >= CPU_SETSIZE)
+        {
+            return -1;
+        }
+        for (; first <= last; first++)
+        {
+            CPU_SET((int)first, set);
+        }
+    }
+    return 0;
+}
+
+static int spec_empty(const char *spec)
+{
+    return spec == NULL || spec[strspn(spec, " \t")] == '\0';
+}
+
+static int nth_cpu(cpu_set_t *set, int nth)
+{
+    int count = CPU_COUNT(set), cpu = 0;
+
+    if (count == 0)
+    {
+        return -1;
+    }
+    nth %= count;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, set) && nth-- == 0)
+        {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+int affinity_cpu(const char *spec, int nth)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    if (spec_empty(spec) || parse_cpus(spec, &set, 1) != 0)
+    {
+        return -1;
+    }
+    return nth_cpu(&set, nth < 0 ? 0 : nth);
+}
+
+int affinity_pin(const char *spec, int nth)
+{
+    cpu_set_t set;
+    int cpu = 0, ret = 0;
+
+    if (spec_empty(spec))
+    {
+        return 0;
+    }
+
+    CPU_ZERO(&set);
+    if (parse_cpus(spec, &set, 1) != 0 || CPU_COUNT(&set) == 0)
+    {
+        debug_sys(LOG_ERR, "bad cpu list \"%s\"\n", spec);
+        return -1;
+    }
+
+    if (nth >= 0)
+    {
+        cpu = nth_cpu(&set, nth);
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+    }
+
+    ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0)
+    {
+        debug_sys(LOG_ERR, "failed to pin thread to \"%s\": %s\n", spec, strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+int affinity_node(int cpu)
+{
+    char path[128] = {0};
+    DIR *dirp = NULL;
+    struct dirent *dp = NULL;
+    int node = 0;
+
+    snprintf(path, sizeof(path), CPU_NODE_DIR, cpu);
+    dirp = opendir(path);
+    if (dirp == NULL)
+    {
+        return 0;
+    }
+    while ((dp = readdir(dirp)) != NULL)
+    {
+        if (strncmp(dp->d_name, "node", 4) == 0 && isdigit((unsigned char)dp->d_name[4]))
+        {
+            node = atoi(dp->d_name + 4);
+            break;
+        }
+    }
+    closedir(dirp);
+    return node;
+}
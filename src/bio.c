@@ -3,78 +3,214 @@
 #include "log.h"
 #include "linux_list.h"
 #include "atomic.h"
+#include "mpsc_ring.h"
+#include "affinity.h"
 
 #define THREAD_STACK_SIZE (1024*1024*4)
+#define BIO_RING_SIZE 1024      //jobs a queue holds before its overflow list is used
+#define BIO_MAX_WORKERS 128
+#define BIO_QUEUE_BATCH 64      //jobs run from a queue before the worker moves on
+#define BIO_HELP_WAIT_MS 10
+
+/*
+    log-linear histograms of microseconds: 8 linear buckets per power of
+    two, so a bucket is at most 12.5% wide. values from 2^HIST_MAX_EXP us
+    (about 2 minutes) on all fall into the last bucket.
+*/
+#define HIST_SUB_BITS   3
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP    27
+#define HIST_BUCKETS    ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB)
+
+typedef struct bio_hist
+{
+    unsigned long long count;
+    unsigned long long max;
+    unsigned long long buckets[HIST_BUCKETS];
+} bio_hist;
+
+/*
+    each queue is a lock-free ring, producers never take the mutex unless
+    the ring is full. a full ring spills into the overflow list, and later
+    jobs follow them there until it is drained, so the jobs of one producer
+    keep their order.
+
+    the queues are run by a pool of workers sized from the CPU count. a
+    queue with jobs is scheduled once on the ready list of its home worker
+    and is run by one worker at a time, so the jobs of a queue (the files
+    hashed to it by RSHash) stay in order. idle workers steal whole queues
+    from the ready lists of the others.
+*/
+typedef struct bio_queue
+{
+    mpsc_ring ring;
+    struct list_head overflow;
+    volatile int overflow_num;
+    volatile unsigned long long pending;    //queued or running
+    volatile int scheduled;                 //on a ready list or being run
+    volatile int waiters;                   //threads waiting on condvar_empty
+    volatile int space_waiters;             //threads waiting on condvar_space
+    pthread_mutex_t mutex;
+    pthread_cond_t condvar_empty;
+    pthread_cond_t condvar_space;
+    unsigned long long jobs;
+    unsigned long long overflows;
+    unsigned long long high_water;          //most jobs pending at once
+    unsigned long long full_hits;           //times a producer found it full
+
+    //written by the worker running the queue only, read by print_bio_stats.
+    bio_hist wait_us;                       //queued to started
+    bio_hist run_us;                        //handler time
+    unsigned long long printed_jobs;        //jobs at the last print_bio_stats
+} bio_queue;
+
+typedef struct bio_worker
+{
+    int id;
+    int cpu;                    //pinned to, -1 if it floats
+    int ready[BIO_NUM_OPS];     //queues ready to run, a queue is on one list at most
+    int head;
+    volatile int num;
+    pthread_mutex_t lock;
+    unsigned long long jobs;
+    unsigned long long steals;
+} __attribute__((aligned(64))) bio_worker;
 
 int g_build_index_ok = 0;
-static pthread_mutex_t bio_mutex[BIO_NUM_OPS];
-static pthread_cond_t bio_condvar[BIO_NUM_OPS];
-static pthread_cond_t bio_condvar_empty[BIO_NUM_OPS];
-struct list_head bio_jobs[BIO_NUM_OPS];
-static unsigned long long bio_pending[BIO_NUM_OPS];
-static unsigned int g_max_bio_penging = 1024000;
+static bio_queue *bio_queues[BIO_NUM_OPS];      //allocated by their home worker
+static bio_worker *bio_workers = NULL;
+static int bio_worker_num = 0;
+static __thread bio_worker *bio_self = NULL;
+static const char *bio_cpus = NULL;
+
+//workers report once their queues are set up.
+static int bio_ready = 0;
+static int bio_init_failed = 0;
+static pthread_mutex_t bio_ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bio_ready_cond = PTHREAD_COND_INITIALIZER;
+
+static volatile int bio_idle = 0;       //workers sleeping on bio_idle_cond
+static pthread_mutex_t bio_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bio_idle_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long long bio_wakeups = 0;
+
+//the event queues wait for the initial index, the scan queues build it.
+static int bio_started = 0;
+static int bio_parked[BIO_NUM_OPS];
+static int bio_parked_num = 0;
+static pthread_mutex_t bio_park_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//jobs a queue takes from bio_try_* before it counts as full, 0 for no limit.
+static unsigned long long bio_queue_limit = 0;
 static unsigned int g_max_free_bio_obj = 1024000;
-static unsigned int g_free_objs = 0;
+static volatile unsigned int g_free_objs = 0;       //job records allocated
 
-struct bio_job
+/*
+    every thread keeps its own free job records. producers allocate and
+    workers free, so the records drift from one cache to another. they
+    move through the global list in bulk, half a cache at a time, which
+    takes free_bio_job_mutex once per BIO_JOB_CACHE / 2 jobs.
+*/
+#define BIO_JOB_CACHE 256
+
+typedef struct bio_job_cache
 {
-    bio_handle bh;
-    void *arg;
-    struct list_head list;
-};
+    struct list_head free;
+    int num;
+} bio_job_cache;
+
+static __thread bio_job_cache bio_cache;
 struct list_head free_bio_job_list;
+static int free_bio_job_num = 0;
 static pthread_mutex_t free_bio_job_mutex;
+static unsigned long long bio_cache_refills = 0;
+static unsigned long long bio_cache_returns = 0;
+
+static bio_job_cache *job_cache()
+{
+    bio_job_cache *c = &bio_cache;
+
+    if (c->free.next == NULL)
+    {
+        INIT_LIST_HEAD(&c->free);
+    }
+    return c;
+}
+
+//move up to num records from one list to another, returns the number moved.
+static int move_jobs(struct list_head *from, struct list_head *to, int num)
+{
+    int moved = 0;
+
+    while (moved < num && !list_empty(from))
+    {
+        struct list_head *ln = from->next;
+        list_del(ln);
+        list_add(ln, to);
+        moved++;
+    }
+    return moved;
+}
 
 struct bio_job *new_bio_job()
 {
+    bio_job_cache *c = job_cache();
     struct bio_job *job = NULL;
+    int moved = 0;
 
-    pthread_mutex_lock(&free_bio_job_mutex);
-    if (!list_empty(&free_bio_job_list))
+    if (c->num == 0 && free_bio_job_num > 0)
     {
-        job = list_entry(free_bio_job_list.next, struct bio_job, list);
-        list_del(&job->list);
+        pthread_mutex_lock(&free_bio_job_mutex);
+        moved = move_jobs(&free_bio_job_list, &c->free, BIO_JOB_CACHE / 2);
+        free_bio_job_num -= moved;
+        bio_cache_refills++;
+        pthread_mutex_unlock(&free_bio_job_mutex);
+        c->num += moved;
     }
-    pthread_mutex_unlock(&free_bio_job_mutex);
 
-    if (job == NULL)
+    if (c->num > 0)
     {
-        job = calloc(1, sizeof(*job));
-        if (job != NULL)
-        {
-            pthread_mutex_lock(&free_bio_job_mutex);
-            g_free_objs++;
-            pthread_mutex_unlock(&free_bio_job_mutex);
-        }
+        job = list_entry(c->free.next, struct bio_job, list);
+        list_del(&job->list);
+        c->num--;
+        return job;
     }
 
+    job = calloc(1, sizeof(*job));
+    if (job != NULL)
+    {
+        __sync_add_and_fetch(&g_free_objs, 1);
+    }
     return job;
 }
 
 void free_bio_job(struct bio_job *jobs)
 {
+    bio_job_cache *c = job_cache();
+    int moved = 0;
+
     if (jobs == NULL)
     {
         return;
     }
 
-    int freeit = 0;
-
-    pthread_mutex_lock(&free_bio_job_mutex);
     if (g_free_objs >= g_max_free_bio_obj)
     {
-        freeit = 1;
-        g_free_objs--;
-    }
-    else
-    {
-        list_add_tail(&jobs->list, &free_bio_job_list);
+        __sync_sub_and_fetch(&g_free_objs, 1);
+        my_free(jobs);
+        return;
     }
-    pthread_mutex_unlock(&free_bio_job_mutex);
 
-    if (freeit)
+    list_add(&jobs->list, &c->free);
+    c->num++;
+    if (c->num > BIO_JOB_CACHE)
     {
-        my_free(jobs);
+        pthread_mutex_lock(&free_bio_job_mutex);
+        moved = move_jobs(&c->free, &free_bio_job_list, BIO_JOB_CACHE / 2);
+        free_bio_job_num += moved;
+        bio_cache_returns++;
+        pthread_mutex_unlock(&free_bio_job_mutex);
+        c->num -= moved;
     }
 }
 
@@ -88,8 +224,59 @@ void mysleep(int sec)
     select(0, NULL, NULL, NULL, &interval);
 }
 
-/* Initialize the background system, spawning the thread. */
-int bio_init(void)
+static bio_queue *bio_queue_create()
+{
+    bio_queue *q = NULL;
+
+    if (posix_memalign((void **)&q, 64, sizeof(bio_queue)) != 0)
+    {
+        return NULL;
+    }
+    //written here, by the worker of the queue, so its pages are on its node.
+    memset(q, 0, sizeof(bio_queue));
+    if (mpsc_ring_init(&q->ring, BIO_RING_SIZE) != 0)
+    {
+        free(q);
+        return NULL;
+    }
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->condvar_empty, NULL);
+    pthread_cond_init(&q->condvar_space, NULL);
+    INIT_LIST_HEAD(&q->overflow);
+    return q;
+}
+
+/*
+    a worker pins itself to its CPU of bio_cpus first, then allocates the
+    queues it is home for (type % workers), so that the state of a shard
+    lives on the NUMA node of the core which runs it.
+*/
+static int bio_worker_setup(bio_worker *w)
+{
+    int type = 0;
+
+    w->cpu = affinity_cpu(bio_cpus, w->id);
+    if (w->cpu >= 0 && affinity_pin(bio_cpus, w->id) != 0)
+    {
+        w->cpu = -1;
+    }
+
+    for (type = w->id; type < BIO_NUM_OPS; type += bio_worker_num)
+    {
+        bio_queues[type] = bio_queue_create();
+        if (bio_queues[type] == NULL)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Initialize the background system, spawning the workers.
+ * threads <= 0 means one worker per online CPU, queue_limit <= 0 leaves
+ * the queues unbounded, cpus is the cpu spec the workers are pinned to
+ * one by one, see affinity.h. */
+int bio_init(int threads, int queue_limit, const char *cpus)
 {
     pthread_attr_t attr;
     pthread_t thread;
@@ -98,15 +285,41 @@ int bio_init(void)
 
     INIT_LIST_HEAD(&free_bio_job_list);
     pthread_mutex_init(&free_bio_job_mutex, NULL);
-    /* Initialization of state vars and objects */
-    for (j = 0; j < BIO_NUM_OPS; j++)
+    bio_queue_limit = queue_limit > 0 ? queue_limit : 0;
+    bio_cpus = cpus;
+    if (cpus != NULL && cpus[strspn(cpus, " \t")] != '\0' && affinity_cpu(cpus, 0) < 0)
+    {
+        //say it once here, the workers just skip pinning
+        debug_sys(LOG_ERR, "bad cpu list \"%s\" for worker_cpus, workers are not pinned\n", cpus);
+        bio_cpus = NULL;
+    }
+
+    if (threads <= 0)
+    {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads <= 0)
+    {
+        threads = 1;
+    }
+    else if (threads > BIO_MAX_WORKERS)
+    {
+        threads = BIO_MAX_WORKERS;
+    }
+
+    if (posix_memalign((void **)&bio_workers, 64, threads * sizeof(bio_worker)) != 0)
+    {
+        printf("Fatal: Can't allocate Background Job workers.\n");
+        return -1;
+    }
+    memset(bio_workers, 0, threads * sizeof(bio_worker));
+    for (j = 0; j < threads; j++)
     {
-        pthread_mutex_init(&bio_mutex[j], NULL);
-        pthread_cond_init(&bio_condvar[j], NULL);
-        pthread_cond_init(&bio_condvar_empty[j], NULL);
-        INIT_LIST_HEAD(&bio_jobs[j]);
-        bio_pending[j] = 0;
+        bio_workers[j].id = j;
+        bio_workers[j].cpu = -1;
+        pthread_mutex_init(&bio_workers[j].lock, NULL);
     }
+    bio_worker_num = threads;
 
     /* Set the stack size as by default it may be small in some system */
     pthread_attr_init(&attr);
@@ -121,134 +334,671 @@ int bio_init(void)
     }
     pthread_attr_setstacksize(&attr, stacksize);
 
-    /* Ready to spawn our threads. We use the single argument the thread
-     * function accepts in order to pass the job ID the thread is
-     * responsible of. */
-    for (j = 0; j < BIO_NUM_OPS; j++)
+    for (j = 0; j < threads; j++)
     {
-        void *arg = (void *)(unsigned long) j;
-        if (pthread_create(&thread, &attr, bio_process_jobs, arg) != 0)
+        if (pthread_create(&thread, &attr, bio_process_jobs, &bio_workers[j]) != 0)
         {
             printf("Fatal: Can't initialize Background Jobs.\n");
             return -1;
         }
     }
+
+    //no job may be queued before every queue exists.
+    pthread_mutex_lock(&bio_ready_lock);
+    while (bio_ready < threads)
+    {
+        pthread_cond_wait(&bio_ready_cond, &bio_ready_lock);
+    }
+    pthread_mutex_unlock(&bio_ready_lock);
+    if (bio_init_failed)
+    {
+        printf("Fatal: Can't allocate Background Job queues.\n");
+        return -1;
+    }
+
+    for (j = 0; j < threads; j++)
+    {
+        if (bio_workers[j].cpu >= 0)
+        {
+            debug_sys(LOG_NOTICE, "bio worker %d on cpu %d (node %d), home of queues %d + k * %d\n",
+                      j, bio_workers[j].cpu, affinity_node(bio_workers[j].cpu), j, threads);
+        }
+    }
+    debug_sys(LOG_NOTICE, "bio pool with %d workers for %d queues\n", threads, BIO_NUM_OPS);
     return 0;
 }
 
-int g_show_logs = 0;
+static void worker_push(bio_worker *w, int type)
+{
+    pthread_mutex_lock(&w->lock);
+    w->ready[(w->head + w->num) % BIO_NUM_OPS] = type;
+    w->num++;
+    pthread_mutex_unlock(&w->lock);
+}
 
-void bio_create_job(int type, bio_handle bh, void *arg)
+//take the oldest ready queue, only one that never waits if leaf_only.
+static int worker_take(bio_worker *w, int leaf_only)
 {
-    int bio_num = 0;
-    struct bio_job *job = new_bio_job();
-    if (job == NULL)
+    int i = 0, type = -1;
+
+    if (w->num == 0)
     {
-        return;
+        return -1;
     }
 
-    job->bh = bh;
-    job->arg = arg;
+    pthread_mutex_lock(&w->lock);
+    for (i = 0; i < w->num; i++)
+    {
+        int t = w->ready[(w->head + i) % BIO_NUM_OPS];
+        if (!leaf_only || t >= HANDLE_INOTIFY_THREADED)
+        {
+            type = t;
+            break;
+        }
+    }
+    if (type >= 0)
+    {
+        //close the gap, the list keeps its order.
+        for (; i > 0; i--)
+        {
+            w->ready[(w->head + i) % BIO_NUM_OPS] = w->ready[(w->head + i - 1) % BIO_NUM_OPS];
+        }
+        w->head = (w->head + 1) % BIO_NUM_OPS;
+        w->num--;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return type;
+}
+
+static int worker_steal(bio_worker *w, int leaf_only)
+{
+    int i = 0, type = -1;
+
+    for (i = 1; i < bio_worker_num; i++)
+    {
+        type = worker_take(&bio_workers[(w->id + i) % bio_worker_num], leaf_only);
+        if (type >= 0)
+        {
+            w->steals++;
+            return type;
+        }
+    }
+    return -1;
+}
+
+static int any_ready()
+{
+    int i = 0;
+
+    for (i = 0; i < bio_worker_num; i++)
+    {
+        if (bio_workers[i].num > 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    INIT_LIST_HEAD(&job->list);
-    pthread_mutex_lock(&bio_mutex[type]);
-    list_add_tail(&job->list, &bio_jobs[type]);
-    bio_num = ++bio_pending[type];
-    pthread_cond_signal(&bio_condvar[type]);
-    pthread_mutex_unlock(&bio_mutex[type]);
+static void bio_wake_worker()
+{
+    //pairs with the barrier of a worker going to sleep.
+    __sync_synchronize();
+    if (bio_idle > 0)
+    {
+        pthread_mutex_lock(&bio_idle_lock);
+        bio_wakeups++;
+        pthread_cond_signal(&bio_idle_cond);
+        pthread_mutex_unlock(&bio_idle_lock);
+    }
+}
+
+static void bio_schedule(int type)
+{
+    worker_push(&bio_workers[type % bio_worker_num], type);
+    bio_wake_worker();
+}
+
+static uint64_t bio_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int hist_index(unsigned long long v)
+{
+    int exp = 0;
+
+    if (v < HIST_SUB)
+    {
+        return (int)v;
+    }
+    exp = 63 - __builtin_clzll(v);
+    if (exp >= HIST_MAX_EXP)
+    {
+        return HIST_BUCKETS - 1;
+    }
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB + (int)((v >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+//the lowest value of a bucket.
+static unsigned long long hist_value(int index)
+{
+    int exp = index / HIST_SUB + HIST_SUB_BITS - 1;
+
+    if (index < HIST_SUB)
+    {
+        return index;
+    }
+    return (unsigned long long)(HIST_SUB + index % HIST_SUB) << (exp - HIST_SUB_BITS);
+}
+
+static void hist_add(bio_hist *h, unsigned long long v)
+{
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    if (v > h->max)
+    {
+        h->max = v;
+    }
+}
+
+//the value below which permille of the samples fall, to the bucket.
+static unsigned long long hist_percentile(bio_hist *h, int permille)
+{
+    unsigned long long want = (h->count * permille + 999) / 1000, seen = 0;
+    int i = 0;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen >= want && seen > 0)
+        {
+            return hist_value(i);
+        }
+    }
+    return h->max;
+}
+
+static int bio_queue_empty(bio_queue *q)
+{
+    return mpsc_ring_empty(&q->ring) && q->overflow_num == 0;
+}
+
+int g_show_logs = 0;
+
+static void bio_queue_job(int type, struct bio_job *job)
+{
+    bio_queue *q = bio_queues[type];
+    unsigned long long bio_num = 0;
+
+    job->queued = bio_now_us();
+    bio_num = __sync_add_and_fetch(&q->pending, 1);
+
+    if (q->overflow_num > 0 || mpsc_ring_push(&q->ring, job) != 0)
+    {
+        pthread_mutex_lock(&q->mutex);
+        INIT_LIST_HEAD(&job->list);
+        list_add_tail(&job->list, &q->overflow);
+        q->overflow_num++;
+        q->overflows++;
+        pthread_mutex_unlock(&q->mutex);
+    }
+
+    //the worker of a queue clears scheduled before it checks for jobs.
+    __sync_synchronize();
+    if (q->scheduled == 0 && __sync_bool_compare_and_swap(&q->scheduled, 0, 1))
+    {
+        bio_schedule(type);
+    }
 
-    if (bio_num > g_max_bio_penging)
+    if (bio_num > q->high_water)
+    {
+        q->high_water = bio_num;
+    }
+    if (bio_queue_limit > 0 && bio_num > bio_queue_limit)
     {
         if (g_show_logs % 1000 == 0)
         {
-            debug_sys(LOG_NOTICE, "There are so many jobs in queue\n");
+            debug_sys(LOG_NOTICE, "bio queue %d has %llu jobs, over its limit %llu\n",
+                      type, bio_num, bio_queue_limit);
             g_show_logs = 0;
         }
         g_show_logs++;
     }
 }
 
+//the queue took bio_queue_limit jobs not done yet.
+int bio_queue_full(int type)
+{
+    bio_queue *q = bio_queues[type];
+
+    return bio_queue_limit > 0 && q->pending >= bio_queue_limit;
+}
+
+int bio_create_job(int type, bio_handle bh, void *arg)
+{
+    struct bio_job *job = new_bio_job();
+    if (job == NULL)
+    {
+        return -1;
+    }
+
+    job->bh = bh;
+    job->arg = arg;
+    job->embedded = 0;
+    bio_queue_job(type, job);
+    return 0;
+}
+
+//queue a job whose memory belongs to the caller, usually embedded in arg.
+//it is taken off the queue before bh runs, so bh may free it.
+void bio_post_job(int type, struct bio_job *job, bio_handle bh, void *arg)
+{
+    job->bh = bh;
+    job->arg = arg;
+    job->embedded = 1;
+    bio_queue_job(type, job);
+}
+
+//as bio_create_job and bio_post_job, but -1 if the queue is full.
+int bio_try_create_job(int type, bio_handle bh, void *arg)
+{
+    if (bio_queue_full(type))
+    {
+        bio_queues[type]->full_hits++;
+        return -1;
+    }
+    return bio_create_job(type, bh, arg);
+}
+
+int bio_try_post_job(int type, struct bio_job *job, bio_handle bh, void *arg)
+{
+    if (bio_queue_full(type))
+    {
+        bio_queues[type]->full_hits++;
+        return -1;
+    }
+    bio_post_job(type, job, bh, arg);
+    return 0;
+}
+
+//take up to max jobs in order, the overflow list in one critical section.
+static int bio_pop_jobs(bio_queue *q, struct bio_job **jobs, int max)
+{
+    struct bio_job *job = NULL;
+    int n = 0;
+
+    while (n < max && (job = (struct bio_job *)mpsc_ring_pop(&q->ring)) != NULL)
+    {
+        jobs[n++] = job;
+    }
+
+    if (n == max || q->overflow_num == 0)
+    {
+        return n;
+    }
+
+    pthread_mutex_lock(&q->mutex);
+    while (n < max && !list_empty(&q->overflow))
+    {
+        job = list_entry(q->overflow.next, struct bio_job, list);
+        list_del(&job->list);
+        q->overflow_num--;
+        jobs[n++] = job;
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return n;
+}
+
+static void bio_run_job(bio_queue *q, struct bio_job *ln)
+{
+    bio_handle bh = ln->bh;
+    void *job_arg = ln->arg;
+    unsigned long long left = 0;
+    uint64_t start = bio_now_us(), queued = ln->queued;
+
+    if (!ln->embedded)
+    {
+        free_bio_job(ln);
+    }
+
+    //process it here
+    bh(job_arg);
+    q->jobs++;
+    hist_add(&q->wait_us, start > queued ? start - queued : 0);
+    hist_add(&q->run_us, bio_now_us() - start);
+
+    left = __sync_sub_and_fetch(&q->pending, 1);
+    __sync_synchronize();
+    if (left == 0 && q->waiters > 0)
+    {
+        pthread_mutex_lock(&q->mutex);
+        pthread_cond_broadcast(&q->condvar_empty);
+        pthread_mutex_unlock(&q->mutex);
+    }
+    if (left < bio_queue_limit && q->space_waiters > 0)
+    {
+        pthread_mutex_lock(&q->mutex);
+        pthread_cond_broadcast(&q->condvar_space);
+        pthread_mutex_unlock(&q->mutex);
+    }
+}
+
+//keep an event queue aside until bio_start_jobs, it stays scheduled.
+static int bio_park(int type)
+{
+    int parked = 0;
+
+    pthread_mutex_lock(&bio_park_lock);
+    if (!bio_started)
+    {
+        bio_parked[bio_parked_num++] = type;
+        parked = 1;
+    }
+    pthread_mutex_unlock(&bio_park_lock);
+    return parked;
+}
+
+static void bio_run_queue(bio_worker *w, int type)
+{
+    bio_queue *q = bio_queues[type];
+    struct bio_job *jobs[BIO_QUEUE_BATCH];
+    int i = 0, n = 0;
+
+    if (type < HANDLE_SCAN && !bio_started && bio_park(type))
+    {
+        return;
+    }
+
+    n = bio_pop_jobs(q, jobs, BIO_QUEUE_BATCH);
+    for (i = 0; i < n; i++)
+    {
+        bio_run_job(q, jobs[i]);
+    }
+    w->jobs += n;
+
+    if (n == BIO_QUEUE_BATCH)
+    {
+        //more may be left, go behind the other ready queues.
+        worker_push(w, type);
+        bio_wake_worker();
+        return;
+    }
+
+    q->scheduled = 0;
+    __sync_synchronize();
+    if (!bio_queue_empty(q) && __sync_bool_compare_and_swap(&q->scheduled, 0, 1))
+    {
+        worker_push(w, type);
+    }
+}
+
+/*
+    run one ready queue that never waits itself, for a worker which waits
+    inside a job. the pool can not deadlock on its own waits then, even
+    with a single worker.
+*/
+static int bio_help(bio_worker *w)
+{
+    int type = worker_take(w, 1);
+
+    if (type < 0)
+    {
+        type = worker_steal(w, 1);
+    }
+    if (type < 0)
+    {
+        return 0;
+    }
+    bio_run_queue(w, type);
+    return 1;
+}
+
 void *bio_process_jobs(void *arg)
 {
-    struct bio_job *ln = NULL;
-    unsigned long type = (unsigned long) arg;
+    bio_worker *w = (bio_worker *)arg;
+    int type = -1, ret = 0;
 
     pthread_detach(pthread_self());
+    bio_self = w;
 
-    //wait the initial process is ready.
-    while (g_build_index_ok == 0)
+    ret = bio_worker_setup(w);
+    pthread_mutex_lock(&bio_ready_lock);
+    if (ret != 0)
     {
-        //if the start flag is 0, sleep 5s, and try it again.
-        mysleep(1);
+        bio_init_failed = 1;
+    }
+    bio_ready++;
+    pthread_cond_signal(&bio_ready_cond);
+    pthread_mutex_unlock(&bio_ready_lock);
+    if (ret != 0)
+    {
+        return NULL;
     }
 
-    pthread_mutex_lock(&bio_mutex[type]);
     while (1)
     {
-        /* The loop always starts with the lock hold. */
-        if (list_empty(&bio_jobs[type]))
+        type = worker_take(w, 0);
+        if (type < 0)
+        {
+            type = worker_steal(w, 0);
+        }
+        if (type >= 0)
         {
-            pthread_cond_wait(&bio_condvar[type], &bio_mutex[type]);
+            bio_run_queue(w, type);
             continue;
         }
-        /* Pop the job from the queue. */
-        ln = list_entry(bio_jobs[type].next, struct bio_job, list);
-        pthread_mutex_unlock(&bio_mutex[type]);
 
-        //process it here
-        ln->bh(ln->arg);
-
-        pthread_mutex_lock(&bio_mutex[type]);
-        list_del(&ln->list);
-        free_bio_job(ln);
-        bio_pending[type]--;
-        if (bio_pending[type] == 0)
+        pthread_mutex_lock(&bio_idle_lock);
+        bio_idle++;
+        //a producer reads bio_idle after putting a queue on a ready list.
+        __sync_synchronize();
+        if (!any_ready())
         {
-            pthread_cond_signal(&bio_condvar_empty[type]);
+            pthread_cond_wait(&bio_idle_cond, &bio_idle_lock);
         }
+        bio_idle--;
+        pthread_mutex_unlock(&bio_idle_lock);
+    }
+    return NULL;
+}
+
+//the initial index is built, the event queues may run now.
+void bio_start_jobs()
+{
+    int i = 0;
+
+    pthread_mutex_lock(&bio_park_lock);
+    bio_started = 1;
+    g_build_index_ok = 1;
+    for (i = 0; i < bio_parked_num; i++)
+    {
+        bio_schedule(bio_parked[i]);
     }
+    bio_parked_num = 0;
+    pthread_mutex_unlock(&bio_park_lock);
 }
 
 /* Return the number of pending jobs of the specified type. */
 unsigned long long bio_jobnum(int type)
 {
-    unsigned long long val;
-    pthread_mutex_lock(&bio_mutex[type]);
-    val = bio_pending[type];
-    pthread_mutex_unlock(&bio_mutex[type]);
-    return val;
+    return bio_queues[type]->pending;
 }
 
-static void wait_for_one_thread(int type)
+//wait until fewer than below jobs of q are pending, waiters counts the threads on cond.
+static void bio_wait_pending(bio_queue *q, unsigned long long below,
+                             pthread_cond_t *cond, volatile int *waiters)
 {
-    pthread_mutex_lock(&bio_mutex[type]);
-    while (1)
+    struct timeval now;
+    struct timespec until;
+
+    if (q->pending < below)
     {
-        if (bio_pending[type] == 0)
+        return;
+    }
+
+    pthread_mutex_lock(&q->mutex);
+    (*waiters)++;
+    __sync_synchronize();
+    while (q->pending >= below)
+    {
+        if (bio_self == NULL)
         {
-            break;
+            pthread_cond_wait(cond, &q->mutex);
+            continue;
         }
 
-        if (bio_pending[type] > 0)
+        //a worker runs the ready queues meanwhile, and looks again now and then.
+        pthread_mutex_unlock(&q->mutex);
+        while (q->pending >= below && bio_help(bio_self))
         {
-            pthread_cond_wait(&bio_condvar_empty[type], &bio_mutex[type]);
-            continue;
+        }
+        pthread_mutex_lock(&q->mutex);
+        if (q->pending >= below)
+        {
+            gettimeofday(&now, NULL);
+            until.tv_sec = now.tv_sec;
+            until.tv_nsec = (now.tv_usec + BIO_HELP_WAIT_MS * 1000) * 1000L;
+            if (until.tv_nsec >= 1000000000L)
+            {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(cond, &q->mutex, &until);
         }
     }
-    pthread_mutex_unlock(&bio_mutex[type]);
+    (*waiters)--;
+    pthread_mutex_unlock(&q->mutex);
+}
+
+static void wait_for_one_thread(int type)
+{
+    bio_queue *q = bio_queues[type];
+    bio_wait_pending(q, 1, &q->condvar_empty, &q->waiters);
+}
+
+//wait until the queue has room for another job, the way to block a producer.
+void bio_wait_space(int type)
+{
+    bio_queue *q = bio_queues[type];
+
+    if (bio_queue_limit > 0)
+    {
+        bio_wait_pending(q, bio_queue_limit, &q->condvar_space, &q->space_waiters);
+    }
+}
+
+//wait until a counter of jobs drops to 0, the jobs decrement it when done.
+void bio_wait_done(atomic_t *counter)
+{
+    while (atomic_read(counter) != 0)
+    {
+        if (bio_self == NULL || !bio_help(bio_self))
+        {
+            usleep(100);
+        }
+    }
+}
+
+//wait until one bio worker thread finished its jobs.
+void wait_for_bio_thread(int type)
+{
+    wait_for_one_thread(type);
 }
 
 //wait until all bio worker threads to finish their jobs.
-//bio worker index starts from HANDLE_INOTIFY_THREADED to BIO_NUM_OPS.
+//bio worker index starts from HANDLE_INOTIFY_THREADED to HANDLE_SCAN.
 void wait_for_bio_threads()
 {
     int i = HANDLE_INOTIFY_THREADED;
-    for (; i < BIO_NUM_OPS; i++)
+    for (; i < HANDLE_SCAN; i++)
     {
         wait_for_one_thread(i);
     }
 }
 
+static void print_bio_hist(const char *name, bio_hist *h)
+{
+    debug_sys(LOG_NOTICE, "    %s us: p50 %llu, p90 %llu, p99 %llu, p999 %llu, max %llu\n", name,
+              hist_percentile(h, 500), hist_percentile(h, 900), hist_percentile(h, 990),
+              hist_percentile(h, 999), h->max);
+}
+
+/*
+    the histograms count from the start, the rates are since the last
+    call. a threaded queue far above the mean rate is a hot RSHash shard.
+*/
+void print_bio_stats()
+{
+    static uint64_t printed = 0;
+    unsigned long long jobs = 0, overflows = 0, steals = 0, full_hits = 0, high_water = 0;
+    unsigned long long shard_jobs = 0, hottest_jobs = 0, delta = 0;
+    uint64_t now = bio_now_us();
+    double secs = printed > 0 && now > printed ? (now - printed) / 1000000.0 : 0;
+    int i = 0, highest = 0, hottest = -1;
+
+    for (i = 0; i < BIO_NUM_OPS; i++)
+    {
+        bio_queue *q = bio_queues[i];
+        jobs += q->jobs;
+        overflows += q->overflows;
+        full_hits += q->full_hits;
+        if (q->high_water > high_water)
+        {
+            high_water = q->high_water;
+            highest = i;
+        }
+        if (q->full_hits > 0)
+        {
+            debug_sys(LOG_NOTICE, "bio queue %d: pending %llu, high water %llu, found full %llu\n",
+                      i, q->pending, q->high_water, q->full_hits);
+        }
+
+        delta = q->jobs - q->printed_jobs;
+        q->printed_jobs = q->jobs;
+        if (i >= HANDLE_INOTIFY_THREADED && i < HANDLE_SCAN)
+        {
+            shard_jobs += delta;
+            if (hottest < 0 || delta > hottest_jobs)
+            {
+                hottest = i;
+                hottest_jobs = delta;
+            }
+        }
+        if (delta == 0)
+        {
+            continue;
+        }
+        debug_sys(LOG_NOTICE, "bio queue %d: jobs %llu, %.1f jobs/sec\n",
+                  i, q->jobs, secs > 0 ? delta / secs : 0.0);
+        print_bio_hist("wait", &q->wait_us);
+        print_bio_hist("run ", &q->run_us);
+    }
+    printed = now;
+
+    for (i = 0; i < bio_worker_num; i++)
+    {
+        steals += bio_workers[i].steals;
+        debug_sys(LOG_NOTICE, "bio worker %d: cpu %d, jobs %llu, queues stolen %llu\n",
+                  i, bio_workers[i].cpu, bio_workers[i].jobs, bio_workers[i].steals);
+    }
+    debug_sys(LOG_NOTICE, "bio jobs %llu, worker wakeups %llu, queues stolen %llu, jobs past a full ring %llu\n",
+              jobs, bio_wakeups, steals, overflows);
+    debug_sys(LOG_NOTICE, "bio queue limit %llu, highest high water %llu on queue %d, found full %llu\n",
+              bio_queue_limit, high_water, highest, full_hits);
+    debug_sys(LOG_NOTICE, "bio job records %u, %d on the shared list, bulk refills %llu, bulk returns %llu\n",
+              g_free_objs, free_bio_job_num, bio_cache_refills, bio_cache_returns);
+    if (shard_jobs > 0)
+    {
+        debug_sys(LOG_NOTICE, "hottest file event queue %d ran %llu of %llu jobs, %.2f times the mean\n",
+                  hottest, hottest_jobs, shard_jobs,
+                  (double)hottest_jobs * (HANDLE_SCAN - HANDLE_INOTIFY_THREADED) / shard_jobs);
+    }
+}
+
 
 ////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////
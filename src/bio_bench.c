@@ -0,0 +1,332 @@
+/*
+    bio_bench: jobs per second through the bio job queues.
+
+    compares the list + condvar queue bio.c used before with the mpsc
+    ring queue it uses now. producers spread empty jobs over the queues,
+    each queue has one consumer thread, like HANDLE_INOTIFY_THREADED.
+
+    usage: bio_bench [producers] [queues] [jobs per producer]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "linux_list.h"
+#include "mpsc_ring.h"
+
+#define BENCH_RING_SIZE 1024
+
+typedef struct bench_job
+{
+    struct list_head list;
+    unsigned long value;
+} bench_job;
+
+typedef struct bench_queue
+{
+    //list + condvar
+    struct list_head jobs;
+    unsigned long long pending;
+
+    //mpsc ring
+    mpsc_ring ring;
+    struct list_head overflow;
+    volatile int overflow_num;
+    volatile int sleeping;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t condvar;
+    unsigned long long expected;
+    unsigned long long expected_sum;
+    unsigned long long done;
+    unsigned long long sum;
+    unsigned long long wakeups;
+} bench_queue;
+
+typedef struct bench_producer
+{
+    int id;
+    bench_job *jobs;
+} bench_producer;
+
+static int g_producers = 1;
+static int g_queues = 128;
+static unsigned long g_jobs = 2000000;
+static bench_queue *g_bench_queues = NULL;
+static volatile int g_start = 0;
+
+static double now_sec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void run_job(bench_queue *q, bench_job *job)
+{
+    q->sum += job->value;
+    q->done++;
+}
+
+////////////////////////////////////////////////////////////////////
+//the queue as it was: one lock round trip and one signal per job.
+
+static void list_push(bench_queue *q, bench_job *job)
+{
+    pthread_mutex_lock(&q->mutex);
+    list_add_tail(&job->list, &q->jobs);
+    q->pending++;
+    pthread_cond_signal(&q->condvar);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+static void *list_consumer(void *arg)
+{
+    bench_queue *q = (bench_queue *)arg;
+    bench_job *job = NULL;
+
+    pthread_mutex_lock(&q->mutex);
+    while (q->done < q->expected)
+    {
+        if (list_empty(&q->jobs))
+        {
+            q->wakeups++;
+            pthread_cond_wait(&q->condvar, &q->mutex);
+            continue;
+        }
+        job = list_entry(q->jobs.next, bench_job, list);
+        pthread_mutex_unlock(&q->mutex);
+
+        run_job(q, job);
+
+        pthread_mutex_lock(&q->mutex);
+        list_del(&job->list);
+        q->pending--;
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+//the ring queue of bio.c.
+
+static void ring_push(bench_queue *q, bench_job *job)
+{
+    if (q->overflow_num > 0 || mpsc_ring_push(&q->ring, job) != 0)
+    {
+        pthread_mutex_lock(&q->mutex);
+        list_add_tail(&job->list, &q->overflow);
+        q->overflow_num++;
+        pthread_mutex_unlock(&q->mutex);
+    }
+
+    __sync_synchronize();
+    if (q->sleeping && __sync_bool_compare_and_swap(&q->sleeping, 1, 0))
+    {
+        pthread_mutex_lock(&q->mutex);
+        pthread_cond_signal(&q->condvar);
+        pthread_mutex_unlock(&q->mutex);
+    }
+}
+
+static bench_job *ring_pop(bench_queue *q)
+{
+    bench_job *job = (bench_job *)mpsc_ring_pop(&q->ring);
+
+    if (job != NULL || q->overflow_num == 0)
+    {
+        return job;
+    }
+
+    pthread_mutex_lock(&q->mutex);
+    if (!list_empty(&q->overflow))
+    {
+        job = list_entry(q->overflow.next, bench_job, list);
+        list_del(&job->list);
+        q->overflow_num--;
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return job;
+}
+
+static void *ring_consumer(void *arg)
+{
+    bench_queue *q = (bench_queue *)arg;
+    bench_job *job = NULL;
+
+    while (q->done < q->expected)
+    {
+        job = ring_pop(q);
+        if (job == NULL)
+        {
+            pthread_mutex_lock(&q->mutex);
+            while (1)
+            {
+                q->sleeping = 1;
+                __sync_synchronize();
+                if (!mpsc_ring_empty(&q->ring) || q->overflow_num > 0)
+                {
+                    break;
+                }
+                q->wakeups++;
+                pthread_cond_wait(&q->condvar, &q->mutex);
+            }
+            q->sleeping = 0;
+            pthread_mutex_unlock(&q->mutex);
+            continue;
+        }
+        run_job(q, job);
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+
+typedef void (*push_func)(bench_queue *q, bench_job *job);
+static push_func g_push = NULL;
+
+static void *producer(void *arg)
+{
+    bench_producer *p = (bench_producer *)arg;
+    unsigned long i = 0;
+
+    while (g_start == 0)
+    {
+        __sync_synchronize();
+    }
+
+    for (i = 0; i < g_jobs; i++)
+    {
+        g_push(&g_bench_queues[(i + p->id) % g_queues], &p->jobs[i]);
+    }
+    return NULL;
+}
+
+static int run_bench(const char *name, push_func push, void *(*consumer)(void *))
+{
+    pthread_t *cthreads = (pthread_t *)calloc(g_queues, sizeof(pthread_t));
+    pthread_t *pthreads = (pthread_t *)calloc(g_producers, sizeof(pthread_t));
+    bench_producer *producers = (bench_producer *)calloc(g_producers, sizeof(bench_producer));
+    unsigned long long total = (unsigned long long)g_producers * g_jobs, wakeups = 0;
+    double begin = 0, used = 0;
+    int i = 0;
+    unsigned long j = 0;
+
+    g_bench_queues = (bench_queue *)calloc(g_queues, sizeof(bench_queue));
+    if (cthreads == NULL || pthreads == NULL || producers == NULL || g_bench_queues == NULL)
+    {
+        printf("out of memory\n");
+        return -1;
+    }
+
+    for (i = 0; i < g_queues; i++)
+    {
+        bench_queue *q = &g_bench_queues[i];
+        INIT_LIST_HEAD(&q->jobs);
+        INIT_LIST_HEAD(&q->overflow);
+        pthread_mutex_init(&q->mutex, NULL);
+        pthread_cond_init(&q->condvar, NULL);
+        if (mpsc_ring_init(&q->ring, BENCH_RING_SIZE) != 0)
+        {
+            printf("out of memory\n");
+            return -1;
+        }
+    }
+
+    for (i = 0; i < g_producers; i++)
+    {
+        producers[i].id = i;
+        producers[i].jobs = (bench_job *)calloc(g_jobs, sizeof(bench_job));
+        if (producers[i].jobs == NULL)
+        {
+            printf("out of memory\n");
+            return -1;
+        }
+        for (j = 0; j < g_jobs; j++)
+        {
+            producers[i].jobs[j].value = j;
+            g_bench_queues[(j + i) % g_queues].expected++;
+            g_bench_queues[(j + i) % g_queues].expected_sum += j;
+        }
+    }
+
+    g_push = push;
+    g_start = 0;
+    for (i = 0; i < g_queues; i++)
+    {
+        pthread_create(&cthreads[i], NULL, consumer, &g_bench_queues[i]);
+    }
+    for (i = 0; i < g_producers; i++)
+    {
+        pthread_create(&pthreads[i], NULL, producer, &producers[i]);
+    }
+
+    begin = now_sec();
+    g_start = 1;
+    for (i = 0; i < g_producers; i++)
+    {
+        pthread_join(pthreads[i], NULL);
+    }
+    for (i = 0; i < g_queues; i++)
+    {
+        pthread_join(cthreads[i], NULL);
+        wakeups += g_bench_queues[i].wakeups;
+    }
+    used = now_sec() - begin;
+
+    for (i = 0; i < g_queues; i++)
+    {
+        if (g_bench_queues[i].sum != g_bench_queues[i].expected_sum)
+        {
+            printf("%s: queue %d lost or repeated jobs\n", name, i);
+            return -1;
+        }
+    }
+
+    printf("%-14s %12.0f jobs/sec, %llu jobs in %.3f sec, %llu consumer sleeps\n",
+           name, used > 0 ? total / used : 0.0, total, used, wakeups);
+
+    for (i = 0; i < g_queues; i++)
+    {
+        mpsc_ring_destroy(&g_bench_queues[i].ring);
+    }
+    for (i = 0; i < g_producers; i++)
+    {
+        free(producers[i].jobs);
+    }
+    free(g_bench_queues);
+    free(producers);
+    free(pthreads);
+    free(cthreads);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+    {
+        g_producers = atoi(argv[1]);
+    }
+    if (argc > 2)
+    {
+        g_queues = atoi(argv[2]);
+    }
+    if (argc > 3)
+    {
+        g_jobs = strtoul(argv[3], NULL, 10);
+    }
+    if (g_producers <= 0 || g_queues <= 0 || g_jobs == 0)
+    {
+        printf("usage: %s [producers] [queues] [jobs per producer]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%d producers, %d queues, %lu jobs per producer\n", g_producers, g_queues, g_jobs);
+    if (run_bench("list+condvar", list_push, list_consumer) != 0
+        || run_bench("mpsc ring", ring_push, ring_consumer) != 0)
+    {
+        return 1;
+    }
+    return 0;
+}
@@ -2,6 +2,7 @@
 #include "headercxx.h"
 #include "config.h"
 #include "util.h"
+#include "inotifytools.h"
 
 static struct command config_commands[] =
 {
@@ -59,6 +60,78 @@ static struct command config_commands[] =
         offsetof(struct config, check_one_folder_interval)
     },
 
+    {
+        "notify_backend",
+        config_set_string,
+        offsetof(struct config, notify_backend)
+    },
+
+    {
+        "coalesce_window_ms",
+        config_set_int,
+        offsetof(struct config, coalesce_window_ms)
+    },
+
+    {
+        "overflow_rescan_rate",
+        config_set_int,
+        offsetof(struct config, overflow_rescan_rate)
+    },
+
+    {
+        "inotify_instances",
+        config_set_int,
+        offsetof(struct config, inotify_instances)
+    },
+
+    {
+        "bio_threads",
+        config_set_int,
+        offsetof(struct config, bio_threads)
+    },
+
+    {
+        "bio_queue_limit",
+        config_set_int,
+        offsetof(struct config, bio_queue_limit)
+    },
+
+    {
+        "queue_full_policy",
+        config_set_string,
+        offsetof(struct config, queue_full_policy)
+    },
+
+    {
+        "worker_cpus",
+        config_set_string,
+        offsetof(struct config, worker_cpus)
+    },
+
+    {
+        "reader_cpus",
+        config_set_string,
+        offsetof(struct config, reader_cpus)
+    },
+
+    {
+        "service_cpus",
+        config_set_string,
+        offsetof(struct config, service_cpus)
+    },
+
+    {
+        "delta_flush_ms",
+        config_set_int,
+        offsetof(struct config, delta_flush_ms)
+    },
+
+    {
+        "lazy_rollup",
+        config_set_int,
+        offsetof(struct config, lazy_rollup)
+    },
+
     null_command
 };
 
@@ -123,6 +196,46 @@ int init_config(const char *file, config *cfg)
     {
         cfg->check_one_folder_interval = 30;
     }
+    if (cfg->coalesce_window_ms < 0)
+    {
+        cfg->coalesce_window_ms = 0;
+    }
+    else if (cfg->coalesce_window_ms > 1000)
+    {
+        cfg->coalesce_window_ms = 1000;
+    }
+    if (cfg->overflow_rescan_rate <= 0)
+    {
+        cfg->overflow_rescan_rate = 20;
+    }
+    if (cfg->inotify_instances <= 0)
+    {
+        cfg->inotify_instances = 1;
+    }
+    else if (cfg->inotify_instances > INOTIFYTOOLS_MAX_INSTANCES)
+    {
+        cfg->inotify_instances = INOTIFYTOOLS_MAX_INSTANCES;
+    }
+    if (cfg->bio_threads < 0)
+    {
+        cfg->bio_threads = 0;
+    }
+    if (cfg->bio_queue_limit < 0)
+    {
+        cfg->bio_queue_limit = 0;
+    }
+    if (cfg->delta_flush_ms < 0)
+    {
+        cfg->delta_flush_ms = 0;
+    }
+    else if (cfg->delta_flush_ms > 1000)
+    {
+        cfg->delta_flush_ms = 1000;
+    }
+    if (cfg->lazy_rollup != 0)
+    {
+        cfg->lazy_rollup = 1;
+    }
 
 
     print_config(cfg);
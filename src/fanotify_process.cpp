@@ -0,0 +1,404 @@
+#include "header.h"
+#include "headercxx.h"
+#include "inotify.h"
+#include "inotify-nosys.h"
+#include "inotify_process.h"
+#include "monitor_dir.h"
+#include "util.h"
+#include "log.h"
+
+#include <sys/fanotify.h>
+#include <sys/statfs.h>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+/*
+    fanotify event source. one filesystem mark per filesystem replaces the
+    inotify watch per directory. events carry the handle of the parent
+    directory plus the entry name (FAN_REPORT_DFID_NAME); the handle is
+    resolved to a path once and cached. events are converted to the
+    equivalent IN_* mask and handed to the same processing as inotify.
+*/
+
+#define FAN_BUF_SIZE        (64 * 1024)
+#define MAX_DIR_HANDLES     (1024 * 1024)
+#define DELETED_SUFFIX      " (deleted)"    //readlink of an unlinked dir
+
+static int g_fan_fd = -1;
+
+//st_dev of the marked filesystems, and an open dir per fsid for open_by_handle_at.
+typedef unordered_map<uint64_t, int> fsidFdMap;
+static set<dev_t> g_fan_devs;
+static fsidFdMap g_fan_mount_fds;
+static pthread_mutex_t g_fan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//fsid + file handle -> directory path, and back, only used by the reader thread.
+typedef unordered_map<string, string> dirHandleMap;
+typedef map<string, string> dirPathMap;
+static dirHandleMap g_dir_handles;
+static dirPathMap g_dir_paths;
+
+#ifdef FAN_REPORT_DFID_NAME
+
+static uint64_t fsid_key(const int32_t *val)
+{
+    return ((uint64_t)(uint32_t)val[0] << 32) | (uint32_t)val[1];
+}
+
+int fanotify_init_backend()
+{
+    g_fan_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_REPORT_DFID_NAME,
+                             O_RDONLY | O_LARGEFILE);
+    if (g_fan_fd < 0)
+    {
+        debug_sys(LOG_ERR, "fanotify_init failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+//mark the filesystem holding dir, once per filesystem.
+int fanotify_watch_dir(const char *dir)
+{
+    struct stat64 st;
+    struct statfs sfs;
+    uint64_t mask = FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO
+                    | FAN_CLOSE_WRITE | FAN_ONDIR;
+    int fd = -1, ret = 0;
+
+    if (stat64(dir, &st) != 0 || statfs(dir, &sfs) != 0)
+    {
+        debug_sys(LOG_ERR, "Couldn't stat %s: %s\n", dir, strerror(errno));
+        return -2;
+    }
+
+    pthread_mutex_lock(&g_fan_lock);
+    if (g_fan_devs.find(st.st_dev) != g_fan_devs.end())
+    {
+        pthread_mutex_unlock(&g_fan_lock);
+        return 0;
+    }
+
+    if (fanotify_mark(g_fan_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, AT_FDCWD, dir) != 0)
+    {
+        debug_sys(LOG_ERR, "fanotify_mark for filesystem of %s failed: %s\n", dir, strerror(errno));
+        ret = -2;
+        goto out;
+    }
+
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        debug_sys(LOG_ERR, "open %s failed: %s\n", dir, strerror(errno));
+        ret = -2;
+        goto out;
+    }
+
+    g_fan_devs.insert(st.st_dev);
+    g_fan_mount_fds.insert(make_pair(fsid_key((int32_t *)&sfs.f_fsid), fd));
+    debug_sys(LOG_NOTICE, "fanotify marked the filesystem of %s\n", dir);
+
+out:
+    pthread_mutex_unlock(&g_fan_lock);
+    return ret;
+}
+
+//drop the cached handles of dir and of the directories below it.
+static void forget_dir_handles(const string &dir)
+{
+    string below = dir + "/";
+    dirPathMap::iterator it = g_dir_paths.find(dir);
+
+    if (it != g_dir_paths.end())
+    {
+        g_dir_handles.erase(it->second);
+        g_dir_paths.erase(it);
+    }
+    it = g_dir_paths.lower_bound(below);
+    while (it != g_dir_paths.end() && it->first.compare(0, below.length(), below) == 0)
+    {
+        g_dir_handles.erase(it->second);
+        g_dir_paths.erase(it++);
+    }
+}
+
+static int resolve_dir_handle(uint64_t fsid, struct file_handle *handle, string &dir)
+{
+    char link[64] = {0};
+    char path[MAX_PATH] = {0};
+    int mount_fd = -1, fd = -1;
+    ssize_t len = 0;
+    string key = string((char *)&fsid, sizeof(fsid))
+                 + string((char *)handle, sizeof(struct file_handle) + handle->handle_bytes);
+
+    dirHandleMap::iterator it = g_dir_handles.find(key);
+    if (it != g_dir_handles.end())
+    {
+        dir = it->second;
+        return 0;
+    }
+
+    pthread_mutex_lock(&g_fan_lock);
+    fsidFdMap::iterator itfd = g_fan_mount_fds.find(fsid);
+    if (itfd != g_fan_mount_fds.end())
+    {
+        mount_fd = itfd->second;
+    }
+    pthread_mutex_unlock(&g_fan_lock);
+
+    if (mount_fd < 0)
+    {
+        return -1;
+    }
+
+    //the directory may be gone already, e.g. a create right before rmdir.
+    fd = open_by_handle_at(mount_fd, handle, O_PATH);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    len = readlink(link, path, sizeof(path) - 1);
+    close(fd);
+    if (len <= 0)
+    {
+        return -1;
+    }
+    path[len] = '\0';
+
+    //the directory was removed after the event, its name is no path any more.
+    if ((size_t)len >= sizeof(DELETED_SUFFIX) - 1
+        && strcmp(path + len - (sizeof(DELETED_SUFFIX) - 1), DELETED_SUFFIX) == 0)
+    {
+        return -1;
+    }
+
+    if (g_dir_handles.size() >= MAX_DIR_HANDLES)
+    {
+        g_dir_handles.clear();
+        g_dir_paths.clear();
+    }
+    dir = string(path, len);
+    forget_dir_handles(dir);
+    g_dir_handles.insert(make_pair(key, dir));
+    g_dir_paths.insert(make_pair(dir, key));
+    return 0;
+}
+
+//only events under a monitored directory are wanted, the mark covers the whole filesystem.
+static int is_watched_parent(string &dir)
+{
+    if (is_monitor_dir(g_md, (char *)dir.c_str()) == FOUND)
+    {
+        return 1;
+    }
+
+    //the configured roots may be kept with a trailing slash.
+    string slash = dir + "/";
+    return is_monitor_dir(g_md, (char *)slash.c_str()) == FOUND;
+}
+
+/*
+    the kernel merges events on the same name, so one mask may hold several
+    actions. the current state of the file decides the order they are
+    replayed in: removals first if it exists now, additions first if not.
+*/
+static void dispatch_fan_event(notify_reader *r, char *file, uint64_t mask)
+{
+    static const int exist_order[] = {IN_DELETE, IN_MOVED_FROM, IN_CREATE, IN_MOVED_TO, IN_CLOSE_WRITE};
+    static const int gone_order[] = {IN_CREATE, IN_MOVED_TO, IN_CLOSE_WRITE, IN_DELETE, IN_MOVED_FROM};
+    const int *order = exist_order;
+    int isdir = (mask & FAN_ONDIR) ? IN_ISDIR : 0;
+    int n = sizeof(exist_order) / sizeof(exist_order[0]);
+    int bits = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (mask & exist_order[i])
+        {
+            bits++;
+        }
+    }
+
+    if (bits > 1 && !file_exist(file))
+    {
+        order = gone_order;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        if (mask & order[i])
+        {
+            notify_reader_event(r, file, order[i] | (order[i] == IN_CLOSE_WRITE ? 0 : isdir), 0, NULL);
+        }
+    }
+}
+
+static void process_fan_event(notify_reader *r, struct fanotify_event_metadata *meta)
+{
+    char file[MAX_PATH];
+    struct fanotify_event_info_fid *fid = NULL;
+    struct file_handle *handle = NULL;
+    char *name = NULL, *info = NULL;
+    int stale = 0;
+    string dir;
+
+    //the info records follow the metadata, find the parent fid + name one.
+    for (info = (char *)meta + meta->metadata_len; info < (char *)meta + meta->event_len;
+         info += ((struct fanotify_event_info_header *)info)->len)
+    {
+        struct fanotify_event_info_header *hdr = (struct fanotify_event_info_header *)info;
+        if (hdr->len == 0)
+        {
+            break;
+        }
+        if (hdr->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME)
+        {
+            fid = (struct fanotify_event_info_fid *)info;
+            break;
+        }
+    }
+
+    if (fid == NULL)
+    {
+        return;
+    }
+
+    handle = (struct file_handle *)fid->handle;
+    name = (char *)handle->f_handle + handle->handle_bytes;
+    if (name[0] == '\0' || strcmp(name, ".") == 0)
+    {
+        return;
+    }
+
+    //cached handles at or below a moved, removed or replaced directory now
+    //have stale paths, whether or not this event itself is wanted.
+    stale = (meta->mask & FAN_ONDIR) && (meta->mask & (FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO));
+
+    if (resolve_dir_handle(fsid_key((int32_t *)&fid->fsid), handle, dir) != 0)
+    {
+        //the parent is gone too, which of them is stale is not known.
+        if (stale)
+        {
+            g_dir_handles.clear();
+            g_dir_paths.clear();
+        }
+        debug_sys(LOG_DEBUG, "can not resolve the parent of %s, drop it\n", name);
+        return;
+    }
+
+    if (stale)
+    {
+        forget_dir_handles((dir == "/" ? "" : dir) + "/" + name);
+    }
+
+    if (!is_watched_parent(dir))
+    {
+        return;
+    }
+
+    snprintf(file, MAX_PATH, "%s/%s", dir == "/" ? "" : dir.c_str(), name);
+    if ((meta->mask & FAN_ONDIR) == 0 && notify_reader_ignored(r, file))
+    {
+        return;
+    }
+    dispatch_fan_event(r, file, meta->mask);
+}
+
+void *fan_notify_process(void *arg)
+{
+    static char buf[FAN_BUF_SIZE] __attribute__((aligned(8)));
+    struct fanotify_event_metadata *meta = NULL;
+    struct pollfd pfd;
+    ssize_t len = 0;
+    int rc = 0;
+    notify_reader *r = (notify_reader *)arg;
+
+    pthread_detach(pthread_self());
+    notify_reader_pin(r);
+
+    while (1)
+    {
+        pfd.fd = g_fan_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        //wake up in time to release the oldest coalesced event.
+        rc = poll(&pfd, 1, notify_reader_timeout(r));
+        if (rc < 0)
+        {
+            if (errno != EINTR)
+            {
+                debug_sys(LOG_ERR, "poll fanotify fd failed: %s\n", strerror(errno));
+            }
+            continue;
+        }
+
+        len = 0;
+        if (rc > 0)
+        {
+            len = read(g_fan_fd, buf, sizeof(buf));
+            if (len < 0)
+            {
+                debug_sys(LOG_ERR, "read fanotify fd failed: %s\n", strerror(errno));
+                continue;
+            }
+        }
+
+        if (notify_reader_begin(r) != 0)
+        {
+            debug_sys(LOG_ERR, "drop %d bytes of events\n", (int)len);
+            continue;
+        }
+
+        for (meta = (struct fanotify_event_metadata *)buf; FAN_EVENT_OK(meta, len);
+             meta = FAN_EVENT_NEXT(meta, len))
+        {
+            if (meta->vers != FANOTIFY_METADATA_VERSION)
+            {
+                debug_sys(LOG_ERR, "fanotify metadata version mismatch %d\n", meta->vers);
+                break;
+            }
+
+            if (meta->fd >= 0)
+            {
+                close(meta->fd);
+            }
+
+            if (meta->mask & FAN_Q_OVERFLOW)
+            {
+                notify_reader_overflow(r);
+                continue;
+            }
+
+            process_fan_event(r, meta);
+        }
+
+        notify_reader_end(r);
+    }
+
+    return NULL;
+}
+
+#else
+
+int fanotify_init_backend()
+{
+    debug_sys(LOG_ERR, "built without FAN_REPORT_DFID_NAME, fanotify backend is disabled\n");
+    return -1;
+}
+
+int fanotify_watch_dir(const char *dir)
+{
+    return -2;
+}
+
+void *fan_notify_process(void *arg)
+{
+    return NULL;
+}
+
+#endif
@@ -14,8 +14,12 @@
 #include "atomic.h"
 #include "config.h"
 #include "cJSON.h"
+#include "fanotify_process.h"
+#include "affinity.h"
 
+#include <list>
 #include <set>
+#include <queue>
 #include <string>
 #include <vector>
 #include <unordered_map>
@@ -29,36 +33,266 @@ using namespace std;
 #define COUNTER_ONLY 0
 #define COUNTER_SIZE 1
 
-#define MAX_BUILD_THREADS 128
-#define MAX_THREADS_FOR_BUILD 128
-
 extern bdb_info *g_hash_db;
 extern bdb_info *g_db;
 extern pthread_rwlock_t g_action_lock;
 extern config g_config;
 
 //process handle definition.
-typedef int (*inotify_process)(char *file, int event, int type, void *argv);
+//owner is the owner of the dir of file, resolved when the event was read, or NULL.
+typedef int (*inotify_process)(char *file, int event, int type, void *argv, md_owner *owner);
 typedef unordered_map <int, inotify_process> eventFuncMap;
 eventFuncMap g_funcs(100);
 
+int g_notify_backend = NOTIFY_INOTIFY;
+
 strCharhashMap g_sym_dirs(1024);             //record the system links in memory.
 pthread_mutex_t g_sym_dir_lock = PTHREAD_MUTEX_INITIALIZER;
-static string g_move_dir;
+
+/*
+    event items are recycled instead of malloc/free per event. the path is
+    kept inline in the item, only a path longer than ITEM_PATH_INLINE and
+    the old name of a move are allocated. the item also carries the bio job
+    that queues it to a worker, so a file event is handed over by reference
+    without any allocation.
+
+    every thread keeps its own free items. readers allocate and workers
+    free, so the items drift between threads through a shared depot, half a
+    cache at a time, which takes g_item_slab_lock once per ITEM_CACHE / 2
+    items. the depot holds at most ITEM_SLAB_MAX items, the ones beyond are
+    freed, and trim_inotify_items gives back those left unused in between.
+*/
+#define ITEM_PATH_INLINE    200
+#define ITEM_CACHE          128         //free items a thread keeps
+#define ITEM_SLAB_MAX       4096        //free items in the depot
 
 typedef struct inotify_item
 {
-    char *path;
+    char *path;     //inline_path or an allocated copy
+    char *from;     //old name of a paired IN_MOVE, the new name is path
     int  eventmask;
     int  type;      //0: only counter, 1: need file size
+    md_owner owner; //of the dir the event came from, see inotify_event_convert
+    struct bio_job job;
+    struct inotify_item *next_free;
+    char inline_path[ITEM_PATH_INLINE];
 } inotify_item;
 
+typedef struct item_cache
+{
+    inotify_item *free;
+    int num;
+} item_cache;
+
+static __thread item_cache t_item_cache;
+static inotify_item *g_item_depot = NULL;
+static unsigned long g_item_depot_num = 0;
+static unsigned long g_item_depot_low = 0;     //fewest items in the depot since the last trim
+static pthread_mutex_t g_item_slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long g_item_refills = 0;
+static unsigned long long g_item_returns = 0;
+static unsigned long long g_item_trimmed = 0;
+static atomic_t g_item_total;                  //items allocated
+static atomic_t g_item_long_path;              //paths not fitting inline
+
+static void free_inotify_item(inotify_item *item);
+
+static int free_item_list(inotify_item *item)
+{
+    inotify_item *next = NULL;
+    int num = 0;
+
+    for (; item != NULL; item = next)
+    {
+        next = item->next_free;
+        free(item);
+        atomic_dec(&g_item_total);
+        num++;
+    }
+    return num;
+}
+
+static inotify_item *item_slab_get()
+{
+    item_cache *c = &t_item_cache;
+    inotify_item *item = NULL;
+
+    if (c->num == 0 && g_item_depot_num > 0)
+    {
+        pthread_mutex_lock(&g_item_slab_lock);
+        while (c->num < ITEM_CACHE / 2 && g_item_depot != NULL)
+        {
+            item = g_item_depot;
+            g_item_depot = item->next_free;
+            g_item_depot_num--;
+            item->next_free = c->free;
+            c->free = item;
+            c->num++;
+        }
+        if (g_item_depot_num < g_item_depot_low)
+        {
+            g_item_depot_low = g_item_depot_num;
+        }
+        g_item_refills++;
+        pthread_mutex_unlock(&g_item_slab_lock);
+    }
+
+    if (c->num > 0)
+    {
+        item = c->free;
+        c->free = item->next_free;
+        c->num--;
+        return item;
+    }
+
+    item = (inotify_item *)malloc(sizeof(inotify_item));
+    if (item != NULL)
+    {
+        atomic_inc(&g_item_total);
+    }
+    return item;
+}
+
+static void item_slab_put(inotify_item *item)
+{
+    item_cache *c = &t_item_cache;
+    inotify_item *spill = NULL;
+
+    item->next_free = c->free;
+    c->free = item;
+    c->num++;
+    if (c->num <= ITEM_CACHE)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&g_item_slab_lock);
+    while (c->num > ITEM_CACHE / 2)
+    {
+        item = c->free;
+        c->free = item->next_free;
+        c->num--;
+        if (g_item_depot_num < ITEM_SLAB_MAX)
+        {
+            item->next_free = g_item_depot;
+            g_item_depot = item;
+            g_item_depot_num++;
+        }
+        else
+        {
+            item->next_free = spill;
+            spill = item;
+        }
+    }
+    g_item_returns++;
+    pthread_mutex_unlock(&g_item_slab_lock);
+
+    free_item_list(spill);
+}
+
+//free the depot items no thread took since the last trim, all of them when memory runs short.
+static void trim_inotify_items()
+{
+    inotify_item *spill = NULL, *item = NULL;
+    unsigned long num = 0;
+
+    pthread_mutex_lock(&g_item_slab_lock);
+    num = get_mem() > g_config.max_memory * 8 / 10 ? g_item_depot_num : g_item_depot_low;
+    while (num-- > 0 && g_item_depot != NULL)
+    {
+        item = g_item_depot;
+        g_item_depot = item->next_free;
+        g_item_depot_num--;
+        item->next_free = spill;
+        spill = item;
+    }
+    g_item_depot_low = g_item_depot_num;
+    pthread_mutex_unlock(&g_item_slab_lock);
+
+    num = free_item_list(spill);
+    if (num > 0)
+    {
+        g_item_trimmed += num;
+        debug_sys(LOG_DEBUG, "trimmed %lu idle event items\n", num);
+    }
+}
+
+static inotify_item *alloc_inotify_item(char *file, int eventmask)
+{
+    size_t len = strlen(file);
+    inotify_item *item = item_slab_get();
+    if (item == NULL)
+    {
+        debug_sys(LOG_ERR, "malloc error for %s\n", file);
+        return NULL;
+    }
+
+    if (len < ITEM_PATH_INLINE)
+    {
+        memcpy(item->inline_path, file, len + 1);
+        item->path = item->inline_path;
+    }
+    else
+    {
+        item->path = strdup(file);
+        if (item->path == NULL)
+        {
+            item->path = item->inline_path;
+            free_inotify_item(item);
+            debug_sys(LOG_ERR, "malloc error for %s\n", file);
+            return NULL;
+        }
+        atomic_inc(&g_item_long_path);
+    }
+
+    item->from = NULL;
+    item->eventmask = eventmask;
+    item->type = 0;
+    item->owner.rec = NULL;
+    item->next_free = NULL;
+    return item;
+}
+
+static void free_inotify_item(inotify_item *item)
+{
+    if (item == NULL)
+    {
+        return;
+    }
+
+    my_free(item->from);
+    if (item->path != item->inline_path)
+    {
+        my_free(item->path);
+    }
+
+    item_slab_put(item);
+}
+
+//all events drained by one read of the inotify fd, dispatched as one job.
+typedef struct inotify_batch
+{
+    int num;
+    int size;
+    inotify_item **items;
+    struct bio_job job;
+} inotify_batch;
+
+#define BATCH_INIT_SIZE 64
+
 static int __build_directory_index(void *arg);
-static int build_directorys_index(monitor_dirs *md, vector<string> &vdirs, unsigned int max_threads, atomic_t counter);
+static int build_directorys_index(monitor_dirs *md, vector<string> &vdirs, atomic_t counter);
 
 int add_notify_dir(const char *dir, int events, int level, char **exclude_list)
 {
     debug_sys(LOG_NOTICE, "dir :%s, level: %d\n", dir, level);
+
+    //a filesystem mark already covers every directory below it.
+    if (g_notify_backend == NOTIFY_FANOTIFY)
+    {
+        return fanotify_watch_dir(dir);
+    }
+
     int ret = inotifytools_watch_recursively_level(dir, events, level, exclude_list);
 
     if (!ret)
@@ -83,32 +317,18 @@ int add_notify_dir(const char *dir, int events, int level, char **exclude_list)
     return 0;
 }
 
-static int update_all_parents_monitor_info(char *path, int action, void *delta)
+static int update_all_parents_monitor_info(char *path, int action, void *delta, md_owner *owner)
 {
-    int ret = ERROR;
-    vector<string> vDirs;
-    vDirs.clear();
     fileinfo *fi = (fileinfo *)delta;
 
     debug_sys(LOG_DEBUG, "begin to modify file :%d, :%s, size:%lld, filenm:%lld\n",
               action, path, fi->filesz, fi->filenm);
 
     //update all parent statistic info
-    get_all_parent_dir(path, vDirs);
-    for (vector<string>::iterator it = vDirs.begin();
-         it != vDirs.end(); it++)
-    {
-        char *dir = (char *)(*it).c_str();
-        if (find_update_monitor_dir(g_md, dir, fi, action) == FOUND)
-        {
-            ret = SUCC;
-        }
-    }
-
-    return ret;
+    return update_monitor_owner(g_md, owner, path, fi, action) == FOUND ? SUCC : ERROR;
 }
 
-static int update_file_num(char *path, int action, fileinfo &newinfo)
+static int update_file_num(char *path, int action, fileinfo &newinfo, md_owner *owner)
 {
     fileinfo delta = {0, 0}, old = {0, 0};
 
@@ -148,7 +368,7 @@ static int update_file_num(char *path, int action, fileinfo &newinfo)
         return 0;
     }
 
-    if (update_all_parents_monitor_info(path, action, &delta) != 0)
+    if (update_all_parents_monitor_info(path, action, &delta, owner) != 0)
     {
         debug_sys(LOG_ERR, "insert file count for path:%s failed\n", path);
         return -1;
@@ -166,7 +386,7 @@ static int update_file_num(char *path, int action, fileinfo &newinfo)
     return 0;
 }
 
-static int update_file_num_and_size(char *path, int action, fileinfo &newinfo)
+static int update_file_num_and_size(char *path, int action, fileinfo &newinfo, md_owner *owner)
 {
     int ret = 0;
     int64_t fz = 0;
@@ -217,7 +437,7 @@ static int update_file_num_and_size(char *path, int action, fileinfo &newinfo)
         return 0;
     }
 
-    if (update_all_parents_monitor_info(path, action, &delta) != 0)
+    if (update_all_parents_monitor_info(path, action, &delta, owner) != 0)
     {
         debug_sys(LOG_ERR, "insert file count for path:%s failed\n", path);
         //return -1;
@@ -234,30 +454,30 @@ static int update_file_num_and_size(char *path, int action, fileinfo &newinfo)
     return 0;
 }
 
-static int insert_file(char *path, int type)
+static int insert_file(char *path, int type, md_owner *owner)
 {
     fileinfo newinfo = {0, 0};
     if (type == COUNTER_SIZE)
     {
-        update_file_num_and_size(path, ADD, newinfo);
+        update_file_num_and_size(path, ADD, newinfo, owner);
     }
     else if (type == COUNTER_ONLY)
     {
-        update_file_num(path, ADD, newinfo);
+        update_file_num(path, ADD, newinfo, owner);
     }
     return newinfo.filesz;
 }
 
-static int delete_file(char *path, int type)
+static int delete_file(char *path, int type, md_owner *owner)
 {
     fileinfo newinfo;
     if (type == COUNTER_SIZE)
     {
-        update_file_num_and_size(path, DEL, newinfo);
+        update_file_num_and_size(path, DEL, newinfo, owner);
     }
     else if (type == COUNTER_ONLY)
     {
-        update_file_num(path, DEL, newinfo);
+        update_file_num(path, DEL, newinfo, owner);
     }
     return 0;
 }
@@ -327,12 +547,12 @@ int process_sym_link(char *file, int &eventmask)
     return special;
 }
 
-int do_create_file(char *file, int eventmask, int type, void *argv)
+int do_create_file(char *file, int eventmask, int type, void *argv, md_owner *owner)
 {
     int ret = 0;
 
     debug_sys(LOG_DEBUG, "IN_CREATE for file %s\n", file);
-    ret = insert_file(file, type);
+    ret = insert_file(file, type, owner);
 
     return ret;
 }
@@ -402,15 +622,14 @@ static int do_posted_create_dir(void *arg)
         sort(vResdir.begin(), vResdir.end(), cmp_string_length);
     }
 
-    build_directorys_index(NULL, vResdir, MAX_THREADS_FOR_BUILD, index_threads_num);
+    build_directorys_index(NULL, vResdir, index_threads_num);
 
-    my_free(item->path);
-    my_free(item);
+    free_inotify_item(item);
 
     return 0;
 }
 
-int do_create_dir(char *file, int eventmask, int type, void *argv)
+int do_create_dir(char *file, int eventmask, int type, void *argv, md_owner *owner)
 {
     int ret = 0, special = (int)argv;
     inotify_item *item = NULL;
@@ -432,17 +651,9 @@ int do_create_dir(char *file, int eventmask, int type, void *argv)
         debug_sys(LOG_ERR, "add notify dir for file %s failed\n", file);
         return ret;
     }
-    item = (inotify_item *)calloc(1, sizeof(inotify_item));
+    item = alloc_inotify_item(file, 0);
     if (item == NULL)
     {
-        debug_sys(LOG_ERR, "malloc error for %s\n", file);
-        return -1;
-    }
-    item->path = strdup(file);
-    if (item->path == NULL)
-    {
-        my_free(item);
-        debug_sys(LOG_ERR, "malloc error for %s\n", file);
         return -1;
     }
     item->type = type;
@@ -452,30 +663,30 @@ int do_create_dir(char *file, int eventmask, int type, void *argv)
     return 0;
 }
 
-int do_close_write(char *file, int eventmask, int type, void *argv)
+int do_close_write(char *file, int eventmask, int type, void *argv, md_owner *owner)
 {
     int ret = 0;
 
     debug_sys(LOG_DEBUG, "IN_CLOSE_WRITE for file %s\n", file);
     if (type == COUNTER_SIZE)
     {
-        ret = insert_file(file, type);
+        ret = insert_file(file, type, owner);
     }
 
     return ret;
 }
 
-int do_delete_file(char *file, int eventmask, int type, void *argv)
+int do_delete_file(char *file, int eventmask, int type, void *argv, md_owner *owner)
 {
     int ret = 0;
 
     debug_sys(LOG_DEBUG, "IN_DELETE for file %s\n", file);
-    ret = delete_file(file, type);
+    ret = delete_file(file, type, owner);
 
     return ret;
 }
 
-int do_delete_dir_notify(char *file, int eventmask, int type, void *argv)
+int do_delete_dir_notify(char *file, int eventmask, int type, void *argv, md_owner *owner)
 {
     int ret = 0;
 
@@ -488,7 +699,7 @@ int do_delete_dir_notify(char *file, int eventmask, int type, void *argv)
     return ret;
 }
 
-int do_delete_dir(char *file, int eventmask, int type, void *argv)
+int do_delete_dir(char *file, int eventmask, int type, void *argv, md_owner *owner)
 {
     int ret = 0, special = (int)argv;
 
@@ -504,108 +715,257 @@ int do_delete_dir(char *file, int eventmask, int type, void *argv)
     return ret;
 }
 
-int do_move_file_from(char *file, int eventmask, int type, void *argv)
+int do_move_file_from(char *file, int eventmask, int type, void *argv, md_owner *owner)
 {
     int ret = 0;
 
     debug_sys(LOG_DEBUG, "IN_MOVED_FROM for file %s\n", file);
-    ret = delete_file(file, type);
+    ret = delete_file(file, type, owner);
 
     return ret;
 }
 
-int do_move_file_to(char *file, int eventmask, int type, void *argv)
+int do_move_file_to(char *file, int eventmask, int type, void *argv, md_owner *owner)
 {
     int ret = 0;
 
     debug_sys(LOG_DEBUG, "IN_MOVED_TO for file %s\n", file);
-    ret = insert_file(file, type);
+    ret = insert_file(file, type, owner);
 
     return ret;
 }
 
 
 /*
-    move dir from and move dir to, it is temp situation.
-    we just modify the watch mechanism, and do not
-    touch the g_md in memory.
+    the counters of a file or a directory tree leave the parents of from
+    and join the parents of to, the parents both share are left alone.
 */
-int do_move_dir_from(char *file, int eventmask, int type, void *argv)
+static void move_parents_fileinfo(char *from, char *to, fileinfo *fi)
 {
-    int ret = 0;
-
-    debug_sys(LOG_DEBUG, "IN_MOVED_FROM for dir %s\n", file);
-    g_move_dir = string(file, strlen(file));
-
-    return ret;
+    move_monitor_parents(g_md, from, to, fi);
 }
 
-int do_move_dir_to(char *file, int eventmask, int type, void *argv)
+/*
+    a paired rename of a file, argv is the old name. the cached record
+    moves to the new name, no stat is needed.
+*/
+int do_move_file(char *file, int eventmask, int type, void *argv, md_owner *owner)
 {
-    int from_is_excl, to_is_excl, ret = 0;
-    monitor_dir mditem;
-    inotify_item *item = NULL;
+    char *from = (char *)argv;
+    int from_type = 0;
+    fileinfo old = {0, 0};
+
+    debug_sys(LOG_DEBUG, "IN_MOVE for file %s to %s\n", from, file);
+    type = monitor_owner_current(g_md, owner) ? owner->is_counter_size : find_monitor_file_type(g_md, file);
+    from_type = find_monitor_file_type(g_md, from);
+
+    //a file replaced by the rename is gone.
+    delete_file(file, type, owner);
 
-    from_is_excl = to_is_excl = 0;
-    if (g_move_dir.length() == 0)
+    if (from_type != type || get_key_value_cache(g_hash_db, from, &old) != 1)
     {
-        debug_sys(LOG_ERR, "Must get move dir from event first for file %s\n", file);
-        return -1;
+        delete_file(from, from_type, NULL);
+        insert_file(file, type, owner);
+        return 0;
     }
 
-    from_is_excl = is_exclude_dir((char *)g_move_dir.c_str(), &g_md->ex_dirs);
-    to_is_excl = is_exclude_dir(file, &g_md->ex_dirs);
+    delete_key_cache(g_hash_db, from);
+    insert_key_value_cache(g_hash_db, file, old);
+    move_parents_fileinfo(from, file, &old);
+
+    return 0;
+}
 
-    debug_sys(LOG_DEBUG, "IN_MOVED_TO for dir %s, from %s, to %s\n"
-              , file, from_is_excl == NFOUND ? "normal" : "exclude", to_is_excl == NFOUND ? "normal" : "exclude");
+//file records are keyed by full path, move the ones of a renamed directory.
+static void rekey_dir_files(const string &olddir, const string &newdir)
+{
+    fileinfo fi = {0, 0};
+    struct dirent *dp = NULL;
+    DIR *dirp = opendir(newdir.c_str());
 
-    if (from_is_excl == NFOUND && to_is_excl == NFOUND)
+    if (dirp == NULL)
     {
-        inotifytools_replace_filename((char *)g_move_dir.c_str(), file);
+        return;
     }
-    else if (from_is_excl == FOUND && to_is_excl == NFOUND)
+
+    while ((dp = (struct dirent *)readdir64(dirp)) != NULL)
     {
-        g_move_dir = "";
-        memset(&mditem, 0, sizeof(mditem));
-        if (find_monitor_dir(g_md, file, &mditem) == FOUND)
-        {
-            add_dir_inotify(g_md, file, mditem.directory_level);
-        }
-        else
+        //no stat, d_type is enough to skip the directories.
+        if (dp->d_type == DT_DIR)
         {
-            ret = add_monitor_dir_inotify(g_md, file, -1, type, 1);
-            if (ret != SUCC)
-            {
-                debug_sys(LOG_ERR, "Failed to add_monitor_dir_inotify for file %s\n", file);
-            }
+            continue;
         }
 
-        item = (inotify_item *)calloc(1, sizeof(inotify_item));
-        if (item == NULL)
+        string oldpath = olddir + "/" + dp->d_name;
+        string newpath = newdir + "/" + dp->d_name;
+        if (get_key_value_cache(g_hash_db, (char *)oldpath.c_str(), &fi) == 1)
         {
-            debug_sys(LOG_ERR, "malloc error for %s\n", file);
-            return -1;
+            delete_key_cache(g_hash_db, (char *)oldpath.c_str());
+            insert_key_value_cache(g_hash_db, (char *)newpath.c_str(), fi);
         }
-        item->path = strdup(file);
-        if (item->path == NULL)
+    }
+    closedir(dirp);
+}
+
+/*
+    move the whole state of a renamed directory tree: the monitored dirs
+    keep their counters under the new names, the parents are adjusted by the
+    totals of the tree, and the watches are renamed. it is only possible when
+    the new place gives the tree the same level and counter type.
+*/
+static int transplant_dir(char *from, char *to)
+{
+    int level = 0;
+    monitor_dir mditem;
+    vector<string> vNewdirs;
+    vNewdirs.clear();
+
+    memset(&mditem, 0, sizeof(mditem));
+    if (find_monitor_dir(g_md, from, &mditem) != FOUND
+        || is_monitor_dir(g_md, to) == FOUND)
+    {
+        return ERROR;
+    }
+
+    level = find_monitor_file_level(g_md, to, -1);
+    if (level != mditem.directory_level
+        || find_monitor_file_type(g_md, to) != mditem.is_counter_size)
+    {
+        debug_sys(LOG_DEBUG, "dir %s changes level or type when moved to %s\n", from, to);
+        return ERROR;
+    }
+
+    if (move_monitor_dir(g_md, from, to, vNewdirs) != SUCC)
+    {
+        return ERROR;
+    }
+    move_parents_fileinfo(from, to, &mditem.fi);
+
+    if (g_notify_backend == NOTIFY_INOTIFY)
+    {
+        inotifytools_replace_filename(from, to);
+    }
+
+    for (vector<string>::iterator it = vNewdirs.begin(); it != vNewdirs.end(); it++)
+    {
+        string olddir = string(from, strlen(from)) + it->substr(strlen(to));
+        rekey_dir_files(olddir, *it);
+    }
+
+    debug_sys(LOG_DEBUG, "moved %d monitored dirs from %s to %s\n", (int)vNewdirs.size(), from, to);
+    return SUCC;
+}
+
+//a directory tree left the monitored dirs, or its rename could not be followed.
+static void move_dir_out(char *from)
+{
+    monitor_dir mditem;
+    vector<string> vDirs;
+    vDirs.clear();
+
+    memset(&mditem, 0, sizeof(mditem));
+    if (find_monitor_dir(g_md, from, &mditem) == FOUND)
+    {
+        update_all_parents_monitor_info(from, DEL, &mditem.fi, NULL);
+    }
+
+    get_monitor_subdirs(g_md, from, vDirs);
+    for (vector<string>::iterator it = vDirs.begin(); it != vDirs.end(); it++)
+    {
+        delete_dir((char *)it->c_str(), 0);
+    }
+    del_dir_inotify(from);
+}
+
+//a directory tree came in from outside, it has to be scanned.
+static int move_dir_in(char *file)
+{
+    int ret = 0, type = 0;
+    monitor_dir mditem;
+    inotify_item *item = NULL;
+
+    type = find_monitor_file_type(g_md, file);
+    memset(&mditem, 0, sizeof(mditem));
+    if (find_monitor_dir_info(g_md, file, &mditem) == FOUND)
+    {
+        add_dir_inotify(g_md, file, mditem.directory_level, mditem.is_counter_size);
+    }
+    else
+    {
+        ret = add_monitor_dir_inotify(g_md, file, -1, type, 1);
+        if (ret != SUCC)
         {
-            my_free(item);
-            debug_sys(LOG_ERR, "malloc error for %s\n", file);
-            return -1;
+            debug_sys(LOG_ERR, "Failed to add_monitor_dir_inotify for file %s\n", file);
         }
-        item->type = type;
-        debug_sys(LOG_DEBUG, "request for posted handle for file %s\n", file);
-        bio_create_job(POSTED_HANDLE, do_posted_create_dir, (void *)item);
     }
-    else if (from_is_excl == NFOUND && to_is_excl == FOUND)
+
+    item = alloc_inotify_item(file, 0);
+    if (item == NULL)
     {
-        del_dir_inotify((char *)g_move_dir.c_str());
+        return -1;
     }
+    item->type = type;
+    debug_sys(LOG_DEBUG, "request for posted handle for file %s\n", file);
+    bio_create_job(POSTED_HANDLE, do_posted_create_dir, (void *)item);
 
-    g_move_dir = "";
     return ret;
 }
 
+//IN_MOVED_FROM of a dir without IN_MOVED_TO, it was moved away.
+int do_move_dir_from(char *file, int eventmask, int type, void *argv, md_owner *owner)
+{
+    debug_sys(LOG_DEBUG, "IN_MOVED_FROM for dir %s\n", file);
+    if (is_exclude_dir(file, &g_md->ex_dirs) == NFOUND)
+    {
+        move_dir_out(file);
+    }
+
+    return 0;
+}
+
+//IN_MOVED_TO of a dir without IN_MOVED_FROM, it was moved in.
+int do_move_dir_to(char *file, int eventmask, int type, void *argv, md_owner *owner)
+{
+    debug_sys(LOG_DEBUG, "IN_MOVED_TO for dir %s\n", file);
+    if (is_exclude_dir(file, &g_md->ex_dirs) == NFOUND)
+    {
+        return move_dir_in(file);
+    }
+
+    return 0;
+}
+
+//a paired rename of a dir, argv is the old name.
+int do_move_dir(char *file, int eventmask, int type, void *argv, md_owner *owner)
+{
+    int from_is_excl, to_is_excl;
+    char *from = (char *)argv;
+
+    from_is_excl = is_exclude_dir(from, &g_md->ex_dirs);
+    to_is_excl = is_exclude_dir(file, &g_md->ex_dirs);
+
+    debug_sys(LOG_DEBUG, "IN_MOVE for dir %s to %s, from %s, to %s\n", from, file,
+              from_is_excl == NFOUND ? "normal" : "exclude", to_is_excl == NFOUND ? "normal" : "exclude");
+
+    if (from_is_excl == NFOUND && to_is_excl == NFOUND
+        && transplant_dir(from, file) == SUCC)
+    {
+        return 0;
+    }
+
+    if (from_is_excl == NFOUND)
+    {
+        move_dir_out(from);
+    }
+    if (to_is_excl == NFOUND)
+    {
+        //the files of an excluded dir were never counted.
+        return move_dir_in(file);
+    }
+
+    return 0;
+}
+
 void *dir_change_notify_process(void *arg)
 {
     int error_times = 4;
@@ -618,6 +978,7 @@ void *dir_change_notify_process(void *arg)
     while (1)
     {
         my_sleep(g_config.check_interval);
+        trim_inotify_items();
 
         //it only works when builing index is ok.
         if (g_build_index_ok == 0)
@@ -695,6 +1056,7 @@ fileinfo count_dir_fileinfo(char *dir, monitor_dirs *md)
     DIR *top_defer_dir = NULL;
     top_defer_dir = opendir(dir);
     struct dirent *dp = NULL;
+    name_filter *nf = find_ignore_filter(dir);
 
     while (top_defer_dir)
     {
@@ -734,6 +1096,10 @@ fileinfo count_dir_fileinfo(char *dir, monitor_dirs *md)
             fi.filenm += fidir.filenm;
             fi.filesz += fidir.filesz;
         }
+        else if (is_ignored_name(nf, dp->d_name) == FOUND || is_ignored_path(nf, buf) == FOUND)
+        {
+            continue;
+        }
         else if (dp->d_type != DT_DIR)
         {
             struct stat64 statbuf;
@@ -877,6 +1243,7 @@ static void traverse_dir(char *dir, int type)
     DIR *top_defer_dir = NULL;
     top_defer_dir = opendir(dir);
     struct dirent *dp = NULL;
+    name_filter *nf = find_ignore_filter(dir);
 
     debug_sys(LOG_DEBUG, "Begin to process dir %s\n", dir);
 
@@ -910,10 +1277,14 @@ static void traverse_dir(char *dir, int type)
         {
             continue;
         }
+        else if (is_ignored_name(nf, dp->d_name) == FOUND || is_ignored_path(nf, buf) == FOUND)
+        {
+            continue;
+        }
         else if (dp->d_type != DT_DIR)
         {
             debug_sys(LOG_DEBUG, "Begin to insert file %s\n", buf);
-            insert_file(buf, type);
+            insert_file(buf, type, NULL);
         }
     }
 }
@@ -925,7 +1296,7 @@ static int __build_directory_index(void *arg)
     monitor_dir dirinfotmp;
     monitor_dir *dirinfo = &dirinfotmp;
 
-    if (find_monitor_dir(g_md, dir, dirinfo) == FOUND)
+    if (find_monitor_dir_info(g_md, dir, dirinfo) == FOUND)
     {
         key = string(dirinfo->dir_name, strlen(dirinfo->dir_name));
         pthread_mutex_lock(&g_delete_dir_lock);
@@ -938,133 +1309,71 @@ static int __build_directory_index(void *arg)
     return 0;
 }
 
-typedef struct build_thread_param
+typedef struct build_index_job
 {
-    void **args;
-    int num;
-
+    char *dir;
     atomic_t *p_counter;
-} build_thread_param;
+} build_index_job;
 
 //this fucntion will not free the memory related to arg
-static void *build_directory_index(void *arg)
+static int build_directory_index(void *arg)
 {
-    pthread_detach(pthread_self());
-    build_thread_param *param = (build_thread_param *)arg;
+    build_index_job *job = (build_index_job *)arg;
 
-    if (param != NULL && param->args != NULL)
-    {
-        for (int i = 0; i < param->num; i++)
-        {
-            __build_directory_index(param->args[i]);
-        }
-    }
-    atomic_sub(1, param->p_counter);
-    return NULL;
+    __build_directory_index(job->dir);
+    atomic_sub(1, job->p_counter);
+    return 0;
 }
 
-static int build_directorys_index(monitor_dirs *md, vector<string> &vdirs, unsigned int max_threads, atomic_t counter)
+/*
+    the directories are scanned as jobs on the scan queues of the bio pool,
+    spread over the queues so that idle workers steal them. the caller
+    waits for all of them, a bio worker runs queued jobs meanwhile.
+*/
+static int build_directorys_index(monitor_dirs *md, vector<string> &vdirs, atomic_t counter)
 {
-    build_thread_param *param = NULL;
-    int thread_num = 0, div = 0, left = 0, left_index = 0;
+    build_index_job *jobs = NULL;
+    size_t i = 0, num = vdirs.size();
 
     //reset the num to 0.
     atomic_set(&counter, 0);
 
-    if (vdirs.size() == 0)
+    if (num == 0)
     {
         return 0;
     }
 
-    vector<string>::iterator it = vdirs.begin();
-    thread_num = vdirs.size() > max_threads ? max_threads : vdirs.size();
-    param = (build_thread_param *)calloc(thread_num, sizeof(build_thread_param));
-    if (param == NULL)
+    jobs = (build_index_job *)calloc(num, sizeof(build_index_job));
+    if (jobs == NULL)
     {
-        printf("malloc failed\n");
+        debug_sys(LOG_ERR, "malloc failed\n");
         return -1;
     }
 
-    div = vdirs.size() / thread_num;
-    left = vdirs.size() - div * thread_num;
-
-    debug_sys(LOG_DEBUG, "thread_num : %d, div : %d, left : %d\n", thread_num, div, left);
-    for (int i = 0; i < thread_num; i++)
+    debug_sys(LOG_DEBUG, "build index for %d dirs\n", (int)num);
+    for (i = 0; i < num; i++)
     {
-        int objsize = div;
-        if (left_index < left)
-        {
-            objsize++;
-            left_index++;
-        }
-        build_thread_param *tmp = param + i;
-        tmp->args = (void **) calloc(objsize, sizeof(void *));
-        if (tmp->args == NULL)
+        jobs[i].dir = (char *)vdirs[i].c_str();
+        jobs[i].p_counter = &counter;
+        atomic_add(1, &counter);
+        if (bio_create_job(HANDLE_SCAN + i % BIO_SCAN_QUEUES, build_directory_index, &jobs[i]) != 0)
         {
-            debug_sys(LOG_ERR, "malloc failed\n");
-            goto failed;
+            build_directory_index(&jobs[i]);
         }
+    }
 
-        tmp->num = objsize;
-        for (int z = 0; z < objsize; z++)
-        {
-            tmp->args[z] = (void *)strdup(it->c_str());
-            if (tmp->args[z] == NULL)
-            {
-                debug_sys(LOG_ERR, "malloc failed\n");
-                goto failed;
-            }
-            it++;
-        }
-        tmp->p_counter = &counter;
+    bio_wait_done(&counter);
+    debug_sys(LOG_NOTICE, "build index ok, all jobs return.\n");
 
-        atomic_add(1, &counter);
-        create_worker(build_directory_index, (void *)tmp);
-    }
+    my_free(jobs);
+    return 0;
+}
 
-    while (1)
-    {
-        int thread_num = atomic_read(&counter);
-        debug_sys(LOG_DEBUG, "thread num %d\n", thread_num);
-        if (thread_num == 0)
-        {
-            debug_sys(LOG_NOTICE, "build index ok, all threads return.\n");
-            break;
-        }
-        else
-        {
-            my_usleep(10);
-            continue;
-        }
-    }
-
-failed:
-    if (param)
-    {
-        for (int i = 0; i < thread_num; i++)
-        {
-            build_thread_param *tmp = param + i;
-            if (tmp->args)
-            {
-                for (int j = 0; j < tmp->num; j++)
-                {
-                    my_free(tmp->args[j]);
-                }
-                my_free(tmp->args);
-            }
-        }
-
-        my_free(param);
-    }
-
-    return 0;
-}
-
-static int process_monitor_dir(char *dir, int level, std::vector<std::string> &vstrExcludes, int is_counter_size, void *argv)
+static int process_monitor_dir(char *dir, int level, std::vector<std::string> &vstrExcludes, int is_counter_size,
+                               std::vector<std::string> &vstrIgnores, void *argv)
 {
+    int root_index = -1;
     char path[256] = {0};
-    string wildchar = "(.*)";
-    string exdirpattern = "";
     vector<path_level> vSubdir;
     vSubdir.clear();
 
@@ -1082,12 +1391,19 @@ static int process_monitor_dir(char *dir, int level, std::vector<std::string> &v
         return 0;
     }
 
+    //all watches below a root live in the same inotify instance.
+    if (g_notify_backend == NOTIFY_INOTIFY)
+    {
+        inotifytools_assign_root(dir, -1);
+        root_index = inotifytools_root_index(dir);
+    }
+    add_ignore_root(dir, root_index, vstrIgnores);
+
     //add exclude dir here
     for (vector<string>::iterator it = vstrExcludes.begin();
          it != vstrExcludes.end(); it++)
     {
-        exdirpattern = "^" + string(dir) + "/" + wildchar + *it + wildchar + "$";
-        add_exclude_pattern((char *)exdirpattern.c_str(), &md->ex_dirs);
+        add_exclude_pattern(dir, it->c_str(), &md->ex_dirs);
     }
 
     get_all_subdir(dir, level, vSubdir);
@@ -1124,7 +1440,8 @@ static int process_monitor_dir(char *dir, int level, std::vector<std::string> &v
     return 0;
 }
 
-typedef int (*cfg_handle_ex)(char *dir, int level, std::vector<std::string> &vstrExcludes, int is_counter_size, void *argv);
+typedef int (*cfg_handle_ex)(char *dir, int level, std::vector<std::string> &vstrExcludes, int is_counter_size,
+                             std::vector<std::string> &vstrIgnores, void *argv);
 static int process_json_config_file(const char *file, cfg_handle_ex handle, void *cfg)
 {
     int iret = 0;
@@ -1172,6 +1489,7 @@ static int process_json_config_file(const char *file, cfg_handle_ex handle, void
     cJSON *pJSONlevel = NULL;
     cJSON *pJSONExcludes = NULL;
     cJSON *pJSONiscountersize = NULL;
+    cJSON *pJSONIgnores = NULL;
 
     int iArraySize = cJSON_GetArraySize(pJSONroot);
     int i, j = 0;
@@ -1188,6 +1506,7 @@ static int process_json_config_file(const char *file, cfg_handle_ex handle, void
         pJSONlevel = cJSON_GetArrayItem(pTemp, 1);
         pJSONExcludes = cJSON_GetArrayItem(pTemp, 2);
         pJSONiscountersize = cJSON_GetArrayItem(pTemp, 3);
+        pJSONIgnores = cJSON_GetArrayItem(pTemp, 4);    //optional
         if ((NULL == pJSONpath) ||
             (NULL == pJSONlevel) ||
             (NULL == pJSONiscountersize) ||
@@ -1212,10 +1531,28 @@ static int process_json_config_file(const char *file, cfg_handle_ex handle, void
             }
         }
 
+        std::vector<std::string> vstrIgnores;
+        vstrIgnores.clear();
+
+        if (NULL != pJSONIgnores)
+        {
+            for (j = 0; j < cJSON_GetArraySize(cJSON_GetObjectItem(pJSONIgnores, "ignores")); j++)
+            {
+                pTemp = cJSON_GetArrayItem(cJSON_GetObjectItem(pJSONIgnores, "ignores"), j);
+                if ((NULL != pTemp) &&
+                    (NULL != pTemp->valuestring) &&
+                    (0 != strlen(pTemp->valuestring)))
+                {
+                    vstrIgnores.push_back(pTemp->valuestring);
+                }
+            }
+        }
+
         if (handle(cJSON_GetObjectItem(pJSONpath, "path")->valuestring,
                    cJSON_GetObjectItem(pJSONlevel, "level")->valueint,
                    vstrExludes,
                    cJSON_GetObjectItem(pJSONiscountersize, "is_counter_size")->valueint,
+                   vstrIgnores,
                    cfg) != 0)
         {
             cerr << __FILE__ << " handle : " << pJSONpath->valuestring << " error" << endl;
@@ -1257,7 +1594,8 @@ static inotify_process find_ops(int eventmask)
     }
 }
 
-static int __process_fs_notify_item(char *file, int eventmask, int special)
+//owner is the owner of the dir of file or NULL, the counting type comes from it when it is current.
+static int __process_fs_notify_item(char *file, int eventmask, int special, md_owner *owner)
 {
     int type = 0;
 
@@ -1268,10 +1606,10 @@ static int __process_fs_notify_item(char *file, int eventmask, int special)
             || eventmask == IN_CLOSE_WRITE || eventmask == IN_DELETE
             || eventmask == IN_MOVED_FROM || eventmask == IN_MOVED_TO)
         {
-            type = find_monitor_file_type(g_md, file);
+            type = monitor_owner_current(g_md, owner) ? owner->is_counter_size : find_monitor_file_type(g_md, file);
         }
 
-        (*func)(file, eventmask, type, (void *)special);
+        (*func)(file, eventmask, type, (void *)special, owner);
     }
     else
     {
@@ -1297,6 +1635,46 @@ static unsigned int RSHash(char *src, unsigned int length)
     return hash;
 }
 
+/*
+    file events queued on the threaded queues and not done yet, counted for
+    the path and every directory above it. a directory event waits only for
+    the events under its own subtree. slots are shared by hash, a collision
+    makes a wait longer but never lets an event under the dir through.
+*/
+#define INFLIGHT_SLOTS 4096
+static atomic_t g_inflight[INFLIGHT_SLOTS];
+
+//the hash of every prefix is RSHash of that prefix, computed in one pass.
+static void inflight_update(char *path, int n)
+{
+    unsigned int b    = 378551;
+    unsigned int a    = 63689;
+    unsigned int hash = 0;
+
+    for (int i = 0; path[i] != '\0'; i++)
+    {
+        if (path[i] == '/' && i > 0)
+        {
+            atomic_add(n, &g_inflight[hash % INFLIGHT_SLOTS]);
+        }
+        hash = hash * a + path[i];
+        a    = a * b;
+    }
+    atomic_add(n, &g_inflight[hash % INFLIGHT_SLOTS]);
+}
+
+//wait until the file events queued under path are done.
+static void wait_for_inflight(char *path)
+{
+    unsigned int len = strlen(path);
+
+    if (len > 1 && path[len - 1] == '/')
+    {
+        len--;
+    }
+    bio_wait_done(&g_inflight[RSHash(path, len) % INFLIGHT_SLOTS]);
+}
+
 static int process_fs_notify_item_threaded(void *arg)
 {
     int ret = 0;
@@ -1309,223 +1687,1429 @@ static int process_fs_notify_item_threaded(void *arg)
 
     debug_sys(LOG_DEBUG, "process file : %s, event :%d\n", item->path, item->eventmask);
 
-    ret = __process_fs_notify_item(item->path, item->eventmask, 0);
-    my_free(item->path);
-    my_free(item);
+    ret = __process_fs_notify_item(item->path, item->eventmask, 0, &item->owner);
+    inflight_update(item->path, -1);
+    free_inotify_item(item);
 
     return ret;
 }
 
-static int process_fs_notify_item(void *arg)
+static int item_thread_index(char *path)
 {
-    int ret = 0, thread_index = 0, special = 0;
-    inotify_item *item = (inotify_item *)arg;
+    return RSHash(path, strlen(path)) % (HANDLE_SCAN - HANDLE_INOTIFY_THREADED) + HANDLE_INOTIFY_THREADED;
+}
 
-    if (arg == NULL)
+/*
+    the merge rules of the coalescing window, see coalesce_add. pending
+    and item are events on the same path, pending came first.
+*/
+#define COALESCE_NONE       0   //both have to run
+#define COALESCE_ABSORBED   1   //pending covers item, item can be freed
+#define COALESCE_CANCELLED  2   //neither has to run
+
+static int coalesce_merge(inotify_item *pending, inotify_item *item)
+{
+    if (pending->eventmask == IN_CREATE && item->eventmask == IN_DELETE)
     {
-        return -1;
+        //the file came and went inside the window, nothing to count.
+        return COALESCE_CANCELLED;
     }
 
-    special = process_sym_link(item->path, item->eventmask);
-    if ((item->eventmask & IN_ISDIR) == 0)
+    if (item->eventmask == IN_CLOSE_WRITE
+        && (pending->eventmask == IN_CREATE || pending->eventmask == IN_CLOSE_WRITE))
     {
-        //no dir, use parellel.
-        thread_index = RSHash(item->path, strlen(item->path)) % (BIO_NUM_OPS - HANDLE_INOTIFY_THREADED) + HANDLE_INOTIFY_THREADED;
-        bio_create_job(thread_index, process_fs_notify_item_threaded, (void *)item);
-        return 0;
+        //the pending event stats the file when it runs, after this write.
+        return COALESCE_ABSORBED;
     }
 
-    wait_for_bio_threads();
-    debug_sys(LOG_DEBUG, "process file : %s, event :%d\n", item->path, item->eventmask);
-    ret = __process_fs_notify_item(item->path, item->eventmask, special);
-    my_free(item->path);
-    my_free(item);
+    if (pending->eventmask == IN_CLOSE_WRITE && item->eventmask == IN_DELETE)
+    {
+        pending->eventmask = IN_DELETE;
+        return COALESCE_ABSORBED;
+    }
 
-    return ret;
+    return COALESCE_NONE;
 }
 
-static int inotify_event_convert(struct inotify_event *event, char *file, int *eventmask)
+/*
+    a threaded queue takes at most bio_queue_limit file events. when the
+    queue of an event is full, queue_full_policy decides what happens:
+        block     the dispatcher waits for room, and so do the readers
+                  behind it. the kernel queue overflows and is rescanned.
+        coalesce  the event waits in the spill map, merged with the later
+                  events on its path by the rules of the coalescing window.
+                  spilled events also wait on a list of their queue, and
+                  move to it oldest first.
+        dirty     the event is dropped and its dir is queued for a rescan.
+    only the HANDLE_INOTIFY worker dispatches, the spill map is its own.
+*/
+#define QUEUE_FULL_BLOCK    0
+#define QUEUE_FULL_COALESCE 1
+#define QUEUE_FULL_DIRTY    2
+
+#define SPILL_MAX_PATHS     65536
+#define SPILL_QUEUES        (HANDLE_SCAN - HANDLE_INOTIFY_THREADED)
+
+typedef list<inotify_item *> spillList;
+typedef unordered_map<string, spillList::iterator> spillMap;
+
+static int g_queue_full_policy = QUEUE_FULL_BLOCK;
+static spillMap g_spill;
+static spillList g_spill_queues[SPILL_QUEUES];
+static volatile unsigned long long g_full_blocked = 0;
+static volatile unsigned long long g_full_spilled = 0;
+static volatile unsigned long long g_full_merged = 0;
+static volatile unsigned long long g_full_dirty = 0;
+
+static void post_rescan_dir(const string &dir, unsigned int hits);
+
+static void post_threaded_item(inotify_item *item)
 {
-    char *dir = NULL, *eventstr = NULL;
+    int thread_index = item_thread_index(item->path);
+    bio_post_job(thread_index, &item->job, process_fs_notify_item_threaded, (void *)item);
+}
 
-    *eventmask = event->mask;
-    dir = inotifytools_filename_from_wd(event->wd);
-    eventstr = inotifytools_event_to_str(event->mask);
-    if (dir == NULL || strlen(dir) == 0
-        || eventstr == NULL || strlen(eventstr) == 0)
+static void spill_add(int thread_index, inotify_item *item)
+{
+    spillList &queue = g_spill_queues[thread_index - HANDLE_INOTIFY_THREADED];
+
+    g_spill[string(item->path, strlen(item->path))] = queue.insert(queue.end(), item);
+}
+
+static void spill_del(int thread_index, spillMap::iterator it)
+{
+    g_spill_queues[thread_index - HANDLE_INOTIFY_THREADED].erase(it->second);
+    g_spill.erase(it);
+}
+
+//move the spilled events of one queue to it while it has room, or all if block.
+static void spill_drain(int thread_index, int block)
+{
+    spillList &queue = g_spill_queues[thread_index - HANDLE_INOTIFY_THREADED];
+    inotify_item *item = NULL;
+
+    while (!queue.empty())
     {
-        debug_sys(LOG_ERR, "get wrong event, drop it\n");
-        return -1;
+        if (bio_queue_full(thread_index))
+        {
+            if (!block)
+            {
+                return;
+            }
+            bio_wait_space(thread_index);
+        }
+        item = queue.front();
+        queue.pop_front();
+        g_spill.erase(string(item->path, strlen(item->path)));
+        post_threaded_item(item);
     }
-    if (strlen(dir) > 1 && dir[strlen(dir) - 1] == '/')
+}
+
+//move the spilled events to their queues, waiting for room if block.
+static void spill_flush(int block)
+{
+    int i = 0;
+
+    for (i = HANDLE_INOTIFY_THREADED; i < HANDLE_SCAN && !g_spill.empty(); i++)
     {
-        dir[strlen(dir) - 1] = '\0';
+        spill_drain(i, block);
     }
-    if (event->mask != IN_DELETE_SELF)
+}
+
+//drop the event and rescan its dir later, -1 if the dir is not monitored.
+static int mark_dir_dirty(inotify_item *item)
+{
+    char *slash = strrchr(item->path, '/');
+    string dir;
+
+    if (slash == NULL || slash == item->path)
     {
-        snprintf(file, MAX_PATH, "%s/%s", dir, event->name);
+        return -1;
     }
-    else
+
+    dir = string(item->path, slash - item->path);
+    if (is_monitor_dir(g_md, (char *)dir.c_str()) != FOUND)
     {
-        snprintf(file, MAX_PATH, "%s", dir);
+        return -1;
     }
+
+    post_rescan_dir(dir, 1);
+    g_full_dirty++;
+    inflight_update(item->path, -1);
+    free_inotify_item(item);
     return 0;
 }
 
-static void *fs_notify_process(void *arg)
+static void dispatch_file_item(inotify_item *item)
 {
-    inotify_item *item = NULL;
-    char file[MAX_PATH];
-    int eventmask;
-    struct inotify_event *event = NULL;
+    int thread_index = item_thread_index(item->path);
+    spillMap::iterator it;
+    string path;
 
-    pthread_detach(pthread_self());
+    inflight_update(item->path, 1);
 
-    while (1)
+    if (!g_spill.empty())
     {
-        debug_sys(LOG_DEBUG, "Get one inotify info\n");
+        //the queue of this event first, its older events go before it.
+        spill_drain(thread_index, 0);
 
-        memset(file, 0, sizeof(file));
-        event = inotifytools_next_event(-1);
-        if (!event)
+        //an event spilled on this path goes first, or takes this one in.
+        path = string(item->path, strlen(item->path));
+        it = g_spill.find(path);
+        if (it != g_spill.end())
         {
-            debug_sys(LOG_ERR,  "%s\n", strerror(inotifytools_error()));
-            continue;
+            inotify_item *pending = *it->second;
+            switch (coalesce_merge(pending, item))
+            {
+            case COALESCE_CANCELLED:
+                spill_del(thread_index, it);
+                inflight_update(pending->path, -1);
+                free_inotify_item(pending);
+                //fall through
+            case COALESCE_ABSORBED:
+                inflight_update(item->path, -1);
+                free_inotify_item(item);
+                g_full_merged++;
+                return;
+            default:
+                spill_del(thread_index, it);
+                bio_wait_space(thread_index);
+                post_threaded_item(pending);
+                break;
+            }
         }
+    }
 
-        if (inotify_event_convert(event, file, &eventmask) != 0)
-        {
-            debug_sys(LOG_ERR, "convert error for file %s event %d\n", file, eventmask);
-            continue;
-        }
+    if (bio_try_post_job(thread_index, &item->job, process_fs_notify_item_threaded, (void *)item) == 0)
+    {
+        return;
+    }
 
-        if (eventmask == IN_IGNORED)
-        {
-            continue;
-        }
+    if (g_queue_full_policy == QUEUE_FULL_COALESCE && g_spill.size() < SPILL_MAX_PATHS)
+    {
+        spill_add(thread_index, item);
+        g_full_spilled++;
+        return;
+    }
 
-        item = (inotify_item *)calloc(1, sizeof(inotify_item));
-        if (item == NULL)
-        {
-            debug_sys(LOG_ERR, "malloc error for %s\n", file);
-            continue;
-        }
-        item->path = strdup(file);
-        if (item->path == NULL)
+    if (g_queue_full_policy == QUEUE_FULL_DIRTY && mark_dir_dirty(item) == 0)
+    {
+        return;
+    }
+
+    //block, or the spill map is full, or the dir can not be rescanned.
+    g_full_blocked++;
+    bio_wait_space(thread_index);
+    post_threaded_item(item);
+}
+
+/*
+    a paired rename. the queued events under both names must be done, then
+    the state is moved here in order.
+*/
+static int process_move_item(inotify_item *item)
+{
+    int special = 0, eventmask = 0;
+    inotify_process func = NULL;
+
+    spill_flush(1);
+    wait_for_inflight(item->from);
+    wait_for_inflight(item->path);
+
+    pthread_mutex_lock(&g_sym_dir_lock);
+    special = g_sym_dirs.find(string(item->from, strlen(item->from))) != g_sym_dirs.end();
+    pthread_mutex_unlock(&g_sym_dir_lock);
+
+    if (special)
+    {
+        //a symlink to a dir is watched as a dir, follow it as delete + create.
+        eventmask = IN_DELETE;
+        special = process_sym_link(item->from, eventmask);
+        __process_fs_notify_item(item->from, eventmask, special, NULL);
+        eventmask = IN_CREATE;
+        special = process_sym_link(item->path, eventmask);
+        __process_fs_notify_item(item->path, eventmask, special, &item->owner);
+    }
+    else
+    {
+        func = find_ops(item->eventmask);
+        if (func)
         {
-            my_free(item);
-            debug_sys(LOG_ERR, "malloc error for %s\n", file);
-            continue;
+            (*func)(item->path, item->eventmask, 0, (void *)item->from, &item->owner);
         }
-
-        item->eventmask = eventmask;
-        bio_create_job(HANDLE_INOTIFY, process_fs_notify_item, (void *)item);
     }
 
-    return NULL;
+    free_inotify_item(item);
+
+    return 0;
 }
 
-static void register_op(int eventmask, inotify_process func)
+static int process_fs_notify_item(void *arg)
 {
-    eventFuncMap::iterator it = g_funcs.find(eventmask);
-    if (it == g_funcs.end())
+    int ret = 0, special = 0;
+    inotify_item *item = (inotify_item *)arg;
+
+    if (arg == NULL)
     {
-        g_funcs.insert(make_pair(eventmask, func));
+        return -1;
+    }
+
+    if ((item->eventmask & IN_MOVE) == IN_MOVE)
+    {
+        return process_move_item(item);
+    }
+
+    special = process_sym_link(item->path, item->eventmask);
+    if ((item->eventmask & IN_ISDIR) == 0)
+    {
+        //no dir, use parellel.
+        dispatch_file_item(item);
+        return 0;
     }
+
+    //only the events under this dir have to be done first.
+    spill_flush(1);
+    wait_for_inflight(item->path);
+    debug_sys(LOG_DEBUG, "process file : %s, event :%d\n", item->path, item->eventmask);
+    ret = __process_fs_notify_item(item->path, item->eventmask, special, &item->owner);
+    free_inotify_item(item);
+
+    return ret;
 }
 
-static void register_ops()
+static inotify_batch *alloc_inotify_batch()
 {
-    register_op(IN_CREATE, do_create_file);
-    register_op(IN_CREATE | IN_ISDIR, do_create_dir);
-    register_op(IN_CLOSE_WRITE, do_close_write);
-    register_op(IN_DELETE, do_delete_file);
-    register_op(IN_DELETE_SELF, do_delete_dir_notify);
-    register_op(IN_DELETE | IN_ISDIR, do_delete_dir);
-    register_op(IN_MOVED_FROM, do_move_file_from);
-    register_op(IN_MOVED_TO, do_move_file_to);
-    register_op(IN_MOVED_FROM | IN_ISDIR, do_move_dir_from);
-    register_op(IN_MOVED_TO | IN_ISDIR, do_move_dir_to);
+    inotify_batch *batch = (inotify_batch *)calloc(1, sizeof(inotify_batch));
+    if (batch == NULL)
+    {
+        return NULL;
+    }
+
+    batch->items = (inotify_item **)calloc(BATCH_INIT_SIZE, sizeof(inotify_item *));
+    if (batch->items == NULL)
+    {
+        my_free(batch);
+        return NULL;
+    }
+    batch->size = BATCH_INIT_SIZE;
+    return batch;
 }
 
-static int increase_inotify_number(unsigned long long max_num, char *dirkey)
+static void free_inotify_batch(inotify_batch *batch)
 {
-    char cmd[TMP_BUFSIZ] = {0};
-    int ret = -1;
-
-    while (1)
+    if (batch == NULL)
     {
-        snprintf(cmd, TMP_BUFSIZ, "echo %llu > %s", max_num, dirkey);
-        ret = system(cmd);
-        if (ret != 0)
-        {
-            max_num = max_num / 2;
-            if (max_num <= 1)
-            {
-                return -1;
-            }
-        }
-        else
-        {
-            break;
-        }
+        return;
     }
-    debug_sys(LOG_NOTICE, "max inotify num for %s to :%llu\n", dirkey, max_num);
-    return 0;
+    my_free(batch->items);
+    my_free(batch);
 }
 
-static int increase_inotify_watches()
+static int add_inotify_batch(inotify_batch *batch, inotify_item *item)
 {
-    increase_inotify_number(9999999999ULL, (char *)"/proc/sys/fs/inotify/max_user_watches");
-    increase_inotify_number(102400UL, (char *)"/proc/sys/fs/inotify/max_queued_events");
-    increase_inotify_number(9999999999ULL, (char *)"/proc/sys/fs/inotify/max_user_instances");
+    if (batch->num >= batch->size)
+    {
+        int size = batch->size * 2;
+        inotify_item **tmp = (inotify_item **)realloc(batch->items, size * sizeof(inotify_item *));
+        if (tmp == NULL)
+        {
+            return -1;
+        }
+        batch->items = tmp;
+        batch->size = size;
+    }
+    batch->items[batch->num++] = item;
     return 0;
 }
 
-int init_notify_fs(const char *config_file)
+//run the events of one batch in the order they were read.
+static int process_fs_notify_batch(void *arg)
 {
-    atomic_t index_threads_num;         //the number of initial threads to read file from dir directly.
-    atomic_set(&index_threads_num, 0);
-
-    vector<monitor_dir> vdirs;
-    vector<string> vstrdirs;
-    vdirs.clear();
-    vstrdirs.clear();
-
-    g_move_dir = "";
-    g_sym_dirs.clear();
+    inotify_batch *batch = (inotify_batch *)arg;
 
-    g_events = IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM | IN_MOVED_TO /*| IN_DONT_FOLLOW*/;
-
-    g_md = alloc_monitor_dirs();
-    if (g_md == NULL)
+    if (arg == NULL)
     {
-        debug_sys(LOG_ERR, "failed to alloc monitor_dirs\n");
         return -1;
     }
 
-    if (increase_inotify_watches() != 0)
+    for (int i = 0; i < batch->num; i++)
     {
-        debug_sys(LOG_ERR, "increase_inotify_watches failed\n");
-        return -1;
+        process_fs_notify_item((void *)batch->items[i]);
     }
+    free_inotify_batch(batch);
 
-    if (!inotifytools_initialize())
+    //move what fits to the queues that got room, and wait for room only
+    //when no more batches are waiting to merge into the rest.
+    if (!g_spill.empty())
     {
-        debug_sys(LOG_ERR, "Couldn't initialize inotify\n");
-        return -1;
+        spill_flush(bio_jobnum(HANDLE_INOTIFY) <= 1);
     }
 
-    register_ops();
-    create_worker(fs_notify_process, NULL);
-    debug_sys(LOG_NOTICE, "Create notify monitor process Successfully.\n");
-
-    create_worker(dir_check_process, NULL);
-    debug_sys(LOG_NOTICE, "Create check process Successfully.\n");
+    return 0;
+}
 
-    create_worker(dir_change_notify_process, NULL);
+//add item to the batch, the item is released if the batch can not grow.
+static void push_inotify_batch(inotify_batch *batch, inotify_item *item)
+{
+    if (add_inotify_batch(batch, item) != 0)
+    {
+        debug_sys(LOG_ERR, "malloc error for %s\n", item->path);
+        free_inotify_item(item);
+    }
+}
+
+/*
+    file events are held for coalesce_window_ms so that later events
+    on the same path can be merged into them before dispatch:
+        IN_CREATE      + IN_CLOSE_WRITE -> IN_CREATE (one stat)
+        IN_CLOSE_WRITE + IN_CLOSE_WRITE -> IN_CLOSE_WRITE
+        IN_CREATE      + IN_DELETE      -> nothing
+        IN_CLOSE_WRITE + IN_DELETE      -> IN_DELETE
+    any other pair, a move of the path, or a directory event flushes the
+    pending event first, so the order seen by the workers is unchanged.
+    the state lives in the notify_reader of each reader thread.
+*/
+typedef struct coalesce_entry
+{
+    inotify_item *item;
+    uint64_t deadline;
+} coalesce_entry;
+
+typedef map<uint64_t, coalesce_entry> coalesceOrderMap;    //arrival sequence -> entry
+typedef unordered_map<string, uint64_t> coalescePathMap;   //path -> arrival sequence
+
+typedef struct dir_activity
+{
+    uint64_t last;
+    unsigned int hits;
+} dir_activity;
+typedef unordered_map<string, dir_activity> dirActivityMap;
+
+//state of one reader thread, one per inotify instance or the fanotify fd.
+//the owner of a watched dir, a reader caches them direct mapped by wd.
+#define READER_OWNER_CACHE 4096
+
+typedef struct wd_owner
+{
+    int wd;
+    md_owner owner;
+} wd_owner;
+
+struct notify_reader
+{
+    int instance;
+    inotify_batch *batch;
+    uint64_t now;
+
+    coalesceOrderMap coalesce_order;
+    coalescePathMap coalesce_paths;
+    uint64_t coalesce_seq;
+    volatile unsigned long long coalesce_eliminated;   //events never dispatched
+    volatile unsigned long long coalesce_cancelled;    //create+delete pairs
+
+    dirActivityMap dir_activity;
+    uint64_t activity_pruned;
+    uint64_t overflow_until;
+    volatile unsigned long long overflow_num;
+
+    volatile int moves_held;    //IN_MOVED_FROM waiting for a pair, see g_move_pairs
+    volatile unsigned long long ignored;    //events dropped by the ignore list of their root
+
+    wd_owner owners[READER_OWNER_CACHE];    //by watch descriptor, see inotify_event_convert
+    volatile unsigned long long owner_misses;
+};
+
+static notify_reader *g_readers[INOTIFYTOOLS_MAX_INSTANCES + 1];
+static int g_reader_num = 0;
+
+static int is_coalesce_event(int eventmask)
+{
+    return eventmask == IN_CREATE || eventmask == IN_CLOSE_WRITE
+           || eventmask == IN_DELETE;
+}
+
+static void coalesce_remove(notify_reader *r, coalescePathMap::iterator it)
+{
+    r->coalesce_order.erase(it->second);
+    r->coalesce_paths.erase(it);
+}
+
+static void coalesce_flush_path(notify_reader *r, char *path)
+{
+    coalescePathMap::iterator it = r->coalesce_paths.find(string(path, strlen(path)));
+    if (it == r->coalesce_paths.end())
+    {
+        return;
+    }
+
+    push_inotify_batch(r->batch, r->coalesce_order[it->second].item);
+    coalesce_remove(r, it);
+}
+
+static void coalesce_flush_all(notify_reader *r)
+{
+    for (coalesceOrderMap::iterator it = r->coalesce_order.begin();
+         it != r->coalesce_order.end(); it++)
+    {
+        push_inotify_batch(r->batch, it->second.item);
+    }
+    r->coalesce_order.clear();
+    r->coalesce_paths.clear();
+}
+
+//entries are ordered by arrival, so the expired ones are at the front.
+static void coalesce_flush_expired(notify_reader *r)
+{
+    while (!r->coalesce_order.empty())
+    {
+        coalesceOrderMap::iterator it = r->coalesce_order.begin();
+        if (it->second.deadline > r->now)
+        {
+            break;
+        }
+
+        inotify_item *item = it->second.item;
+        r->coalesce_paths.erase(string(item->path, strlen(item->path)));
+        r->coalesce_order.erase(it);
+        push_inotify_batch(r->batch, item);
+    }
+}
+
+//milliseconds until the oldest pending entry expires, -1 if none.
+static int coalesce_timeout(notify_reader *r, uint64_t now)
+{
+    if (r->coalesce_order.empty())
+    {
+        return -1;
+    }
+
+    uint64_t deadline = r->coalesce_order.begin()->second.deadline;
+    return deadline > now ? (int)(deadline - now) : 0;
+}
+
+static void coalesce_add(notify_reader *r, inotify_item *item)
+{
+    string path = string(item->path, strlen(item->path));
+    coalescePathMap::iterator it = r->coalesce_paths.find(path);
+
+    if (it != r->coalesce_paths.end())
+    {
+        inotify_item *pending = r->coalesce_order[it->second].item;
+
+        switch (coalesce_merge(pending, item))
+        {
+        case COALESCE_CANCELLED:
+            debug_sys(LOG_DEBUG, "coalesce: drop create+delete of %s\n", item->path);
+            coalesce_remove(r, it);
+            free_inotify_item(pending);
+            free_inotify_item(item);
+            r->coalesce_eliminated += 2;
+            r->coalesce_cancelled++;
+            return;
+        case COALESCE_ABSORBED:
+            free_inotify_item(item);
+            r->coalesce_eliminated++;
+            return;
+        default:
+            break;
+        }
+
+        push_inotify_batch(r->batch, pending);
+        coalesce_remove(r, it);
+    }
+
+    coalesce_entry entry;
+    entry.item = item;
+    entry.deadline = r->now + g_config.coalesce_window_ms;
+    r->coalesce_order.insert(make_pair(r->coalesce_seq, entry));
+    r->coalesce_paths.insert(make_pair(path, r->coalesce_seq));
+    r->coalesce_seq++;
+}
+
+//dispatch the pending events which must run before item.
+static void coalesce_flush_before(notify_reader *r, inotify_item *item)
+{
+    if (g_config.coalesce_window_ms <= 0)
+    {
+        return;
+    }
+
+    if (item->eventmask == IN_MOVED_FROM || item->eventmask == IN_MOVED_TO)
+    {
+        coalesce_flush_path(r, item->path);
+    }
+    else if (item->eventmask == IN_MOVE)
+    {
+        coalesce_flush_path(r, item->from);
+        coalesce_flush_path(r, item->path);
+    }
+    else
+    {
+        //directory events may touch any pending path below them.
+        coalesce_flush_all(r);
+    }
+}
+
+//route one event from the reader, either into the batch or the coalescing window.
+static void queue_inotify_item(notify_reader *r, inotify_item *item)
+{
+    if (g_config.coalesce_window_ms > 0 && is_coalesce_event(item->eventmask))
+    {
+        coalesce_add(r, item);
+        return;
+    }
+
+    coalesce_flush_before(r, item);
+    push_inotify_batch(r->batch, item);
+}
+
+/*
+    the IN_MOVED_FROM and IN_MOVED_TO of one rename carry the same cookie.
+    the IN_MOVED_FROM is held until its IN_MOVED_TO shows up, then both go
+    out as one IN_MOVE item (path is the new name, from the old one), so the
+    state can be moved instead of deleted and scanned again. cookies are
+    global to the kernel, a rename between two inotify instances pairs too.
+    an IN_MOVED_FROM still alone after MOVE_PAIR_MS, or followed by another
+    event on its path, is released alone: the path was moved away.
+*/
+#define MOVE_PAIR_MS    100
+
+typedef struct move_pending
+{
+    inotify_item *item;
+    uint64_t deadline;
+    notify_reader *owner;
+} move_pending;
+typedef unordered_map<uint32_t, move_pending> movePairMap;
+
+static movePairMap g_move_pairs;
+static pthread_mutex_t g_move_pair_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile unsigned long long g_move_paired = 0;
+static volatile unsigned long long g_move_unpaired = 0;
+
+static void move_pair_hold(notify_reader *r, inotify_item *item, uint32_t cookie)
+{
+    move_pending held;
+    held.item = item;
+    held.deadline = r->now + MOVE_PAIR_MS;
+    held.owner = r;
+
+    //what happened to the path before the move goes first.
+    coalesce_flush_before(r, item);
+
+    pthread_mutex_lock(&g_move_pair_lock);
+    movePairMap::iterator it = g_move_pairs.find(cookie);
+    if (it != g_move_pairs.end())
+    {
+        //a stale cookie, it was never paired.
+        inotify_item *stale = it->second.item;
+        it->second.owner->moves_held--;
+        g_move_pairs.erase(it);
+        g_move_unpaired++;
+        push_inotify_batch(r->batch, stale);
+    }
+    g_move_pairs.insert(make_pair(cookie, held));
+    r->moves_held++;
+    pthread_mutex_unlock(&g_move_pair_lock);
+}
+
+static inotify_item *move_pair_take(uint32_t cookie)
+{
+    inotify_item *item = NULL;
+
+    pthread_mutex_lock(&g_move_pair_lock);
+    movePairMap::iterator it = g_move_pairs.find(cookie);
+    if (it != g_move_pairs.end())
+    {
+        item = it->second.item;
+        it->second.owner->moves_held--;
+        g_move_pairs.erase(it);
+        g_move_paired++;
+    }
+    pthread_mutex_unlock(&g_move_pair_lock);
+
+    return item;
+}
+
+//release the held moves of r which expired, or all of them on path.
+static void move_pair_release(notify_reader *r, char *path)
+{
+    vector<inotify_item *> vItems;
+
+    if (r->moves_held == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&g_move_pair_lock);
+    for (movePairMap::iterator it = g_move_pairs.begin(); it != g_move_pairs.end();)
+    {
+        move_pending &held = it->second;
+        if (held.owner == r
+            && (path != NULL ? strcmp(held.item->path, path) == 0 : held.deadline <= r->now))
+        {
+            vItems.push_back(held.item);
+            r->moves_held--;
+            g_move_unpaired++;
+            g_move_pairs.erase(it++);
+        }
+        else
+        {
+            it++;
+        }
+    }
+    pthread_mutex_unlock(&g_move_pair_lock);
+
+    for (vector<inotify_item *>::iterator it = vItems.begin(); it != vItems.end(); it++)
+    {
+        push_inotify_batch(r->batch, *it);
+    }
+}
+
+static int move_pair_timeout(notify_reader *r, uint64_t now)
+{
+    uint64_t deadline = 0;
+
+    if (r->moves_held == 0)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&g_move_pair_lock);
+    for (movePairMap::iterator it = g_move_pairs.begin(); it != g_move_pairs.end(); it++)
+    {
+        if (it->second.owner == r && (deadline == 0 || it->second.deadline < deadline))
+        {
+            deadline = it->second.deadline;
+        }
+    }
+    pthread_mutex_unlock(&g_move_pair_lock);
+
+    if (deadline == 0)
+    {
+        return -1;
+    }
+    return deadline > now ? (int)(deadline - now) : 0;
+}
+
+/*
+    when the kernel queue overflows, the events lost are unknown. the reader
+    remembers which directories saw events in the last ACTIVITY_WINDOW_MS,
+    and on IN_Q_OVERFLOW those directories, plus the ones active during the
+    following ACTIVITY_WINDOW_MS, are queued for a rescan. the busiest
+    directories are rescanned first, at most overflow_rescan_rate per second.
+*/
+#define ACTIVITY_WINDOW_MS  5000
+#define MAX_ACTIVE_DIRS     65536
+
+typedef pair<unsigned int, string> rescan_req;  //hits, dir
+static priority_queue<rescan_req> g_rescan_queue;
+static strCharhashMap g_rescan_set;
+static pthread_mutex_t g_rescan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_rescan_cond = PTHREAD_COND_INITIALIZER;
+
+static volatile unsigned long long g_rescan_queued = 0;
+static volatile unsigned long long g_rescan_done = 0;
+
+static void post_rescan_dir(const string &dir, unsigned int hits)
+{
+    pthread_mutex_lock(&g_rescan_lock);
+    if (add_key_set(g_rescan_set, dir) == 0)
+    {
+        g_rescan_queue.push(make_pair(hits, dir));
+        g_rescan_queued++;
+        pthread_cond_signal(&g_rescan_cond);
+    }
+    pthread_mutex_unlock(&g_rescan_lock);
+}
+
+static void prune_dir_activity(notify_reader *r)
+{
+    for (dirActivityMap::iterator it = r->dir_activity.begin(); it != r->dir_activity.end();)
+    {
+        if (r->now - it->second.last > ACTIVITY_WINDOW_MS)
+        {
+            r->dir_activity.erase(it++);
+        }
+        else
+        {
+            it++;
+        }
+    }
+
+    //a storm over too many directories, start over rather than grow forever.
+    if (r->dir_activity.size() > MAX_ACTIVE_DIRS)
+    {
+        r->dir_activity.clear();
+    }
+    r->activity_pruned = r->now;
+}
+
+static void note_dir_activity(notify_reader *r, char *path, int eventmask)
+{
+    string dir;
+    char *slash = NULL;
+
+    if (eventmask == IN_DELETE_SELF)
+    {
+        dir = string(path, strlen(path));
+    }
+    else
+    {
+        slash = strrchr(path, '/');
+        if (slash == NULL)
+        {
+            return;
+        }
+        dir = string(path, slash == path ? 1 : slash - path);
+    }
+
+    dir_activity &act = r->dir_activity[dir];
+    if (r->now - act.last > ACTIVITY_WINDOW_MS)
+    {
+        act.hits = 0;
+    }
+    act.hits++;
+    act.last = r->now;
+
+    if (r->now < r->overflow_until)
+    {
+        post_rescan_dir(dir, act.hits);
+    }
+
+    if (r->now - r->activity_pruned > ACTIVITY_WINDOW_MS
+        || r->dir_activity.size() > MAX_ACTIVE_DIRS)
+    {
+        prune_dir_activity(r);
+    }
+}
+
+//only the directories of the overflowed queue are rescanned.
+static void handle_queue_overflow(notify_reader *r)
+{
+    int num = 0;
+
+    r->overflow_num++;
+    r->overflow_until = r->now + ACTIVITY_WINDOW_MS;
+
+    for (dirActivityMap::iterator it = r->dir_activity.begin();
+         it != r->dir_activity.end(); it++)
+    {
+        if (r->now - it->second.last <= ACTIVITY_WINDOW_MS)
+        {
+            post_rescan_dir(it->first, it->second.hits);
+            num++;
+        }
+    }
+    debug_sys(LOG_ERR, "event queue %d overflow (%llu so far), %d active dirs queued for rescan\n",
+              r->instance, r->overflow_num, num);
+}
+
+//subdirs created while the queue was overflowing were never watched.
+static void rescan_new_subdirs(monitor_dir *dirinfo)
+{
+    char buf[MAX_PATH] = {0};
+    DIR *dirp = NULL;
+    struct dirent *dp = NULL;
+    inotify_item *item = NULL;
+    int len = strlen(dirinfo->dir_name);
+
+    if (dirinfo->directory_level <= 1)
+    {
+        return;
+    }
+
+    dirp = opendir(dirinfo->dir_name);
+    if (dirp == NULL)
+    {
+        return;
+    }
+
+    while ((dp = (struct dirent *)readdir64(dirp)) != NULL)
+    {
+        if (dp->d_name[0] == '.' || dp->d_type != DT_DIR)
+        {
+            continue;
+        }
+
+        snprintf(buf, sizeof(buf), "%s%s%s", dirinfo->dir_name,
+                 (len > 0 && dirinfo->dir_name[len - 1] == '/') ? "" : "/", dp->d_name);
+        if (is_monitor_dir(g_md, buf) == FOUND
+            || is_exclude_dir(buf, &g_md->ex_dirs) == FOUND)
+        {
+            continue;
+        }
+
+        //replay it as a directory create through the normal event path.
+        item = alloc_inotify_item(buf, IN_CREATE | IN_ISDIR);
+        if (item != NULL)
+        {
+            debug_sys(LOG_NOTICE, "rescan found unwatched dir %s\n", buf);
+            bio_post_job(HANDLE_INOTIFY, &item->job, process_fs_notify_item, (void *)item);
+        }
+    }
+    closedir(dirp);
+}
+
+static void rescan_one_dir(string &dir)
+{
+    monitor_dir dirinfo;
+    string key = dir;
+
+    if (find_monitor_dir_info(g_md, (char *)key.c_str(), &dirinfo) != FOUND)
+    {
+        key += "/";
+        if (find_monitor_dir_info(g_md, (char *)key.c_str(), &dirinfo) != FOUND)
+        {
+            return;
+        }
+    }
+
+    debug_sys(LOG_DEBUG, "overflow rescan for dir %s\n", dirinfo.dir_name);
+    __build_directory_index((void *)dirinfo.dir_name);
+    rescan_new_subdirs(&dirinfo);
+    g_rescan_done++;
+}
+
+//apply the counter updates left in the buffers of idle workers.
+static void *delta_flush_process(void *arg)
+{
+    pthread_detach(pthread_self());
+    while (1)
+    {
+        my_usleep(g_md->delta_flush_ms * 1000);
+        flush_monitor_deltas(g_md);
+    }
+    return NULL;
+}
+
+static void *overflow_rescan_process(void *arg)
+{
+    rescan_req req;
+    int interval = 1000000 / g_config.overflow_rescan_rate;
+
+    pthread_detach(pthread_self());
+    while (1)
+    {
+        pthread_mutex_lock(&g_rescan_lock);
+        while (g_rescan_queue.empty())
+        {
+            pthread_cond_wait(&g_rescan_cond, &g_rescan_lock);
+        }
+        req = g_rescan_queue.top();
+        g_rescan_queue.pop();
+        del_key_set(g_rescan_set, req.second);
+        pthread_mutex_unlock(&g_rescan_lock);
+
+        if (g_build_index_ok == 0)
+        {
+            continue;
+        }
+
+        rescan_one_dir(req.second);
+
+        if (interval >= 1000000)
+        {
+            my_sleep(interval / 1000000);
+        }
+        else
+        {
+            my_usleep(interval);
+        }
+    }
+    return NULL;
+}
+
+/*
+    every event source (an inotify instance or the fanotify fd) has its own
+    reader thread and notify_reader, and hands its events over through the
+    notify_reader_* calls, one begin/end pair per read.
+*/
+notify_reader *alloc_notify_reader(int instance)
+{
+    notify_reader *r = NULL;
+
+    if (g_reader_num >= INOTIFYTOOLS_MAX_INSTANCES + 1)
+    {
+        return NULL;
+    }
+
+    r = new notify_reader();
+    r->instance = instance;
+    g_readers[g_reader_num++] = r;
+    return r;
+}
+
+//called by the reader thread itself, readers take the CPUs of reader_cpus in turn.
+void notify_reader_pin(notify_reader *r)
+{
+    affinity_pin(g_config.reader_cpus, r->instance);
+}
+
+//poll timeout for the reader, in milliseconds.
+int notify_reader_timeout(notify_reader *r)
+{
+    uint64_t now = get_mstime();
+    int timeout = coalesce_timeout(r, now);
+    int move_timeout = move_pair_timeout(r, now);
+
+    if (timeout < 0 || (move_timeout >= 0 && move_timeout < timeout))
+    {
+        timeout = move_timeout;
+    }
+    return timeout;
+}
+
+int notify_reader_begin(notify_reader *r)
+{
+    r->batch = alloc_inotify_batch();
+    if (r->batch == NULL)
+    {
+        debug_sys(LOG_ERR, "malloc error for inotify batch\n");
+        return -1;
+    }
+    r->now = get_mstime();
+    return 0;
+}
+
+void notify_reader_overflow(notify_reader *r)
+{
+    handle_queue_overflow(r);
+}
+
+//for readers without a wd, file is the whole path of a non directory.
+int notify_reader_ignored(notify_reader *r, char *file)
+{
+    name_filter *nf = NULL;
+    char *name = strrchr(file, '/');
+
+    if (!have_ignore_filters())
+    {
+        return 0;
+    }
+
+    nf = find_ignore_filter(file);
+    if (is_ignored_name(nf, name ? name + 1 : file) == FOUND
+        || is_ignored_path(nf, file) == FOUND)
+    {
+        r->ignored++;
+        return 1;
+    }
+    return 0;
+}
+
+//cookie is the inotify cookie of a move, 0 if it is unknown.
+void notify_reader_event(notify_reader *r, char *file, int eventmask, uint32_t cookie, md_owner *owner)
+{
+    inotify_item *item = NULL;
+    int action = eventmask & ~IN_ISDIR;
+
+    note_dir_activity(r, file, eventmask);
+
+    //a held move of this path happened before this event.
+    move_pair_release(r, file);
+
+    if (action == IN_MOVED_TO && cookie != 0)
+    {
+        inotify_item *held = move_pair_take(cookie);
+        if (held != NULL && held->eventmask == (IN_MOVED_FROM | (eventmask & IN_ISDIR)))
+        {
+            item = alloc_inotify_item(file, IN_MOVE | (eventmask & IN_ISDIR));
+            if (item != NULL && (item->from = strdup(held->path)) != NULL)
+            {
+                if (owner != NULL)
+                {
+                    item->owner = *owner;
+                }
+                free_inotify_item(held);
+                queue_inotify_item(r, item);
+                return;
+            }
+            free_inotify_item(item);
+        }
+        if (held != NULL)
+        {
+            queue_inotify_item(r, held);
+        }
+    }
+
+    item = alloc_inotify_item(file, eventmask);
+    if (item == NULL)
+    {
+        return;
+    }
+    if (owner != NULL)
+    {
+        item->owner = *owner;
+    }
+
+    if (action == IN_MOVED_FROM && cookie != 0)
+    {
+        move_pair_hold(r, item, cookie);
+        return;
+    }
+
+    queue_inotify_item(r, item);
+}
+
+void notify_reader_end(notify_reader *r)
+{
+    move_pair_release(r, NULL);
+    coalesce_flush_expired(r);
+
+    if (r->batch->num == 0)
+    {
+        free_inotify_batch(r->batch);
+    }
+    else
+    {
+        //a reader always waits, the kernel queue takes the backlog then.
+        bio_wait_space(HANDLE_INOTIFY);
+        bio_post_job(HANDLE_INOTIFY, &r->batch->job, process_fs_notify_batch, (void *)r->batch);
+    }
+    r->batch = NULL;
+}
+
+//one thread per inotify instance, arg is the notify_reader of the instance.
+/*
+    the path of the event, and for an event on a name in the watched dir the
+    owner of that dir. the owner is kept per watch in a small cache of the
+    reader and looked up again only after the registry changed.
+*/
+static int inotify_event_convert(notify_reader *r, struct inotify_event *event, char *file,
+                                 int *eventmask, md_owner *owner)
+{
+    int len = 0, namelen = 0;
+    wd_owner *cached = NULL;
+
+    *eventmask = event->mask;
+    owner->rec = NULL;
+    //copy the name out, another reader may rename the watch meanwhile.
+    len = inotifytools_copy_filename_from_wd(r->instance, event->wd, file, MAX_PATH);
+    if (len <= 0 || event->mask == 0)
+    {
+        debug_sys(LOG_ERR, "get wrong event, drop it\n");
+        return -1;
+    }
+    if (len > 1 && file[len - 1] == '/')
+    {
+        file[--len] = '\0';
+    }
+    if (event->mask == IN_DELETE_SELF || event->len == 0)
+    {
+        return 0;
+    }
+
+    cached = &r->owners[(unsigned int)event->wd % READER_OWNER_CACHE];
+    if (cached->wd != event->wd)
+    {
+        cached->wd = event->wd;
+        cached->owner.rec = NULL;
+        r->owner_misses++;
+    }
+    if (resolve_monitor_owner(g_md, file, &cached->owner) == FOUND)
+    {
+        *owner = cached->owner;
+    }
+
+    namelen = strlen(event->name);
+    if (len + 1 + namelen >= MAX_PATH)
+    {
+        debug_sys(LOG_ERR, "path too long under %s, drop it\n", file);
+        return -1;
+    }
+    file[len] = '/';
+    memcpy(file + len + 1, event->name, namelen + 1);
+    return 0;
+}
+
+static void *fs_notify_process(void *arg)
+{
+    char file[MAX_PATH];
+    int eventmask, bytes, timeout;
+    char *p = NULL, *end = NULL;
+    struct inotify_event *event = NULL;
+    name_filter *nf = NULL;
+    md_owner owner;
+    notify_reader *r = (notify_reader *)arg;
+
+    pthread_detach(pthread_self());
+    notify_reader_pin(r);
+
+    while (1)
+    {
+        debug_sys(LOG_DEBUG, "Get inotify batch of instance %d\n", r->instance);
+
+        //wake up in time to release the oldest coalesced event.
+        timeout = notify_reader_timeout(r);
+        event = inotifytools_next_batch_instance(r->instance, timeout, &bytes);
+        if (!event && inotifytools_error() != 0)
+        {
+            debug_sys(LOG_ERR,  "%s\n", strerror(inotifytools_error()));
+            continue;
+        }
+
+        if (notify_reader_begin(r) != 0)
+        {
+            debug_sys(LOG_ERR, "drop %d bytes of events\n", bytes);
+            continue;
+        }
+
+        end = (char *)event + bytes;
+        for (p = (char *)event; p < end; p += sizeof(struct inotify_event) + event->len)
+        {
+            event = (struct inotify_event *)p;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                notify_reader_overflow(r);
+                continue;
+            }
+
+            //ignored names are dropped before the path is built.
+            nf = NULL;
+            if (event->len > 0 && (event->mask & IN_ISDIR) == 0 && have_ignore_filters())
+            {
+                nf = ignore_filter_of_root(inotifytools_root_from_wd(r->instance, event->wd));
+                if (is_ignored_name(nf, event->name) == FOUND)
+                {
+                    r->ignored++;
+                    continue;
+                }
+            }
+
+            if (inotify_event_convert(r, event, file, &eventmask, &owner) != 0)
+            {
+                debug_sys(LOG_ERR, "convert error for file %s event %d\n", file, eventmask);
+                continue;
+            }
+
+            if (is_ignored_path(nf, file) == FOUND)
+            {
+                r->ignored++;
+                continue;
+            }
+
+            if (eventmask == IN_IGNORED)
+            {
+                continue;
+            }
+
+            notify_reader_event(r, file, eventmask, event->cookie, &owner);
+        }
+
+        notify_reader_end(r);
+    }
+
+    return NULL;
+}
+
+void print_notify_stats()
+{
+    int i = 0;
+    unsigned long long eliminated = 0, cancelled = 0, overflows = 0, ignored = 0, owner_misses = 0;
+    inotifytools_batch_stats st;
+    memset(&st, 0, sizeof(st));
+    inotifytools_get_batch_stats(&st);
+
+    debug_sys(LOG_NOTICE, "inotify batches %llu, events %llu, syscalls %llu, max batch %llu, "
+              "avg batch %.2f, syscalls per event %.4f\n",
+              st.batches, st.events, st.syscalls, st.max_batch,
+              st.batches ? (double)st.events / st.batches : 0.0,
+              st.events ? (double)st.syscalls / st.events : 0.0);
+
+    for (i = 0; i < g_reader_num; i++)
+    {
+        notify_reader *r = g_readers[i];
+        if (g_reader_num > 1)
+        {
+            memset(&st, 0, sizeof(st));
+            inotifytools_get_batch_stats_instance(r->instance, &st);
+            debug_sys(LOG_NOTICE, "instance %d: batches %llu, events %llu, max batch %llu, "
+                      "overflows %llu, dirs tracked %u\n",
+                      r->instance, st.batches, st.events, st.max_batch,
+                      r->overflow_num, (unsigned)r->dir_activity.size());
+        }
+        eliminated += r->coalesce_eliminated;
+        cancelled += r->coalesce_cancelled;
+        overflows += r->overflow_num;
+        ignored += r->ignored;
+        owner_misses += r->owner_misses;
+    }
+
+    debug_sys(LOG_NOTICE, "coalesce window %d ms, events eliminated %llu, create+delete pairs dropped %llu\n",
+              g_config.coalesce_window_ms, eliminated, cancelled);
+    debug_sys(LOG_NOTICE, "inotify queue overflows %llu, dirs queued for rescan %llu, rescanned %llu\n",
+              overflows, g_rescan_queued, g_rescan_done);
+    debug_sys(LOG_NOTICE, "renames paired %llu, moves without pair %llu\n",
+              g_move_paired, g_move_unpaired);
+    debug_sys(LOG_NOTICE, "events dropped by ignore lists %llu\n", ignored);
+    debug_sys(LOG_NOTICE, "watch owner cache misses %llu\n", owner_misses);
+    debug_sys(LOG_NOTICE, "full queues: waited %llu, events spilled %llu, merged in spill %llu, "
+              "dirs marked dirty %llu\n",
+              g_full_blocked, g_full_spilled, g_full_merged, g_full_dirty);
+
+    pthread_mutex_lock(&g_item_slab_lock);
+    debug_sys(LOG_NOTICE, "event items allocated %d, in depot %lu, depot refills %llu, returns %llu, "
+              "trimmed %llu, long paths %d\n",
+              atomic_read(&g_item_total), g_item_depot_num, g_item_refills, g_item_returns,
+              g_item_trimmed, atomic_read(&g_item_long_path));
+    pthread_mutex_unlock(&g_item_slab_lock);
+}
+static void register_op(int eventmask, inotify_process func)
+{
+    eventFuncMap::iterator it = g_funcs.find(eventmask);
+    if (it == g_funcs.end())
+    {
+        g_funcs.insert(make_pair(eventmask, func));
+    }
+}
+
+static void register_ops()
+{
+    register_op(IN_CREATE, do_create_file);
+    register_op(IN_CREATE | IN_ISDIR, do_create_dir);
+    register_op(IN_CLOSE_WRITE, do_close_write);
+    register_op(IN_DELETE, do_delete_file);
+    register_op(IN_DELETE_SELF, do_delete_dir_notify);
+    register_op(IN_DELETE | IN_ISDIR, do_delete_dir);
+    register_op(IN_MOVED_FROM, do_move_file_from);
+    register_op(IN_MOVED_TO, do_move_file_to);
+    register_op(IN_MOVED_FROM | IN_ISDIR, do_move_dir_from);
+    register_op(IN_MOVED_TO | IN_ISDIR, do_move_dir_to);
+    register_op(IN_MOVE, do_move_file);
+    register_op(IN_MOVE | IN_ISDIR, do_move_dir);
+}
+
+static int increase_inotify_number(unsigned long long max_num, char *dirkey)
+{
+    char cmd[TMP_BUFSIZ] = {0};
+    int ret = -1;
+
+    while (1)
+    {
+        snprintf(cmd, TMP_BUFSIZ, "echo %llu > %s", max_num, dirkey);
+        ret = system(cmd);
+        if (ret != 0)
+        {
+            max_num = max_num / 2;
+            if (max_num <= 1)
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+    debug_sys(LOG_NOTICE, "max inotify num for %s to :%llu\n", dirkey, max_num);
+    return 0;
+}
+
+static int increase_inotify_watches()
+{
+    increase_inotify_number(9999999999ULL, (char *)"/proc/sys/fs/inotify/max_user_watches");
+    increase_inotify_number(102400UL, (char *)"/proc/sys/fs/inotify/max_queued_events");
+    increase_inotify_number(9999999999ULL, (char *)"/proc/sys/fs/inotify/max_user_instances");
+    return 0;
+}
+
+int init_notify_fs(const char *config_file)
+{
+    atomic_t index_threads_num;         //the number of initial threads to read file from dir directly.
+    atomic_set(&index_threads_num, 0);
+
+    vector<monitor_dir> vdirs;
+    vector<string> vstrdirs;
+    vdirs.clear();
+    vstrdirs.clear();
+
+    g_sym_dirs.clear();
+
+    g_events = IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM | IN_MOVED_TO /*| IN_DONT_FOLLOW*/;
+
+    g_md = alloc_monitor_dirs();
+    if (g_md == NULL)
+    {
+        debug_sys(LOG_ERR, "failed to alloc monitor_dirs\n");
+        return -1;
+    }
+    g_md->delta_flush_ms = g_config.delta_flush_ms;
+    g_md->lazy_rollup = g_config.lazy_rollup;
+
+    if (g_config.notify_backend != NULL && strcmp(g_config.notify_backend, "fanotify") == 0)
+    {
+        if (fanotify_init_backend() == 0)
+        {
+            g_notify_backend = NOTIFY_FANOTIFY;
+        }
+        else
+        {
+            debug_sys(LOG_ERR, "fanotify backend is not available, fall back to inotify\n");
+        }
+    }
+
+    if (g_config.queue_full_policy != NULL)
+    {
+        if (strcmp(g_config.queue_full_policy, "coalesce") == 0)
+        {
+            g_queue_full_policy = QUEUE_FULL_COALESCE;
+        }
+        else if (strcmp(g_config.queue_full_policy, "dirty") == 0)
+        {
+            g_queue_full_policy = QUEUE_FULL_DIRTY;
+        }
+        else if (strcmp(g_config.queue_full_policy, "block") != 0)
+        {
+            debug_sys(LOG_ERR, "unknown queue_full_policy %s, use block\n", g_config.queue_full_policy);
+        }
+    }
+
+    register_ops();
+
+    if (g_notify_backend == NOTIFY_FANOTIFY)
+    {
+        create_worker(fan_notify_process, (void *)alloc_notify_reader(0));
+        debug_sys(LOG_NOTICE, "Create fanotify monitor process Successfully.\n");
+    }
+    else
+    {
+        if (increase_inotify_watches() != 0)
+        {
+            debug_sys(LOG_ERR, "increase_inotify_watches failed\n");
+            return -1;
+        }
+
+        if (!inotifytools_initialize_instances(g_config.inotify_instances))
+        {
+            debug_sys(LOG_ERR, "Couldn't initialize inotify\n");
+            return -1;
+        }
+
+        for (int i = 0; i < inotifytools_get_num_instances(); i++)
+        {
+            create_worker(fs_notify_process, (void *)alloc_notify_reader(i));
+        }
+        debug_sys(LOG_NOTICE, "Create %d notify monitor process Successfully.\n",
+                  inotifytools_get_num_instances());
+    }
+
+    create_worker(dir_check_process, NULL);
+    debug_sys(LOG_NOTICE, "Create check process Successfully.\n");
+
+    create_worker(dir_change_notify_process, NULL);
     debug_sys(LOG_NOTICE, "Create notify monitor process Successfully.\n");
 
+    create_worker(overflow_rescan_process, NULL);
+    debug_sys(LOG_NOTICE, "Create overflow rescan process Successfully.\n");
+
+    if (g_md->delta_flush_ms > 0)
+    {
+        create_worker(delta_flush_process, NULL);
+        debug_sys(LOG_NOTICE, "Create delta flush process Successfully.\n");
+    }
+
     if (get_monitor_dir_from_config(config_file, g_md) != 0)
     {
         debug_sys(LOG_ERR, "Couldn't read config file %s\n", config_file);
@@ -1540,11 +3124,11 @@ int init_notify_fs(const char *config_file)
     {
         vstrdirs.push_back(it->dir_name);
     }
-    build_directorys_index(g_md, vstrdirs, MAX_BUILD_THREADS, index_threads_num);
+    build_directorys_index(g_md, vstrdirs, index_threads_num);
     debug_sys(LOG_NOTICE, "Build directory Successfully.\n");
 
     //bio thread begins to work now.
-    g_build_index_ok = 1;
+    bio_start_jobs();
     debug_sys(LOG_NOTICE, "Watches established, Init notify fs ok!!!\n");
 
     return 0;
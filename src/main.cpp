@@ -22,6 +22,7 @@
 #include "monitor_dir.h"
 #include "bio.h"
 #include "dump.h"
+#include "affinity.h"
 
 #define PID_FILE "/var/run/dircounter.pid"
 
@@ -177,6 +178,9 @@ int main(int argc, char **argv)
 
     debug_sys(LOG_NOTICE, "dircounter begin to init\n");
 
+    //the threads started from here on inherit it, bio workers and readers pin themselves again.
+    affinity_pin(g_config.service_cpus, -1);
+
     mem_object_init();
     snprintf(internal_path, 1024, "%s", g_config.db_dir);
     g_hash_db = init_kv_storage(internal_path, (char *)"tmp", HASH, 1, 1);
@@ -186,7 +190,7 @@ int main(int argc, char **argv)
         exit(-1);
     }
 
-    ret = bio_init();
+    ret = bio_init(g_config.bio_threads, g_config.bio_queue_limit, g_config.worker_cpus);
     PEXIT_EX("init bio error\n");
 
     ret = init_notify_fs(g_config.default_monitor_file);
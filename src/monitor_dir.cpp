@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <fnmatch.h>
 #include "inotifytools.h"
 #include "inotify.h"
 #include "inotify-nosys.h"
@@ -14,256 +15,1570 @@ monitor_dirs *g_md = NULL;
 pthread_mutex_t g_delete_dir_lock = PTHREAD_MUTEX_INITIALIZER;
 strCharhashMap g_delete_dir(1024);
 
-static int __find_exclude_pattern(char *pattern, exclude_dir_array *ed)
+/*
+    exclude names. a plain name goes into one automaton shared by all
+    roots, a name holding regex characters stays a studied pcre pattern.
+    a path is only checked against the roots it lies below, found by
+    probing its prefixes of root length, so most paths miss without
+    scanning anything. answers, both ways, go to a fixed cache.
+*/
+#define EX_NONE 0xffffffff
+#define EX_MAX_NESTED 8     //roots above one path kept on the stack
+
+typedef struct exclude_automaton
 {
-    string strpatn(pattern, strlen(pattern));
-    vector<edir> vdirs = ed->vdirs;
-    for (vector<edir>::iterator it = vdirs.begin();
-         it != vdirs.end(); it++)
+    unsigned char byte_class[256];  //0 for the bytes in no name
+    uint32_t classes;
+    vector<uint32_t> delta;         //next state, at state * classes + class
+    vector<uint32_t> out;           //the name ending at the state
+    vector<uint32_t> out_link;      //next state down the suffix chain ending a name
+    vector<uint32_t> lit_len;
+} exclude_automaton;
+
+typedef struct exclude_root
+{
+    string path;
+    int all;                    //an empty name, everything below is excluded
+    vector<uint32_t> literals;  //sorted ids of the plain names
+    vector<edir> regexes;
+} exclude_root;
+
+static uint32_t exclude_hash(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+    size_t i = 0;
+
+    for (i = 0; i < len; i++)
+    {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+//aho-corasick over the names, with the failure links folded into delta.
+static exclude_automaton *build_exclude_automaton(vector<string> &literals)
+{
+    exclude_automaton *a = new exclude_automaton;
+    vector<uint32_t> fail, queue;
+    uint32_t classes = 1, s = 0, t = 0, f = 0, cl = 0;
+    size_t i = 0, j = 0;
+
+    memset(a->byte_class, 0, sizeof(a->byte_class));
+    for (i = 0; i < literals.size(); i++)
     {
-        if (it->dirpattern == strpatn)
+        for (j = 0; j < literals[i].length(); j++)
         {
-            return FOUND;
+            unsigned char c = literals[i][j];
+            if (a->byte_class[c] == 0)
+            {
+                a->byte_class[c] = classes++;
+            }
         }
     }
-    return NFOUND;
+    a->classes = classes;
+
+    a->delta.assign(classes, EX_NONE);
+    a->out.assign(1, EX_NONE);
+    for (i = 0; i < literals.size(); i++)
+    {
+        s = 0;
+        for (j = 0; j < literals[i].length(); j++)
+        {
+            cl = a->byte_class[(unsigned char)literals[i][j]];
+            if (a->delta[s * classes + cl] == EX_NONE)
+            {
+                a->delta[s * classes + cl] = a->out.size();
+                a->delta.resize(a->delta.size() + classes, EX_NONE);
+                a->out.push_back(EX_NONE);
+            }
+            s = a->delta[s * classes + cl];
+        }
+        a->out[s] = i;
+        a->lit_len.push_back(literals[i].length());
+    }
+
+    fail.assign(a->out.size(), 0);
+    a->out_link.assign(a->out.size(), EX_NONE);
+    for (cl = 0; cl < classes; cl++)
+    {
+        t = a->delta[cl];
+        if (t == EX_NONE)
+        {
+            a->delta[cl] = 0;
+        }
+        else
+        {
+            queue.push_back(t);
+        }
+    }
+    for (i = 0; i < queue.size(); i++)
+    {
+        s = queue[i];
+        for (cl = 0; cl < classes; cl++)
+        {
+            t = a->delta[s * classes + cl];
+            f = a->delta[fail[s] * classes + cl];
+            if (t == EX_NONE)
+            {
+                a->delta[s * classes + cl] = f;
+                continue;
+            }
+            fail[t] = f;
+            a->out_link[t] = a->out[f] != EX_NONE ? f : a->out_link[f];
+            queue.push_back(t);
+        }
+    }
+    return a;
+}
+
+static void free_exclude_root(exclude_root *r, int free_regexes)
+{
+    if (free_regexes)
+    {
+        for (vector<edir>::iterator it = r->regexes.begin(); it != r->regexes.end(); it++)
+        {
+#ifdef PCRE_STUDY_JIT_COMPILE
+            pcre_free_study(it->extra);
+#else
+            pcre_free(it->extra);
+#endif
+            pcre_free(it->re);
+        }
+    }
+    delete r;
 }
 
-int add_exclude_pattern(char *dirpattern , exclude_dir_array *ed)
+//add "^root/(.*)name(.*)$", FOUND if it was there already.
+int add_exclude_pattern(char *root, const char *name, exclude_dir_array *ed)
 {
     const char *error = NULL;
     int erroffset = 0;
-    pcre *re = NULL;
+    string path(root, strlen(root)), dirpattern;
+    exclude_root *r = NULL, *old = NULL;
+    exclude_automaton *a = NULL;
+    strInthashMap::iterator it;
+    uint32_t slot = 0, id = 0;
     edir dir_tmp;
 
+    if (path.length() > 1 && path[path.length() - 1] == '/')
+    {
+        path.erase(path.length() - 1);
+    }
+    if (path.empty() || path.length() >= MAX_PATH)
+    {
+        debug_sys(LOG_ERR, "bad exclude root %s\n", root);
+        return ERROR;
+    }
+    dirpattern = "^" + path + "/(.*)" + name + "(.*)$";
+
     pthread_mutex_lock(&ed->ex_lock);
-    if (__find_exclude_pattern(dirpattern, ed) == FOUND)
+    if (is_key_set(ed->pattern_map, dirpattern) == FOUND)
     {
         pthread_mutex_unlock(&ed->ex_lock);
         return FOUND;
     }
 
-    re = pcre_compile(dirpattern, 0, &error, &erroffset, NULL);
-    if (re == NULL)
+    slot = exclude_hash(path.data(), path.length()) % EXCLUDE_ROOT_SLOTS;
+    while ((old = ed->roots[slot]) != NULL && old->path != path)
+    {
+        slot = (slot + 1) % EXCLUDE_ROOT_SLOTS;
+    }
+    if (old == NULL && ed->root_num >= MAX_MONITOR_DIRS)
     {
         pthread_mutex_unlock(&ed->ex_lock);
-        debug_sys(LOG_ERR, "PCRE compilation telephone failed at offset %d: %s\n", erroffset,  error);
+        debug_sys(LOG_ERR, "too many roots, no exclude list for %s\n", root);
         return ERROR;
     }
 
-    dir_tmp.dirpattern = string(dirpattern, strlen(dirpattern));
-    dir_tmp.re = re;
-    ed->vdirs.push_back(dir_tmp);
+    dir_tmp.dirpattern = dirpattern;
+    dir_tmp.re = NULL;
+    dir_tmp.extra = NULL;
+    if (strpbrk(name, "\\^$.|?*+()[]{}") != NULL)
+    {
+        dir_tmp.re = pcre_compile(dirpattern.c_str(), 0, &error, &erroffset, NULL);
+        if (dir_tmp.re == NULL)
+        {
+            pthread_mutex_unlock(&ed->ex_lock);
+            debug_sys(LOG_ERR, "PCRE compilation failed at offset %d: %s\n", erroffset, error);
+            return ERROR;
+        }
+#ifdef PCRE_STUDY_JIT_COMPILE
+        dir_tmp.extra = pcre_study(dir_tmp.re, PCRE_STUDY_JIT_COMPILE, &error);
+#else
+        dir_tmp.extra = pcre_study(dir_tmp.re, 0, &error);
+#endif
+    }
+
+    if (old != NULL)
+    {
+        r = new exclude_root(*old);
+    }
+    else
+    {
+        r = new exclude_root;
+        r->path = path;
+        r->all = 0;
+    }
+
+    if (dir_tmp.re != NULL)
+    {
+        r->regexes.push_back(dir_tmp);
+    }
+    else if (*name == '\0')
+    {
+        r->all = 1;
+    }
+    else
+    {
+        it = ed->literal_ids.find(string(name));
+        if (it == ed->literal_ids.end())
+        {
+            id = ed->literals.size();
+            ed->literals.push_back(string(name));
+            ed->literal_ids.insert(make_pair(string(name), (int)id));
+
+            //the names of a root must not reach readers before the automaton.
+            a = build_exclude_automaton(ed->literals);
+            if (ed->automaton != NULL)
+            {
+                ed->old_automata.push_back((exclude_automaton *)ed->automaton);
+            }
+            __sync_synchronize();
+            ed->automaton = a;
+        }
+        else
+        {
+            id = it->second;
+        }
+        r->literals.insert(lower_bound(r->literals.begin(), r->literals.end(), id), id);
+    }
+
+    add_key_set(ed->pattern_map, dirpattern);
+    __sync_synchronize();
+    ed->root_lens[path.length() >> 3] |= 1 << (path.length() & 7);
+    ed->roots[slot] = r;
+    if (old != NULL)
+    {
+        ed->old_roots.push_back(old);
+    }
+    else
+    {
+        ed->root_num++;
+    }
+    __sync_synchronize();
+    ed->gen++;
     pthread_mutex_unlock(&ed->ex_lock);
 
     return NFOUND;
 }
 
-static int __is_exclude_dir(char *dir , exclude_dir_array *ed)
+//the roots above dir, outermost first, and the lengths of their paths.
+//returns how many there are, only the first max are stored.
+static int exclude_roots_of(exclude_dir_array *ed, const char *dir, size_t len,
+                            exclude_root **roots, size_t *lens, int max)
+{
+    exclude_root *r = NULL;
+    uint32_t slot = 0;
+    size_t i = 0;
+    int num = 0;
+
+    for (i = 1; i < len && i < MAX_PATH; i++)
+    {
+        if (dir[i] != '/' || !(ed->root_lens[i >> 3] & (1 << (i & 7))))
+        {
+            continue;
+        }
+        slot = exclude_hash(dir, i) % EXCLUDE_ROOT_SLOTS;
+        while ((r = ed->roots[slot]) != NULL)
+        {
+            if (r->path.length() == i && memcmp(r->path.data(), dir, i) == 0)
+            {
+                if (num < max)
+                {
+                    roots[num] = r;
+                    lens[num] = i;
+                }
+                num++;
+                break;
+            }
+            slot = (slot + 1) % EXCLUDE_ROOT_SLOTS;
+        }
+    }
+    return num;
+}
+
+static int __is_exclude_dir(exclude_dir_array *ed, const char *dir, size_t len)
+{
+    exclude_root *stack_roots[EX_MAX_NESTED];
+    size_t stack_lens[EX_MAX_NESTED];
+    exclude_root **roots = stack_roots;
+    size_t *lens = stack_lens;
+    vector<exclude_root *> more_roots;
+    vector<size_t> more_lens;
+    exclude_automaton *a = ed->automaton;
+    size_t pos = 0, start = 0;
+    uint32_t s = 0, n = 0, lit = 0;
+    int num = 0, i = 0;
+
+    num = exclude_roots_of(ed, dir, len, roots, lens, EX_MAX_NESTED);
+    if (num > EX_MAX_NESTED)
+    {
+        //deeply nested roots are rare, look again into buffers that fit.
+        more_roots.resize(num);
+        more_lens.resize(num);
+        roots = &more_roots[0];
+        lens = &more_lens[0];
+        num = exclude_roots_of(ed, dir, len, roots, lens, num);
+        num = min(num, (int)more_roots.size());
+    }
+    for (i = 0; i < num; i++)
+    {
+        if (roots[i]->all)
+        {
+            return FOUND;
+        }
+    }
+
+    //one pass over the part below the outermost root finds every name in it.
+    if (num > 0 && a != NULL)
+    {
+        for (pos = lens[0] + 1; pos < len; pos++)
+        {
+            s = a->delta[s * a->classes + a->byte_class[(unsigned char)dir[pos]]];
+            for (n = a->out[s] != EX_NONE ? s : a->out_link[s]; n != EX_NONE; n = a->out_link[n])
+            {
+                lit = a->out[n];
+                start = pos + 1 - a->lit_len[lit];
+                for (i = 0; i < num; i++)
+                {
+                    if (start > lens[i]
+                        && binary_search(roots[i]->literals.begin(), roots[i]->literals.end(), lit))
+                    {
+                        return FOUND;
+                    }
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < num; i++)
+    {
+        for (vector<edir>::iterator it = roots[i]->regexes.begin(); it != roots[i]->regexes.end(); it++)
+        {
+            int ovector[10];
+            if (pcre_exec(it->re, it->extra, dir, len, 0, 0, ovector, sizeof(ovector) / sizeof(int)) > 0)
+            {
+                return FOUND;
+            }
+        }
+    }
+    return NFOUND;
+}
+
+//-1 if the slot does not hold dir for this generation.
+static int exclude_cache_get(exclude_cache_slot *slot, uint32_t gen, const char *dir, size_t len)
+{
+    uint32_t seq = slot->seq;
+    int excluded = -1;
+
+    __sync_synchronize();
+    if ((seq & 1) == 0 && slot->gen == gen && slot->len == len && memcmp(slot->path, dir, len) == 0)
+    {
+        excluded = slot->excluded;
+    }
+    __sync_synchronize();
+    if (slot->seq != seq)
+    {
+        return -1;
+    }
+    return excluded;
+}
+
+//a slot another thread is writing is left alone.
+static void exclude_cache_put(exclude_cache_slot *slot, uint32_t gen, const char *dir, size_t len, int excluded)
+{
+    uint32_t seq = slot->seq;
+
+    if ((seq & 1) != 0 || !__sync_bool_compare_and_swap(&slot->seq, seq, seq + 1))
+    {
+        return;
+    }
+    slot->gen = gen;
+    slot->len = len;
+    slot->excluded = excluded;
+    memcpy(slot->path, dir, len);
+    __sync_synchronize();
+    slot->seq = seq + 2;
+}
+
+int is_exclude_dir(char *dir , exclude_dir_array *ed)
+{
+    exclude_cache_slot *slot = NULL;
+    uint32_t gen = ed->gen;
+    size_t len = strlen(dir);
+    int found = NFOUND;
+
+    if (gen == 0)
+    {
+        return NFOUND;
+    }
+    __sync_synchronize();
+
+    if (len <= EXCLUDE_CACHE_PATH)
+    {
+        slot = &ed->cache[exclude_hash(dir, len) % EXCLUDE_CACHE_SLOTS];
+        found = exclude_cache_get(slot, gen, dir, len);
+        if (found >= 0)
+        {
+            return found;
+        }
+    }
+
+    found = __is_exclude_dir(ed, dir, len);
+    if (slot != NULL)
+    {
+        exclude_cache_put(slot, gen, dir, len, found);
+    }
+    return found;
+}
+
+int add_sub_exclude_dir(char *dir, char *subdir, exclude_dir_array *ed)
+{
+    int found = NFOUND;
+    string strdir = string(dir, strlen(dir));
+    vector<string> vSubs;
+    vSubs.clear();
+
+    pthread_mutex_lock(&ed->ex_lock);
+    strVectorhashMap::iterator it = ed->sub_dir_map.find(strdir);
+    if (it == ed->sub_dir_map.end())
+    {
+        vector<string> vtmp;
+        vtmp.clear();
+        vtmp.push_back(string(subdir));
+        ed->sub_dir_map.insert(make_pair(strdir, vtmp));
+    }
+    else
+    {
+        vSubs = it->second;
+        for (vector<string>::iterator it_sub = vSubs.begin();
+             it_sub != vSubs.end(); it_sub++)
+        {
+            if (*it_sub == string(subdir))
+            {
+                found = FOUND;
+                break;
+            }
+        }
+        if (found == NFOUND)
+        {
+            it->second.push_back(string(subdir));
+        }
+    }
+    pthread_mutex_unlock(&ed->ex_lock);
+    return 0;
+}
+
+int get_sub_exclude_dir(char *dir, exclude_dir_array *ed, vector<string> &vSubdirs)
 {
     int found = NFOUND;
-    for (vector<edir>::iterator it = ed->vdirs.begin();
-         it != ed->vdirs.end(); it++)
+    string strdir = string(dir, strlen(dir));
+    pthread_mutex_lock(&ed->ex_lock);
+    strVectorhashMap::iterator it = ed->sub_dir_map.find(strdir);
+    if (it != ed->sub_dir_map.end())
+    {
+        found = FOUND;
+        vSubdirs = it->second;
+    }
+    pthread_mutex_unlock(&ed->ex_lock);
+    return found;
+}
+
+/*
+    ignore filters of the roots. they are set up while the config is
+    loaded and never change once published, the readers look them up
+    without a lock. a root whose patterns change gets a new filter, the
+    old one is kept since a reader may still hold it.
+*/
+typedef struct ignore_root
+{
+    string path;
+    name_filter *nf;
+} ignore_root;
+
+static ignore_root g_ignore_roots[MAX_MONITOR_DIRS];
+static int g_ignore_root_num = 0;
+static int g_ignore_filter_num = 0;     //filters ever published
+static name_filter *g_ignore_by_index[MAX_MONITOR_DIRS];
+static pthread_mutex_t g_ignore_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void add_ignore_rule(name_filter *nf, const string &pattern)
+{
+    const char *wild = "*?[";
+    size_t pos = pattern.find_first_of(wild);
+    string literal;
+
+    if (pattern.find('/') != string::npos)
+    {
+        nf->paths.push_back(pattern);
+        return;
+    }
+
+    if (pos == string::npos)
+    {
+        nf->names.push_back(pattern);
+        literal = pattern;
+    }
+    else if (pos == 0 && pattern[0] == '*' && pattern.length() > 1
+             && pattern.find_first_of(wild, 1) == string::npos)
+    {
+        literal = pattern.substr(1);
+        nf->suffixes.push_back(literal);
+    }
+    else if (pos == pattern.length() - 1 && pattern[pos] == '*' && pos > 0)
+    {
+        nf->prefixes.push_back(pattern.substr(0, pos));
+        nf->check_last = 0;
+        return;
+    }
+    else
+    {
+        nf->globs.push_back(pattern);
+        nf->check_last = 0;
+        return;
+    }
+
+    unsigned char c = literal[literal.length() - 1];
+    nf->last[c >> 3] |= 1 << (c & 7);
+}
+
+static int same_filter(name_filter *nf, vector<string> &vIgnores)
+{
+    size_t num = nf->names.size() + nf->suffixes.size() + nf->prefixes.size()
+                 + nf->globs.size() + nf->paths.size();
+    name_filter tmp;
+
+    if (num != vIgnores.size())
+    {
+        return 0;
+    }
+    memset(tmp.last, 0, sizeof(tmp.last));
+    tmp.check_last = 1;
+    for (vector<string>::iterator it = vIgnores.begin(); it != vIgnores.end(); it++)
+    {
+        add_ignore_rule(&tmp, *it);
+    }
+    return tmp.names == nf->names && tmp.suffixes == nf->suffixes
+           && tmp.prefixes == nf->prefixes && tmp.globs == nf->globs
+           && tmp.paths == nf->paths;
+}
+
+/*
+    set the ignore list of a root, index is the root index of
+    libinotifytools or -1. an empty list still registers the root, so a
+    nested root does not inherit the list of the root it lies in.
+*/
+int add_ignore_root(char *root, int index, vector<string> &vIgnores)
+{
+    name_filter *nf = NULL;
+    string path(root, strlen(root));
+    int i = 0;
+
+    if (path.length() > 1 && path[path.length() - 1] == '/')
+    {
+        path.erase(path.length() - 1);
+    }
+
+    pthread_mutex_lock(&g_ignore_lock);
+    for (i = 0; i < g_ignore_root_num; i++)
+    {
+        if (g_ignore_roots[i].path == path)
+        {
+            break;
+        }
+    }
+    if (i == MAX_MONITOR_DIRS)
+    {
+        pthread_mutex_unlock(&g_ignore_lock);
+        debug_sys(LOG_ERR, "too many roots, no ignore list for %s\n", root);
+        return ERROR;
+    }
+
+    if (i < g_ignore_root_num)
+    {
+        nf = g_ignore_roots[i].nf;
+        if ((nf == NULL && vIgnores.empty()) || (nf != NULL && same_filter(nf, vIgnores)))
+        {
+            pthread_mutex_unlock(&g_ignore_lock);
+            return SUCC;
+        }
+    }
+
+    nf = NULL;
+    if (!vIgnores.empty())
+    {
+        nf = new name_filter;
+        memset(nf->last, 0, sizeof(nf->last));
+        nf->check_last = 1;
+        for (vector<string>::iterator it = vIgnores.begin(); it != vIgnores.end(); it++)
+        {
+            add_ignore_rule(nf, *it);
+            debug_sys(LOG_NOTICE, "ignore %s under %s\n", it->c_str(), root);
+        }
+    }
+
+    //the filter is complete before a reader can see it.
+    __sync_synchronize();
+    g_ignore_roots[i].nf = nf;
+    if (nf != NULL)
+    {
+        g_ignore_filter_num++;
+    }
+    if (i == g_ignore_root_num)
+    {
+        g_ignore_roots[i].path = path;
+        __sync_synchronize();
+        g_ignore_root_num++;
+    }
+    if (index >= 0 && index < MAX_MONITOR_DIRS)
+    {
+        g_ignore_by_index[index] = nf;
+    }
+    pthread_mutex_unlock(&g_ignore_lock);
+
+    return SUCC;
+}
+
+//cheap check for the readers, nothing has to be looked up without filters.
+int have_ignore_filters()
+{
+    return g_ignore_filter_num > 0;
+}
+
+//filter of a root by its libinotifytools index.
+name_filter *ignore_filter_of_root(int index)
+{
+    if (index < 0 || index >= MAX_MONITOR_DIRS)
+    {
+        return NULL;
+    }
+    return g_ignore_by_index[index];
+}
+
+//filter of the longest root holding path.
+name_filter *find_ignore_filter(const char *path)
+{
+    int i = 0, num = g_ignore_root_num, best_len = -1;
+    int len = strlen(path);
+    name_filter *nf = NULL;
+
+    for (i = 0; i < num; i++)
+    {
+        ignore_root *r = &g_ignore_roots[i];
+        int rlen = r->path.length();
+        if (rlen > len || rlen <= best_len
+            || strncmp(r->path.c_str(), path, rlen) != 0)
+        {
+            continue;
+        }
+        if (rlen < len && path[rlen] != '/' && path[rlen - 1] != '/')
+        {
+            continue;
+        }
+        nf = r->nf;
+        best_len = rlen;
+    }
+    return nf;
+}
+
+//name is the last component of a path, not an allocated copy.
+int is_ignored_name(name_filter *nf, const char *name)
+{
+    size_t len = 0, i = 0;
+    unsigned char c = 0;
+
+    if (nf == NULL || name[0] == '\0')
+    {
+        return NFOUND;
+    }
+
+    len = strlen(name);
+    c = name[len - 1];
+    if (nf->check_last && (nf->last[c >> 3] & (1 << (c & 7))) == 0)
+    {
+        return NFOUND;
+    }
+
+    for (i = 0; i < nf->names.size(); i++)
+    {
+        if (nf->names[i].length() == len && memcmp(nf->names[i].c_str(), name, len) == 0)
+        {
+            return FOUND;
+        }
+    }
+    for (i = 0; i < nf->suffixes.size(); i++)
+    {
+        size_t slen = nf->suffixes[i].length();
+        if (slen <= len && memcmp(nf->suffixes[i].c_str(), name + len - slen, slen) == 0)
+        {
+            return FOUND;
+        }
+    }
+    for (i = 0; i < nf->prefixes.size(); i++)
+    {
+        size_t plen = nf->prefixes[i].length();
+        if (plen <= len && memcmp(nf->prefixes[i].c_str(), name, plen) == 0)
+        {
+            return FOUND;
+        }
+    }
+    for (i = 0; i < nf->globs.size(); i++)
+    {
+        if (fnmatch(nf->globs[i].c_str(), name, 0) == 0)
+        {
+            return FOUND;
+        }
+    }
+    return NFOUND;
+}
+
+//only the patterns holding a '/', the names are checked by is_ignored_name.
+int is_ignored_path(name_filter *nf, const char *path)
+{
+    if (nf == NULL)
+    {
+        return NFOUND;
+    }
+
+    for (size_t i = 0; i < nf->paths.size(); i++)
+    {
+        if (fnmatch(nf->paths[i].c_str(), path, FNM_PATHNAME) == 0)
+        {
+            return FOUND;
+        }
+    }
+    return NFOUND;
+}
+
+monitor_dirs *alloc_monitor_dirs()
+{
+    monitor_dirs *md = new monitor_dirs;
+    if (md == NULL)
+    {
+        return NULL;
+    }
+
+    md_node root;
+    root.parent = MD_NONE;
+    root.name = MD_NONE;
+    root.child = MD_NONE;
+    root.next = MD_NONE;
+    root.prev = MD_NONE;
+    root.rec = NULL;
+    md->trie.nodes.push_back(root);
+
+    md->md_mum = 0;
+    md->gen = 1;
+    brlock_init(&md->md_lock);
+    md->delta_flush_ms = 0;
+    pthread_mutex_init(&md->delta_lock, NULL);
+    md->delta_bufs.clear();
+    md->lazy_rollup = 0;
+
+    exclude_dir_array *p_ex_dir = &md->ex_dirs;
+    p_ex_dir->pattern_map.clear();
+    p_ex_dir->sub_dir_map.clear();
+    pthread_mutex_init(&p_ex_dir->ex_lock, NULL);
+    p_ex_dir->automaton = NULL;
+    for (int i = 0; i < EXCLUDE_ROOT_SLOTS; i++)
+    {
+        p_ex_dir->roots[i] = NULL;
+    }
+    memset((void *)p_ex_dir->root_lens, 0, sizeof(p_ex_dir->root_lens));
+    p_ex_dir->gen = 0;
+    p_ex_dir->root_num = 0;
+    p_ex_dir->cache = (exclude_cache_slot *)calloc(EXCLUDE_CACHE_SLOTS, sizeof(exclude_cache_slot));
+    if (p_ex_dir->cache == NULL)
+    {
+        free_monitor_dirs(md);
+        return NULL;
+    }
+
+    return md;
+}
+
+void free_monitor_dirs(monitor_dirs *md)
+{
+    if (!md)
+    {
+        return;
+    }
+
+    for (vector<md_node>::iterator it = md->trie.nodes.begin(); it != md->trie.nodes.end(); it++)
+    {
+        my_free(it->rec);
+    }
+    brlock_destroy(&md->md_lock);
+    pthread_mutex_destroy(&md->delta_lock);
+
+    exclude_dir_array *p_ex_dir = &md->ex_dirs;
+    for (int i = 0; i < EXCLUDE_ROOT_SLOTS; i++)
+    {
+        if (p_ex_dir->roots[i] != NULL)
+        {
+            free_exclude_root(p_ex_dir->roots[i], 1);
+        }
+    }
+    for (vector<exclude_root *>::iterator it = p_ex_dir->old_roots.begin();
+         it != p_ex_dir->old_roots.end(); it++)
+    {
+        free_exclude_root(*it, 0);
+    }
+    for (vector<exclude_automaton *>::iterator it = p_ex_dir->old_automata.begin();
+         it != p_ex_dir->old_automata.end(); it++)
+    {
+        delete *it;
+    }
+    delete p_ex_dir->automaton;
+    my_free(p_ex_dir->cache);
+
+    p_ex_dir->pattern_map.clear();
+
+    pthread_mutex_destroy(&p_ex_dir->ex_lock);
+
+    delete md;
+    md = NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+//the trie of the registry, md_lock held by the callers.
+
+static uint64_t edge_key(uint32_t parent, uint32_t name)
+{
+    return ((uint64_t)parent << 32) | name;
+}
+
+static uint32_t intern_name(md_trie *t, const string &name)
+{
+    uint32_t id = 0;
+    unordered_map <string, uint32_t>::iterator it = t->name_ids.find(name);
+
+    if (it != t->name_ids.end())
+    {
+        t->name_refs[it->second]++;
+        return it->second;
+    }
+
+    if (!t->free_names.empty())
+    {
+        id = t->free_names.back();
+        t->free_names.pop_back();
+    }
+    else
+    {
+        id = t->names.size();
+        t->names.push_back(NULL);
+        t->name_refs.push_back(0);
+    }
+    it = t->name_ids.insert(make_pair(name, id)).first;
+    t->names[id] = &it->first;
+    t->name_refs[id] = 1;
+    return id;
+}
+
+static void release_name(md_trie *t, uint32_t id)
+{
+    if (--t->name_refs[id] == 0)
+    {
+        string name = *t->names[id];
+        t->name_ids.erase(name);
+        t->names[id] = NULL;
+        t->free_names.push_back(id);
+    }
+}
+
+static uint32_t trie_child(md_trie *t, uint32_t parent, const string &name)
+{
+    unordered_map <string, uint32_t>::iterator it = t->name_ids.find(name);
+    if (it == t->name_ids.end())
+    {
+        return MD_NONE;
+    }
+
+    unordered_map <uint64_t, uint32_t>::iterator edge = t->edges.find(edge_key(parent, it->second));
+    return edge == t->edges.end() ? MD_NONE : edge->second;
+}
+
+//link node as the first child of parent under the name.
+static void trie_link(md_trie *t, uint32_t id, uint32_t parent, uint32_t name)
+{
+    md_node *node = &t->nodes[id];
+
+    node->parent = parent;
+    node->name = name;
+    node->prev = MD_NONE;
+    node->next = t->nodes[parent].child;
+    if (node->next != MD_NONE)
+    {
+        t->nodes[node->next].prev = id;
+    }
+    t->nodes[parent].child = id;
+    t->edges[edge_key(parent, name)] = id;
+}
+
+static void trie_unlink(md_trie *t, uint32_t id)
+{
+    md_node *node = &t->nodes[id];
+
+    if (node->prev != MD_NONE)
+    {
+        t->nodes[node->prev].next = node->next;
+    }
+    else
+    {
+        t->nodes[node->parent].child = node->next;
+    }
+    if (node->next != MD_NONE)
+    {
+        t->nodes[node->next].prev = node->prev;
+    }
+    t->edges.erase(edge_key(node->parent, node->name));
+    node->parent = MD_NONE;
+    node->next = MD_NONE;
+    node->prev = MD_NONE;
+}
+
+static uint32_t trie_new_node(md_trie *t, uint32_t parent, const string &name)
+{
+    uint32_t id = 0;
+    md_node node;
+
+    node.child = MD_NONE;
+    node.rec = NULL;
+    if (!t->free_nodes.empty())
+    {
+        id = t->free_nodes.back();
+        t->free_nodes.pop_back();
+        t->nodes[id] = node;
+    }
+    else
+    {
+        id = t->nodes.size();
+        t->nodes.push_back(node);
+    }
+    trie_link(t, id, parent, intern_name(t, name));
+    return id;
+}
+
+static void trie_free_node(md_trie *t, uint32_t id)
+{
+    trie_unlink(t, id);
+    release_name(t, t->nodes[id].name);
+    t->nodes[id].name = MD_NONE;
+    t->nodes[id].rec = NULL;
+    t->free_nodes.push_back(id);
+}
+
+//drop id and the nodes above it that lead to nothing monitored any more.
+static void trie_prune(md_trie *t, uint32_t id)
+{
+    while (id != MD_ROOT && id != MD_NONE
+           && t->nodes[id].rec == NULL && t->nodes[id].child == MD_NONE)
+    {
+        uint32_t parent = t->nodes[id].parent;
+        trie_free_node(t, id);
+        id = parent;
+    }
+}
+
+//id and the nodes below it, parents before their children.
+static void trie_subtree(md_trie *t, uint32_t id, vector<uint32_t> &vNodes)
+{
+    vNodes.push_back(id);
+    for (size_t i = vNodes.size() - 1; i < vNodes.size(); i++)
+    {
+        for (uint32_t child = t->nodes[vNodes[i]].child; child != MD_NONE; child = t->nodes[child].next)
+        {
+            vNodes.push_back(child);
+        }
+    }
+}
+
+/*
+    the deepest node on the way to path, whole is set if it is path itself.
+    empty components and a trailing '/' are skipped.
+*/
+static uint32_t trie_walk(md_trie *t, const char *path, int *whole)
+{
+    uint32_t node = MD_ROOT, child = MD_NONE;
+    const char *p = path, *end = NULL;
+    string name;
+
+    *whole = 1;
+    while (1)
+    {
+        while (*p == '/')
+        {
+            p++;
+        }
+        if (*p == '\0')
+        {
+            return node;
+        }
+
+        end = strchr(p, '/');
+        if (end == NULL)
+        {
+            end = p + strlen(p);
+        }
+        name.assign(p, end - p);
+        child = trie_child(t, node, name);
+        if (child == MD_NONE)
+        {
+            *whole = 0;
+            return node;
+        }
+        node = child;
+        p = end;
+    }
+}
+
+static uint32_t trie_find(md_trie *t, const char *path)
+{
+    int whole = 0;
+    uint32_t node = trie_walk(t, path, &whole);
+    return whole ? node : MD_NONE;
+}
+
+//the node of path, created with the nodes above it if missing.
+static uint32_t trie_insert(md_trie *t, const char *path)
+{
+    int whole = 0;
+    uint32_t node = trie_walk(t, path, &whole);
+    const char *p = path, *end = NULL;
+
+    if (whole)
+    {
+        return node;
+    }
+
+    //skip the components that exist.
+    for (uint32_t n = node; n != MD_ROOT; n = t->nodes[n].parent)
+    {
+        while (*p == '/')
+        {
+            p++;
+        }
+        p = strchr(p, '/');
+    }
+    while (1)
+    {
+        while (*p == '/')
+        {
+            p++;
+        }
+        if (*p == '\0')
+        {
+            return node;
+        }
+        end = strchr(p, '/');
+        if (end == NULL)
+        {
+            end = p + strlen(p);
+        }
+        node = trie_new_node(t, node, string(p, end - p));
+        p = end;
+    }
+}
+
+//the full path of a node, built from the names up to the root.
+static string trie_path(md_trie *t, uint32_t id)
+{
+    vector<uint32_t> vUp;
+    string path;
+
+    for (; id != MD_ROOT && id != MD_NONE; id = t->nodes[id].parent)
+    {
+        vUp.push_back(id);
+    }
+    if (vUp.empty())
+    {
+        return string("/");
+    }
+    for (vector<uint32_t>::reverse_iterator it = vUp.rbegin(); it != vUp.rend(); it++)
+    {
+        path += '/';
+        path += *t->names[t->nodes[*it].name];
+    }
+    return path;
+}
+
+//the name a monitored dir was added with.
+static string record_name(monitor_dirs *md, md_record *rec)
+{
+    string name = trie_path(&md->trie, rec->node);
+    if (rec->trailing_slash && rec->node != MD_ROOT)
+    {
+        name += '/';
+    }
+    return name;
+}
+
+static void copy_record(monitor_dirs *md, md_record *rec, monitor_dir *target)
+{
+    memset(target, 0, sizeof(monitor_dir));
+    snprintf(target->dir_name, MAX_PATH, "%s", record_name(md, rec).c_str());
+    target->file_status = rec->file_status;
+    target->directory_level = rec->directory_level;
+    target->is_counter_size = rec->is_counter_size;
+    target->fi = rec->fi;
+}
+
+//"/a/b" and "/a/b/" are the same monitored dir.
+int __find_monitor_dir(monitor_dirs *md, const char *path, md_record **target)
+{
+    uint32_t node = trie_find(&md->trie, path);
+
+    *target = node == MD_NONE ? NULL : md->trie.nodes[node].rec;
+    return *target == NULL ? NFOUND : FOUND;
+}
+
+//the counters take atomic adds, a shared md_lock is enough to update them.
+static void update_fileinfo(fileinfo *target, fileinfo *src, int type)
+{
+    if (type == ADD)
+    {
+        __sync_fetch_and_add(&target->filenm, src->filenm);
+        __sync_fetch_and_add(&target->filesz, src->filesz);
+    }
+    else if (type == DEL)
+    {
+        __sync_fetch_and_sub(&target->filenm, src->filenm);
+        __sync_fetch_and_sub(&target->filesz, src->filesz);
+    }
+}
+
+/*
+    with delta_flush_ms set, a thread adds the deltas of the dirs above a
+    file to its own buffer, and moves them to the shared counters when the
+    buffer is older than delta_flush_ms. a timer flushes the buffers of idle
+    threads. the buffers are keyed by md_record and flushed under md_lock,
+    so del and move flush them all before a record can be freed.
+*/
+typedef unordered_map <md_record *, fileinfo> md_delta_map;
+
+typedef struct md_delta_buf
+{
+    monitor_dirs *md;
+    pthread_mutex_t lock;
+    md_delta_map deltas;
+    uint64_t flushed;
+} md_delta_buf;
+
+static __thread md_delta_buf *t_delta_buf = NULL;
+
+static md_delta_buf *get_delta_buf(monitor_dirs *md)
+{
+    md_delta_buf *buf = t_delta_buf;
+
+    if (buf != NULL && buf->md == md)
+    {
+        return buf;
+    }
+
+    buf = new md_delta_buf;
+    buf->md = md;
+    pthread_mutex_init(&buf->lock, NULL);
+    buf->deltas.clear();
+    buf->flushed = get_mstime();
+
+    pthread_mutex_lock(&md->delta_lock);
+    md->delta_bufs.push_back(buf);
+    pthread_mutex_unlock(&md->delta_lock);
+
+    t_delta_buf = buf;
+    return buf;
+}
+
+//md_lock held.
+static void __flush_delta_buf(md_delta_buf *buf)
+{
+    pthread_mutex_lock(&buf->lock);
+    for (md_delta_map::iterator it = buf->deltas.begin(); it != buf->deltas.end(); it++)
+    {
+        update_fileinfo(&it->first->fi, &it->second, ADD);
+    }
+    buf->deltas.clear();
+    buf->flushed = get_mstime();
+    pthread_mutex_unlock(&buf->lock);
+}
+
+//md_lock held.
+static void __flush_monitor_deltas(monitor_dirs *md)
+{
+    pthread_mutex_lock(&md->delta_lock);
+    for (vector<md_delta_buf *>::iterator it = md->delta_bufs.begin(); it != md->delta_bufs.end(); it++)
+    {
+        __flush_delta_buf(*it);
+    }
+    pthread_mutex_unlock(&md->delta_lock);
+}
+
+void flush_monitor_deltas(monitor_dirs *md)
+{
+    if (md->delta_flush_ms <= 0)
+    {
+        return;
+    }
+
+    brlock_rdlock(&md->md_lock);
+    __flush_monitor_deltas(md);
+    brlock_rdunlock(&md->md_lock);
+}
+
+//add the deltas still in the buffers for dir to fi, md_lock held.
+static void __pending_monitor_delta(monitor_dirs *md, md_record *dir, fileinfo *fi)
+{
+    pthread_mutex_lock(&md->delta_lock);
+    for (vector<md_delta_buf *>::iterator it = md->delta_bufs.begin(); it != md->delta_bufs.end(); it++)
+    {
+        md_delta_buf *buf = *it;
+
+        pthread_mutex_lock(&buf->lock);
+        md_delta_map::iterator found = buf->deltas.find(dir);
+        if (found != buf->deltas.end())
+        {
+            fi->filenm += found->second.filenm;
+            fi->filesz += found->second.filesz;
+        }
+        pthread_mutex_unlock(&buf->lock);
+    }
+    pthread_mutex_unlock(&md->delta_lock);
+}
+
+/*
+    with lazy_rollup a file event updates only the dir owning the file, the
+    nearest monitored one, whatever the depth. the total of a dir is the sum
+    over the monitored dirs below it: summed on demand for one dir, and
+    bottom up in one pass for a snapshot. add, del and move leave the totals
+    of the other dirs as they are, as they do when every dir is updated.
+*/
+static md_record *__node_monitor_parent(monitor_dirs *md, uint32_t node);
+
+//md_lock held, the buffers flushed.
+static void __monitor_subtree_total(monitor_dirs *md, uint32_t node, fileinfo *fi)
+{
+    vector<uint32_t> vNodes;
+
+    memset(fi, 0, sizeof(*fi));
+    trie_subtree(&md->trie, node, vNodes);
+    for (vector<uint32_t>::iterator it = vNodes.begin(); it != vNodes.end(); it++)
+    {
+        md_record *rec = md->trie.nodes[*it].rec;
+        if (rec != NULL)
+        {
+            fi->filenm += rec->fi.filenm;
+            fi->filesz += rec->fi.filesz;
+        }
+    }
+}
+
+//the copy has the counters as they will be after the next flush.
+int find_monitor_dir(monitor_dirs *md, char *path, monitor_dir *target)
+{
+    int ret = NFOUND;
+    md_record *tmp = NULL;
+
+    brlock_rdlock(&md->md_lock);
+    ret = __find_monitor_dir(md, path, &tmp);
+    if (ret == FOUND)
+    {
+        copy_record(md, tmp, target);
+        if (md->lazy_rollup)
+        {
+            if (md->delta_flush_ms > 0)
+            {
+                __flush_monitor_deltas(md);
+            }
+            __monitor_subtree_total(md, tmp->node, &target->fi);
+        }
+        else if (md->delta_flush_ms > 0)
+        {
+            __pending_monitor_delta(md, tmp, &target->fi);
+        }
+    }
+    brlock_rdunlock(&md->md_lock);
+    return ret;
+}
+
+//as find_monitor_dir without the counters, for callers that only want the name, level and type.
+int find_monitor_dir_info(monitor_dirs *md, char *path, monitor_dir *target)
+{
+    int ret = NFOUND;
+    md_record *tmp = NULL;
+
+    brlock_rdlock(&md->md_lock);
+    ret = __find_monitor_dir(md, path, &tmp);
+    if (ret == FOUND)
+    {
+        copy_record(md, tmp, target);
+        memset(&target->fi, 0, sizeof(target->fi));
+    }
+    brlock_rdunlock(&md->md_lock);
+    return ret;
+}
+
+//only path changes, with lazy_rollup the dir above gives the delta back.
+int find_update_monitor_dir(monitor_dirs *md, char *path, fileinfo *delta, int type)
+{
+    int ret = NFOUND;
+    md_record *tmp = NULL, *parent = NULL;
+
+    brlock_rdlock(&md->md_lock);
+    ret = __find_monitor_dir(md, path, &tmp);
+    if (ret == FOUND)
+    {
+        update_fileinfo(&tmp->fi, delta, type);
+        if (md->lazy_rollup && (parent = __node_monitor_parent(md, tmp->node)) != NULL)
+        {
+            update_fileinfo(&parent->fi, delta, type == ADD ? DEL : ADD);
+        }
+    }
+    brlock_rdunlock(&md->md_lock);
+    return ret;
+}
+
+/*
+    every monitored dir caches the nearest monitored dir above it, so the
+    dirs above a file are one lookup and a walk of pointers. adding,
+    deleting or moving a monitored dir bumps the generation of its registry
+    under the write lock, and the cached parents are looked up again when used.
+*/
+#define MAX_PARENT_CHAIN 256
+
+//nearest monitored dir above node, md_lock held.
+static md_record *__node_monitor_parent(monitor_dirs *md, uint32_t node)
+{
+    md_trie *t = &md->trie;
+
+    while (node != MD_ROOT && node != MD_NONE)
     {
-        edir tmped = *it;
-        int ovector[10];
-        int matched = pcre_exec(tmped.re, NULL, dir, strlen(dir), 0, 0, ovector, sizeof(ovector) / sizeof(int));
-        if (matched > 0)
+        node = t->nodes[node].parent;
+        if (t->nodes[node].rec != NULL)
         {
-            found = FOUND;
+            return t->nodes[node].rec;
         }
     }
-
-    return found;
+    return NULL;
 }
 
-int is_exclude_dir(char *dir , exclude_dir_array *ed)
+//nearest monitored dir above path, md_lock held.
+static md_record *__find_monitor_parent(monitor_dirs *md, const char *path)
 {
-    int found = NFOUND;
-    strInthashMap::iterator itmap;
-    string dirstr = string(dir, strlen(dir));
+    int whole = 0;
+    uint32_t node = trie_walk(&md->trie, path, &whole);
 
-    pthread_mutex_lock(&ed->ex_lock);
-    found = is_key_set(ed->ex_dir_map, dirstr);
-    if (found == NFOUND)
+    if (!whole && md->trie.nodes[node].rec != NULL)
     {
-        found = __is_exclude_dir(dir, ed);
-        if (found == FOUND)
-        {
-            add_key_set(ed->ex_dir_map, dirstr);
-        }
+        return md->trie.nodes[node].rec;
     }
-    pthread_mutex_unlock(&ed->ex_lock);
-    return found;
+    return __node_monitor_parent(md, node);
 }
 
-int add_sub_exclude_dir(char *dir, char *subdir, exclude_dir_array *ed)
+//md_lock held, so the generation can not change meanwhile.
+static md_record *monitor_parent(monitor_dirs *md, md_record *dir)
 {
-    int found = NFOUND;
-    string strdir = string(dir, strlen(dir));
-    vector<string> vSubs;
-    vSubs.clear();
+    uint32_t gen = md->gen;
 
-    pthread_mutex_lock(&ed->ex_lock);
-    strVectorhashMap::iterator it = ed->sub_dir_map.find(strdir);
-    if (it == ed->sub_dir_map.end())
+    if (dir->parent_gen != gen)
     {
-        vector<string> vtmp;
-        vtmp.clear();
-        vtmp.push_back(string(subdir));
-        ed->sub_dir_map.insert(make_pair(strdir, vtmp));
+        //readers racing here store the same pointer.
+        dir->parent = __node_monitor_parent(md, dir->node);
+        __sync_synchronize();
+        dir->parent_gen = gen;
     }
-    else
+    return dir->parent;
+}
+
+//the monitored dirs above path, nearest first, only the nearest with lazy_rollup. md_lock held.
+static int __get_monitor_parents(monitor_dirs *md, const char *path, md_record **chain)
+{
+    int num = 0;
+    md_record *dir = __find_monitor_parent(md, path);
+
+    while (dir != NULL && num < MAX_PARENT_CHAIN)
     {
-        vSubs = it->second;
-        for (vector<string>::iterator it_sub = vSubs.begin();
-             it_sub != vSubs.end(); it_sub++)
-        {
-            if (*it_sub == string(subdir))
-            {
-                found = FOUND;
-                break;
-            }
-        }
-        if (found == NFOUND)
+        chain[num++] = dir;
+        if (md->lazy_rollup)
         {
-            it->second.push_back(string(subdir));
+            break;
         }
+        dir = monitor_parent(md, dir);
     }
-    pthread_mutex_unlock(&ed->ex_lock);
-    return 0;
+    return num;
 }
 
-int get_sub_exclude_dir(char *dir, exclude_dir_array *ed, vector<string> &vSubdirs)
+//a record leaving the registry leaves its files to the dir into, write lock held.
+static void __fold_monitor_record(monitor_dirs *md, md_record *rec, md_record *into)
 {
-    int found = NFOUND;
-    string strdir = string(dir, strlen(dir));
-    pthread_mutex_lock(&ed->ex_lock);
-    strVectorhashMap::iterator it = ed->sub_dir_map.find(strdir);
-    if (it != ed->sub_dir_map.end())
+    if (md->lazy_rollup && into != NULL && into != rec)
     {
-        found = FOUND;
-        vSubdirs = it->second;
+        update_fileinfo(&into->fi, &rec->fi, ADD);
     }
-    pthread_mutex_unlock(&ed->ex_lock);
-    return found;
 }
 
-monitor_dirs *alloc_monitor_dirs()
+//owner came from md as it is now, md_lock held or not.
+int monitor_owner_current(monitor_dirs *md, const md_owner *owner)
 {
-    monitor_dirs *md = new monitor_dirs;
-    if (md == NULL)
+    return owner != NULL && owner->rec != NULL && owner->gen == md->gen;
+}
+
+/*
+    the owner of the files in dir. an owner still current is kept as it is,
+    so a reader caching them per watch takes no lock on a hit.
+*/
+int resolve_monitor_owner(monitor_dirs *md, const char *dir, md_owner *owner)
+{
+    int whole = 0;
+    uint32_t node = MD_NONE;
+    md_record *rec = NULL;
+
+    if (monitor_owner_current(md, owner))
     {
-        return NULL;
+        return FOUND;
     }
-    md->md.clear();
-    md->md_mum = 0;
-    pthread_rwlock_init(&md->md_lock, NULL);
 
-    exclude_dir_array *p_ex_dir = &md->ex_dirs;
-    p_ex_dir->vdirs.clear();
-    p_ex_dir->ex_dir_map.clear();
-    p_ex_dir->sub_dir_map.clear();
-    pthread_mutex_init(&p_ex_dir->ex_lock, NULL);
+    brlock_rdlock(&md->md_lock);
+    node = trie_walk(&md->trie, dir, &whole);
+    rec = md->trie.nodes[node].rec;
+    if (rec == NULL)
+    {
+        rec = __node_monitor_parent(md, node);
+    }
 
-    return md;
+    owner->rec = rec;
+    owner->gen = md->gen;
+    owner->is_counter_size = rec != NULL ? rec->is_counter_size : 0;
+    owner->directory_level = rec != NULL ? rec->directory_level : 0;
+    brlock_rdunlock(&md->md_lock);
+
+    return rec != NULL ? FOUND : NFOUND;
 }
 
-void free_monitor_dirs(monitor_dirs *md)
+//update the counters of the dirs in chain, or the buffer of this thread, md_lock held.
+static void __update_monitor_chain(monitor_dirs *md, md_record **chain, int num, fileinfo *delta, int type)
 {
-    if (!md)
+    md_delta_buf *buf = NULL;
+    int due = 0;
+
+    if (num <= 0)
     {
         return;
     }
 
-    md->md.clear();
-    pthread_rwlock_destroy(&md->md_lock);
-
-    exclude_dir_array *p_ex_dir = &md->ex_dirs;
-    for (vector<edir>::iterator it = p_ex_dir->vdirs.begin();
-         it != p_ex_dir->vdirs.end(); it++)
+    if (md->delta_flush_ms <= 0)
     {
-        edir tmped = *it;
-        my_free(tmped.re);
+        for (int i = 0; i < num; i++)
+        {
+            update_fileinfo(&chain[i]->fi, delta, type);
+        }
+        return;
     }
 
-    p_ex_dir->vdirs.clear();
-    p_ex_dir->ex_dir_map.clear();
-
-    pthread_mutex_destroy(&p_ex_dir->ex_lock);
-
-    delete md;
-    md = NULL;
-}
-
-int __find_monitor_dir(monitor_dirs *md, char *path, monitor_dir **target)
-{
-    string strTmp(path, strlen(path));
-    strhashMap::iterator it = md->md.find(strTmp);
-    if (it == md->md.end())
+    buf = get_delta_buf(md);
+    pthread_mutex_lock(&buf->lock);
+    for (int i = 0; i < num; i++)
     {
-        *target = NULL;
-        return NFOUND;
+        fileinfo *fi = &buf->deltas[chain[i]];
+        if (type == ADD)
+        {
+            fi->filenm += delta->filenm;
+            fi->filesz += delta->filesz;
+        }
+        else if (type == DEL)
+        {
+            fi->filenm -= delta->filenm;
+            fi->filesz -= delta->filesz;
+        }
     }
+    due = get_mstime() - buf->flushed >= (uint64_t)md->delta_flush_ms;
+    pthread_mutex_unlock(&buf->lock);
 
-    *target = it->second;
-    if (*target == NULL)
+    if (due)
     {
-        md->md.erase(it);
-        return NFOUND;
+        __flush_delta_buf(buf);
     }
-    return FOUND;
 }
 
-int find_monitor_dir(monitor_dirs *md, char *path, monitor_dir *target)
+//add or take delta on every monitored dir above path.
+int update_monitor_parents(monitor_dirs *md, char *path, fileinfo *delta, int type)
 {
-    int ret = NFOUND;
-    monitor_dir *tmp = NULL;
+    md_record *chain[MAX_PARENT_CHAIN];
+    int num = 0;
 
-    pthread_rwlock_rdlock(&md->md_lock);
-    ret = __find_monitor_dir(md, path, &tmp);
-    if (ret == FOUND)
-    {
-        memcpy(target, tmp, sizeof(monitor_dir));
-    }
-    pthread_rwlock_unlock(&md->md_lock);
-    return ret;
+    brlock_rdlock(&md->md_lock);
+    num = __get_monitor_parents(md, path, chain);
+    __update_monitor_chain(md, chain, num, delta, type);
+    brlock_rdunlock(&md->md_lock);
+
+    return num > 0 ? FOUND : NFOUND;
 }
 
-static void update_fileinfo(fileinfo *target, fileinfo *src, int type)
+//as update_monitor_parents, the chain starts at the owner of the dir of path if it is current.
+int update_monitor_owner(monitor_dirs *md, md_owner *owner, char *path, fileinfo *delta, int type)
 {
-    if (type == ADD)
+    md_record *chain[MAX_PARENT_CHAIN];
+    md_record *dir = NULL;
+    int num = 0;
+
+    brlock_rdlock(&md->md_lock);
+    if (monitor_owner_current(md, owner))
     {
-        target->filenm += src->filenm;
-        target->filesz += src->filesz;
+        for (dir = owner->rec; dir != NULL && num < MAX_PARENT_CHAIN; dir = monitor_parent(md, dir))
+        {
+            chain[num++] = dir;
+            if (md->lazy_rollup)
+            {
+                break;
+            }
+        }
     }
-    else if (type == DEL)
+    else
     {
-        target->filenm -= src->filenm;
-        target->filesz -= src->filesz;
+        num = __get_monitor_parents(md, path, chain);
     }
+    __update_monitor_chain(md, chain, num, delta, type);
+    brlock_rdunlock(&md->md_lock);
+
+    return num > 0 ? FOUND : NFOUND;
 }
 
-int find_update_monitor_dir(monitor_dirs *md, char *path, fileinfo *delta, int type)
+//delta leaves the dirs above from and joins the dirs above to, the dirs above both are left alone.
+int move_monitor_parents(monitor_dirs *md, char *from, char *to, fileinfo *delta)
 {
-    int ret = NFOUND;
-    monitor_dir *tmp = NULL;
+    md_record *vFrom[MAX_PARENT_CHAIN], *vTo[MAX_PARENT_CHAIN];
+    int nfrom = 0, nto = 0;
 
-    pthread_rwlock_wrlock(&md->md_lock);
-    ret = __find_monitor_dir(md, path, &tmp);
-    if (ret == FOUND)
+    brlock_rdlock(&md->md_lock);
+    nfrom = __get_monitor_parents(md, from, vFrom);
+    nto = __get_monitor_parents(md, to, vTo);
+
+    //both chains end at the same root when they share one.
+    while (nfrom > 0 && nto > 0 && vFrom[nfrom - 1] == vTo[nto - 1])
     {
-        update_fileinfo(&tmp->fi, delta, type);
+        nfrom--;
+        nto--;
     }
-    pthread_rwlock_unlock(&md->md_lock);
-    return ret;
+    __update_monitor_chain(md, vFrom, nfrom, delta, DEL);
+    __update_monitor_chain(md, vTo, nto, delta, ADD);
+    brlock_rdunlock(&md->md_lock);
+
+    return (nfrom > 0 || nto > 0) ? FOUND : NFOUND;
 }
 
 static int __find_monitor_file_level(monitor_dirs *md, const char *path, int level)
 {
-    vector<string> vDirs;
-    monitor_dir *tmp = NULL;
-    vDirs.clear();
+    md_record *tmp = NULL;
     int newlevel = 1;
 
     if (level > 0)
@@ -271,15 +1586,10 @@ static int __find_monitor_file_level(monitor_dirs *md, const char *path, int lev
         return level;
     }
 
-    get_all_parent_dir((char *)path, vDirs);
-    for (vector<string>::iterator it = vDirs.begin();
-         it != vDirs.end(); it++)
+    tmp = __find_monitor_parent(md, path);
+    if (tmp != NULL)
     {
-        if (__find_monitor_dir(md, (char *)(*it).c_str(), &tmp) == FOUND)
-        {
-            newlevel = tmp->directory_level - 1; //decrease the level.
-            break;
-        }
+        newlevel = tmp->directory_level - 1; //decrease the level.
     }
 
     return newlevel;
@@ -289,22 +1599,28 @@ int find_monitor_file_level(monitor_dirs *md, const char *path, int level)
 {
     int nlevel = 0;
 
-    pthread_rwlock_rdlock(&md->md_lock);
+    brlock_rdlock(&md->md_lock);
     nlevel = __find_monitor_file_level(md, path, level);
-    pthread_rwlock_unlock(&md->md_lock);
+    brlock_rdunlock(&md->md_lock);
 
     return nlevel;
 }
 
-int find_monitor_file_type(monitor_dirs *md, const char *path)
+int is_monitor_dir(monitor_dirs *md, char *path)
 {
-    int type = 0, found = NFOUND;
-    string save_path(path, strlen(path));
-    monitor_dir dirobj;
-    vector<string> vAllParents;
+    int ret = NFOUND;
+    md_record *tmp = NULL;
+
+    brlock_rdlock(&md->md_lock);
+    ret = __find_monitor_dir(md, path, &tmp);
+    brlock_rdunlock(&md->md_lock);
+    return ret;
+}
 
-    memset(&dirobj, 0, sizeof(dirobj));
-    vAllParents.clear();
+int find_monitor_file_type(monitor_dirs *md, const char *path)
+{
+    int type = 0;
+    md_record *parent = NULL;
 
     if ((NULL == md) || (NULL == path) || (0 == strlen(path)))
     {
@@ -312,20 +1628,15 @@ int find_monitor_file_type(monitor_dirs *md, const char *path)
         return 0;
     }
 
-    get_all_parent_dir((char *)save_path.c_str(), vAllParents);
-    for (vector<string>::iterator it = vAllParents.begin();
-         it != vAllParents.end(); it++)
+    brlock_rdlock(&md->md_lock);
+    parent = __find_monitor_parent(md, path);
+    if (parent != NULL)
     {
-        if (find_monitor_dir(md, (char *)it->c_str(), &dirobj) == FOUND)
-        {
-            debug_sys(LOG_DEBUG, "path:%s, parent path with type:%s\n", save_path.c_str(), (char *)it->c_str());
-            type = dirobj.is_counter_size;
-            found = FOUND;
-            break;
-        }
+        type = parent->is_counter_size;
     }
+    brlock_rdunlock(&md->md_lock);
 
-    if (found == NFOUND)
+    if (parent == NULL)
     {
         debug_sys(LOG_ERR, "Failed to find the parent for %s!, use the default value 0\n", path);
     }
@@ -334,20 +1645,21 @@ int find_monitor_file_type(monitor_dirs *md, const char *path)
 
 int del_monitor_dir(monitor_dirs *md, char *path)
 {
-    monitor_dir *old = NULL;
-    string strTmp(path, strlen(path));
+    md_record *old = NULL;
 
-    pthread_rwlock_wrlock(&md->md_lock);
-    strhashMap::iterator it = md->md.find(strTmp);
-    if (it == md->md.end())
+    brlock_wrlock(&md->md_lock);
+    if (__find_monitor_dir(md, path, &old) != FOUND)
     {
-        pthread_rwlock_unlock(&md->md_lock);
+        brlock_wrunlock(&md->md_lock);
         return ERROR;
     }
-    old = (monitor_dir *)it->second;
-    md->md.erase(it);
+    __flush_monitor_deltas(md);
+    __fold_monitor_record(md, old, __node_monitor_parent(md, old->node));
+    md->trie.nodes[old->node].rec = NULL;
+    trie_prune(&md->trie, old->node);
     md->md_mum--;
-    pthread_rwlock_unlock(&md->md_lock);
+    md->gen++;
+    brlock_wrunlock(&md->md_lock);
 
     my_free(old);
     return SUCC;
@@ -355,40 +1667,239 @@ int del_monitor_dir(monitor_dirs *md, char *path)
 
 int add_monitor_dir(monitor_dirs *md, char *path, int &level, int is_counter_size)
 {
-    monitor_dir *tmp = NULL;
-    monitor_dir *newone = NULL;
+    md_record *tmp = NULL;
+    md_record *newone = NULL;
+    int len = strlen(path);
 
     debug_sys(LOG_NOTICE, "begin to add_monitor_dir for %s\n", path);
 
-    pthread_rwlock_wrlock(&md->md_lock);
+    brlock_wrlock(&md->md_lock);
     if (__find_monitor_dir(md, path, &tmp) == FOUND)
     {
         debug_sys(LOG_NOTICE, "path exist, skip add monitor %s\n", path);
-        pthread_rwlock_unlock(&md->md_lock);
+        brlock_wrunlock(&md->md_lock);
         return FOUND;
     }
 
-    newone = (monitor_dir *)calloc(1, sizeof(monitor_dir));
+    newone = (md_record *)calloc(1, sizeof(md_record));
     if (newone == NULL)
     {
         debug_sys(LOG_ERR, "Allocate memory failed for %s\n", path);
-        pthread_rwlock_unlock(&md->md_lock);
+        brlock_wrunlock(&md->md_lock);
         return ERROR;
     }
 
-    snprintf(newone->dir_name, MAX_PATH, "%s", path);
     newone->directory_level = __find_monitor_file_level(md, path, level);
     newone->file_status = 1;
     newone->is_counter_size = is_counter_size;
-    md->md.insert(make_pair(string(path, strlen(path)), newone));
+    newone->trailing_slash = len > 1 && path[len - 1] == '/';
+    newone->node = trie_insert(&md->trie, path);
+    md->trie.nodes[newone->node].rec = newone;
     md->md_mum++;
-    pthread_rwlock_unlock(&md->md_lock);
+    md->gen++;
+    brlock_wrunlock(&md->md_lock);
 
     level = newone->directory_level;
 
     return SUCC;
 }
 
+//path and the monitored dirs below it.
+int get_monitor_subdirs(monitor_dirs *md, char *path, vector<string> &vDirs)
+{
+    vector<uint32_t> vNodes;
+    uint32_t node = MD_NONE;
+
+    brlock_rdlock(&md->md_lock);
+    node = trie_find(&md->trie, path);
+    if (node != MD_NONE)
+    {
+        trie_subtree(&md->trie, node, vNodes);
+    }
+    for (vector<uint32_t>::iterator it = vNodes.begin(); it != vNodes.end(); it++)
+    {
+        md_record *rec = md->trie.nodes[*it].rec;
+        if (rec != NULL)
+        {
+            vDirs.push_back(record_name(md, rec));
+        }
+    }
+    brlock_rdunlock(&md->md_lock);
+
+    return vDirs.empty() ? NFOUND : FOUND;
+}
+
+//drop the records below node, write lock held.
+static void __drop_monitor_subtree(monitor_dirs *md, uint32_t node)
+{
+    vector<uint32_t> vNodes;
+    md_record *into = __node_monitor_parent(md, node);
+
+    trie_subtree(&md->trie, node, vNodes);
+    for (vector<uint32_t>::iterator it = vNodes.begin(); it != vNodes.end(); it++)
+    {
+        md_record *rec = md->trie.nodes[*it].rec;
+        if (rec != NULL)
+        {
+            __fold_monitor_record(md, rec, into);
+            pthread_mutex_lock(&g_delete_dir_lock);
+            add_key_set(g_delete_dir, record_name(md, rec));
+            pthread_mutex_unlock(&g_delete_dir_lock);
+
+            md->trie.nodes[*it].rec = NULL;
+            my_free(rec);
+            md->md_mum--;
+        }
+    }
+    //children first.
+    for (vector<uint32_t>::reverse_iterator it = vNodes.rbegin(); it != vNodes.rend(); it++)
+    {
+        trie_free_node(&md->trie, *it);
+    }
+}
+
+/*
+    rename path and the monitored dirs below it to newpath, their levels and
+    counters move along. the old names are recorded as deleted for the dump,
+    vNewdirs gets the new names. the subtree is relinked under the node of
+    newpath's parent, nothing below it is copied.
+*/
+int move_monitor_dir(monitor_dirs *md, char *path, char *newpath, vector<string> &vNewdirs)
+{
+    md_trie *t = &md->trie;
+    vector<uint32_t> vNodes;
+    uint32_t from = MD_NONE, to = MD_NONE, parent = MD_NONE, name = MD_NONE;
+    int moved = 0, whole = 0;
+    md_record *old_parent = NULL, *new_parent = NULL;
+    fileinfo total = {0, 0};
+
+    brlock_wrlock(&md->md_lock);
+    __flush_monitor_deltas(md);
+
+    from = trie_find(t, path);
+    if (from == MD_NONE || from == MD_ROOT || trie_find(t, newpath) == MD_ROOT)
+    {
+        brlock_wrunlock(&md->md_lock);
+        return NFOUND;
+    }
+
+    //a dir can not be renamed into itself, nor over a dir above it.
+    to = trie_find(t, newpath);
+    for (uint32_t n = trie_walk(t, newpath, &whole); n != MD_NONE; n = t->nodes[n].parent)
+    {
+        if (n == from)
+        {
+            debug_sys(LOG_ERR, "can not move %s into %s\n", path, newpath);
+            brlock_wrunlock(&md->md_lock);
+            return NFOUND;
+        }
+    }
+    for (uint32_t n = from; to != MD_NONE && n != MD_NONE; n = t->nodes[n].parent)
+    {
+        if (n == to)
+        {
+            debug_sys(LOG_ERR, "can not move %s into %s\n", path, newpath);
+            brlock_wrunlock(&md->md_lock);
+            return NFOUND;
+        }
+    }
+
+    trie_subtree(t, from, vNodes);
+    for (vector<uint32_t>::iterator it = vNodes.begin(); it != vNodes.end(); it++)
+    {
+        md_record *rec = t->nodes[*it].rec;
+        if (rec != NULL)
+        {
+            pthread_mutex_lock(&g_delete_dir_lock);
+            add_key_set(g_delete_dir, record_name(md, rec));
+            pthread_mutex_unlock(&g_delete_dir_lock);
+            moved++;
+        }
+    }
+    if (moved == 0)
+    {
+        brlock_wrunlock(&md->md_lock);
+        return NFOUND;
+    }
+
+    //the caller moves the total between the dirs above, as when they are not lazy.
+    if (md->lazy_rollup)
+    {
+        __monitor_subtree_total(md, from, &total);
+        old_parent = __node_monitor_parent(md, from);
+    }
+
+    //what was monitored at newpath is replaced.
+    if (to != MD_NONE)
+    {
+        parent = t->nodes[to].parent;
+        __drop_monitor_subtree(md, to);
+        trie_prune(t, parent);
+    }
+
+    //take the place of a fresh node at newpath.
+    parent = t->nodes[from].parent;
+    trie_unlink(t, from);
+    release_name(t, t->nodes[from].name);
+    trie_prune(t, parent);
+
+    to = trie_insert(t, newpath);
+    parent = t->nodes[to].parent;
+    name = t->nodes[to].name;
+    t->name_refs[name]++;
+    trie_free_node(t, to);
+    trie_link(t, from, parent, name);
+
+    if (md->lazy_rollup && (new_parent = __node_monitor_parent(md, from)) != old_parent)
+    {
+        if (old_parent != NULL)
+        {
+            update_fileinfo(&old_parent->fi, &total, ADD);
+        }
+        if (new_parent != NULL)
+        {
+            update_fileinfo(&new_parent->fi, &total, DEL);
+        }
+    }
+
+    for (vector<uint32_t>::iterator it = vNodes.begin(); it != vNodes.end(); it++)
+    {
+        md_record *rec = t->nodes[*it].rec;
+        if (rec == NULL)
+        {
+            continue;
+        }
+
+        string name = record_name(md, rec);
+        if (name.length() >= MAX_PATH)
+        {
+            debug_sys(LOG_ERR, "path too long after move, drop %s\n", name.c_str());
+            __fold_monitor_record(md, rec, __node_monitor_parent(md, *it));
+            t->nodes[*it].rec = NULL;
+            my_free(rec);
+            md->md_mum--;
+            continue;
+        }
+
+        pthread_mutex_lock(&g_delete_dir_lock);
+        del_key_set(g_delete_dir, name);
+        pthread_mutex_unlock(&g_delete_dir_lock);
+        vNewdirs.push_back(name);
+    }
+    //drop the nodes the too long names leave empty, deepest first.
+    for (vector<uint32_t>::reverse_iterator it = vNodes.rbegin(); it != vNodes.rend(); it++)
+    {
+        if (t->nodes[*it].name != MD_NONE)
+        {
+            trie_prune(t, *it);
+        }
+    }
+    md->gen++;
+    brlock_wrunlock(&md->md_lock);
+
+    return SUCC;
+}
+
 void print_directory_sort(monitor_dirs *md)
 {
     string debug_string;
@@ -418,17 +1929,41 @@ int del_monitor_dir_inotify(monitor_dirs *md, char *path)
         }
     */
     del_monitor_dir(md, path);
-    inotifytools_remove_watch_by_filename(path);
+    if (g_notify_backend == NOTIFY_INOTIFY)
+    {
+        inotifytools_remove_watch_by_filename(path);
+    }
     return SUCC;
 }
 
 int del_dir_inotify(char *path)
 {
-    inotifytools_remove_filename_prefix(path);
+    if (g_notify_backend == NOTIFY_INOTIFY)
+    {
+        inotifytools_remove_filename_prefix(path);
+    }
     return SUCC;
 }
 
-int add_dir_inotify(monitor_dirs *md, char *path, int level)
+/*
+    the events a watch needs for the counting policy of its root, only a
+    root counting sizes has to see IN_CLOSE_WRITE. when roots of different
+    policies overlap, a dir watched already is asked again with IN_MASK_ADD
+    for the events its watch lacks (widen_watch in libinotifytools), so a
+    watch keeps the union and never loses an event some root still needs.
+*/
+int notify_events(int is_counter_size)
+{
+    int events = g_events | IN_MASK_ADD;
+
+    if (is_counter_size == 0)
+    {
+        events &= ~IN_CLOSE_WRITE;
+    }
+    return events;
+}
+
+int add_dir_inotify(monitor_dirs *md, char *path, int level, int is_counter_size)
 {
     char **exclude_dirs = NULL;
     int ret, size = 0;
@@ -453,7 +1988,7 @@ int add_dir_inotify(monitor_dirs *md, char *path, int level)
             exclude_dirs[i] = strdup((char *)vSubdirs[i].c_str());
         }
     }
-    ret = add_notify_dir(path, g_events, level + 1, exclude_dirs);
+    ret = add_notify_dir(path, notify_events(is_counter_size), level + 1, exclude_dirs);
 
     if (exclude_dirs != NULL)
     {
@@ -479,7 +2014,7 @@ int add_monitor_dir_inotify(monitor_dirs *md, char *path, int level, int is_coun
 
     if (add_monitor_dir(md, path, level, is_counter_size) == SUCC || f == 1)
     {
-        return add_dir_inotify(md, path, level);
+        return add_dir_inotify(md, path, level, is_counter_size);
     }
     return SUCC;
 }
@@ -489,16 +2024,120 @@ static bool cmp_string_length(const monitor_dir &v1, const monitor_dir &v2)
     return strlen(v1.dir_name) > strlen(v2.dir_name);//longest path first.
 }
 
+/*
+    a view of every monitored dir for the dump and the checkers. the read
+    lock is dropped every MD_SNAPSHOT_CHUNK nodes, so add, del and move wait
+    for one chunk at most. if one of them ran meanwhile the walk starts over,
+    the last try keeps the lock to the end.
+*/
+#define MD_SNAPSHOT_CHUNK 1024
+#define MD_SNAPSHOT_TRIES 3
+
+typedef struct md_snap
+{
+    uint32_t node;
+    string name;
+    fileinfo fi;
+    uint32_t file_status;
+    uint8_t directory_level;
+    uint8_t is_counter_size;
+} md_snap;
+
+//the totals of a lazy_rollup snapshot, children before their parents. md_lock held.
+static void __rollup_snapshot(monitor_dirs *md, vector<md_snap> &vSnap)
+{
+    vector<fileinfo> vTotal(md->trie.nodes.size());
+    vector<uint32_t> vNodes;
+
+    for (vector<md_snap>::iterator it = vSnap.begin(); it != vSnap.end(); it++)
+    {
+        vTotal[it->node] = it->fi;
+    }
+    trie_subtree(&md->trie, MD_ROOT, vNodes);
+    for (vector<uint32_t>::reverse_iterator it = vNodes.rbegin(); it != vNodes.rend(); it++)
+    {
+        if (*it != MD_ROOT)
+        {
+            fileinfo *parent = &vTotal[md->trie.nodes[*it].parent];
+            parent->filenm += vTotal[*it].filenm;
+            parent->filesz += vTotal[*it].filesz;
+        }
+    }
+    for (vector<md_snap>::iterator it = vSnap.begin(); it != vSnap.end(); it++)
+    {
+        it->fi = vTotal[it->node];
+    }
+}
+
+static void snapshot_monitor_dirs(monitor_dirs *md, vector<md_snap> &vSnap)
+{
+    md_snap snap;
+
+    for (int tries = 1; ; tries++)
+    {
+        uint32_t gen = 0;
+        size_t i = 0;
+        int changed = 0;
+
+        vSnap.clear();
+        brlock_rdlock(&md->md_lock);
+        __flush_monitor_deltas(md);
+        gen = md->gen;
+        while (i < md->trie.nodes.size())
+        {
+            md_record *rec = md->trie.nodes[i++].rec;
+            if (rec != NULL)
+            {
+                snap.node = rec->node;
+                snap.name = record_name(md, rec);
+                snap.fi = rec->fi;
+                snap.file_status = rec->file_status;
+                snap.directory_level = rec->directory_level;
+                snap.is_counter_size = rec->is_counter_size;
+                vSnap.push_back(snap);
+            }
+
+            if (i % MD_SNAPSHOT_CHUNK == 0 && tries < MD_SNAPSHOT_TRIES)
+            {
+                brlock_rdunlock(&md->md_lock);
+                brlock_rdlock(&md->md_lock);
+                if (md->gen != gen)
+                {
+                    changed = 1;
+                    break;
+                }
+            }
+        }
+        if (!changed && md->lazy_rollup)
+        {
+            __rollup_snapshot(md, vSnap);
+        }
+        brlock_rdunlock(&md->md_lock);
+
+        if (!changed)
+        {
+            return;
+        }
+    }
+}
+
 int sort_monitor_dirs(monitor_dirs *md, vector<monitor_dir> &vDirs)
 {
+    vector<md_snap> vSnap;
+    monitor_dir dirinfo;
+
     vDirs.clear();
-    pthread_rwlock_rdlock(&md->md_lock);
-    for (strhashMap::iterator it = md->md.begin();
-         it != md->md.end(); it++)
+    snapshot_monitor_dirs(md, vSnap);
+    for (vector<md_snap>::iterator it = vSnap.begin(); it != vSnap.end(); it++)
     {
-        vDirs.push_back(*it->second);
+        memset(&dirinfo, 0, sizeof(dirinfo));
+        snprintf(dirinfo.dir_name, MAX_PATH, "%s", it->name.c_str());
+        dirinfo.file_status = it->file_status;
+        dirinfo.directory_level = it->directory_level;
+        dirinfo.is_counter_size = it->is_counter_size;
+        dirinfo.fi = it->fi;
+        vDirs.push_back(dirinfo);
     }
-    pthread_rwlock_unlock(&md->md_lock);
 
     if (vDirs.size() > 0)
     {
@@ -510,14 +2149,18 @@ int sort_monitor_dirs(monitor_dirs *md, vector<monitor_dir> &vDirs)
 //if the dbkeys do not exist in md, add it into deletekeys list.
 void get_delete_keys(monitor_dirs *md, vector<string> &dbkeys, vector<string> &deletekeys)
 {
-    monitor_dir *target = NULL;
+    md_record *target = NULL;
     for (vector<string>::iterator it = dbkeys.begin();
          it != dbkeys.end(); it++)
     {
         int found = NFOUND;
-        pthread_rwlock_rdlock(&md->md_lock);
+        brlock_rdlock(&md->md_lock);
         found = __find_monitor_dir(md, (char *)(*it).c_str(), &target);
-        pthread_rwlock_unlock(&md->md_lock);
+        if (found == FOUND && record_name(md, target) != *it)
+        {
+            found = NFOUND;     //the key of the other spelling, "/a/b" for "/a/b/"
+        }
+        brlock_rdunlock(&md->md_lock);
 
         if (found == NFOUND)
         {
@@ -549,29 +2192,26 @@ void convert_to_param(monitor_dirs *md, vector<txn_param> &params)
     pthread_mutex_unlock(&g_delete_dir_lock);
 
     //convert the value in g_md.
-    pthread_rwlock_rdlock(&md->md_lock);
-    for (strhashMap::iterator it = md->md.begin();
-         it != md->md.end(); it++)
+    vector<md_snap> vSnap;
+    snapshot_monitor_dirs(md, vSnap);
+    for (vector<md_snap>::iterator it = vSnap.begin(); it != vSnap.end(); it++)
     {
-        monitor_dir *target = it->second;
-
         memset(&param, 0, sizeof(txn_param));
         param.should_free = true;
         param.type = INSERT;
-        param.key = strdup(target->dir_name);
-        param.keysize = strlen(target->dir_name);
-        param.value = calloc(1, sizeof(target->fi));
+        param.key = strdup(it->name.c_str());
+        param.keysize = it->name.length();
+        param.value = calloc(1, sizeof(it->fi));
         if (param.value)
         {
-            memcpy(param.value, &target->fi, sizeof(target->fi));
+            memcpy(param.value, &it->fi, sizeof(it->fi));
         }
         else
         {
             continue;
         }
-        param.valuesize = sizeof(target->fi);
+        param.valuesize = sizeof(it->fi);
         add_txn_param(param, params);
     }
-    pthread_rwlock_unlock(&md->md_lock);
 }
 
@@ -10,6 +10,7 @@
 #include "log.h"
 #include "kv.h"
 #include "dump.h"
+#include "bio.h"
 
 #define DEBUG_KEY_FILE "/usr/local/etc/dc_debug"
 
@@ -211,6 +212,7 @@ fileinfo count_dir(char *dir, monitor_dirs *md)
     DIR *top_defer_dir = NULL;
     top_defer_dir = opendir(dir);
     struct dirent *dp = NULL;
+    name_filter *nf = find_ignore_filter(dir);
 
     while (top_defer_dir)
     {
@@ -250,6 +252,10 @@ fileinfo count_dir(char *dir, monitor_dirs *md)
             fi.filenm += fidir.filenm;
             fi.filesz += fidir.filesz;
         }
+        else if (is_ignored_name(nf, dp->d_name) == FOUND || is_ignored_path(nf, buf) == FOUND)
+        {
+            continue;
+        }
         else if (dp->d_type != DT_DIR)
         {
             struct stat64 statbuf;
@@ -307,6 +313,9 @@ int sig_handler_user1(int signo)
     vector<monitor_dir> vdirs;
     vdirs.clear();
 
+    print_notify_stats();
+    print_bio_stats();
+
     monitor_dirs *tmp_md = alloc_monitor_dirs();
     if (tmp_md == NULL)
     {
@@ -99,6 +99,14 @@ void my_usleep(int usec)
     select(0, NULL, NULL, NULL, &interval);
 }
 
+//monotonic clock in milliseconds, only meaningful as a difference.
+uint64_t get_mstime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 //return 1 means ok.
 int make_dir(const char *path, mode_t iFlag)
 {